@@ -7,7 +7,8 @@
 
 This code provides the firmware update loader for an AVR using an XBee version
 2 in API mode. Firmware is in iHex format, with the semicolon at the start of
-each line taken as a command to write the line. Pages are erased as needed
+each line taken as a command to write the line, or in binary records which
+carry as much raw data as fits in the RF payload. Pages are erased as needed
 before writing starts, with lockout bits being used to prevent them being erased
 at later times. If the process needs to be restarted, the microcontroller must
 be reset.
@@ -39,8 +40,54 @@ last line has been written, the RWW section is enabled and a jump to the
 application start occurs. The erase lock bits are reset only when the
 bootloader is restarted.
 
+Binary records are sized by the uploader to fill whole words, and are normally
+aligned so that a number of them fill a page exactly. Each record is checked
+with a CRC-16 (XModem) over the address and data. A record with no data marks
+the end of the image. Binary records are acknowledged with 'B', a status
+character as for the single character responses below, and the record address
+as four hex characters.
+
+Windowed records allow the uploader to send several records before waiting for
+an acknowledgement. Each carries a sequence number as well as its address, and
+is written directly into its page so that records may arrive in any order. The
+words of the page outside the record are filled with 0xFFFF, which leaves any
+data already written unchanged. The response is 'W', a status character, the
+sequence number of the first record not yet received as two hex characters,
+and four hex characters giving a bitmap of the following 16 records with bit 0
+for the record after the first missing one. Only missing records need be sent
+again. A windowed record without data finishes the image, and its sequence
+number must be the number of records in the image. If any are missing the
+response has status 'N' and the bootloader continues. Windowed records should
+not be mixed with iHex lines or binary records in the one upload.
+
+A windowed record with command 'Z' carries a whole page compressed with a
+simple LZSS scheme that only refers back within the page. It is decompressed
+into a page sized RAM buffer and written as for a raw record. Any page may be
+sent either way, so the uploader sends raw records for pages that do not fit
+one compressed record.
+
+The uploader can avoid rewriting pages that have not changed by first asking
+for the CRC-16 (XModem) of each page of Flash. Only pages whose CRC differs from
+that of the new image need be sent, and these are erased as they are written.
+The same query after the transfer verifies what was written. The response is
+'K', the first page as two hex characters, the page size in words as two hex
+characters, then four hex characters for the CRC of each page. Pages beyond the
+application area are not returned. The query clears a partly filled page buffer
+so it must not be used part way through an iHex or binary record upload.
+
+Windowed records may be broadcast to a group of nodes at once. Records received
+as broadcasts are written but not acknowledged, as every node answering would
+flood the network. The uploader then sends 'S' to each node in turn, which
+returns the windowed record acknowledgement without a record, and sends only
+the records each node missed by unicast.
+
 Commands are:
 ; - program an iHex line.
+B - program a binary record: two byte address, data, two byte CRC.
+W - program a windowed record: sequence, two byte address, data, two byte CRC.
+Z - program a compressed page as a windowed record.
+S - return the windowed record acknowledgement.
+Kppnn - return the CRCs of nn pages from page pp, both in hex (up to 14 pages).
 X - erase all Flash in application area (excluding bootloader).
 J - quit the bootloader and jump to application code.
 Mxxxx - dump memory in hex, 16 bytes from the hex address xxxx
@@ -86,6 +133,7 @@ Tested:   ATMega168 at 8MHz internal clock.
 #include <string.h>
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
+#include <util/crc16.h>
 #include "bootloader.h"
 #include <util/delay.h>
 
@@ -105,6 +153,8 @@ static uint8_t nybbleToHex(uint8_t x)
  __attribute__ ((section (".bootloader")));
 static uint8_t isHex(uint8_t hex)
  __attribute__ ((section (".bootloader")));
+static uint16_t decompressPage(uint8_t* source, uint8_t length, uint8_t* page)
+ __attribute__ ((section (".bootloader")));
 messageError parseMessage(uint8_t inputChar, uint8_t *messageState, rxFrameType *message)
  __attribute__ ((section (".bootloader")));
 void sendDataMessageCoordinator(uint8_t *ch, uint8_t messageLength)
@@ -159,6 +209,10 @@ application. If this is not used, the J instruction will provide the jump.*/
     uint8_t writeInProgress = FALSE;    /* writes must finish before starting more */
     uint8_t response[64];
     uint8_t responseLength;
+    uint8_t recordReceived[RECORD_FLAGS];   /* Windowed records received */
+    memset(recordReceived,0,RECORD_FLAGS);
+    uint16_t firstMissing = 0;          /* First windowed record not received */
+    uint8_t pageBuffer[PAGESIZE];       /* Page built from a windowed record */
 
 /*---------------------------------------------------------------------------*/
 /* Main loop. */
@@ -185,6 +239,13 @@ discarded */
 
             uint8_t command = rxMessage.message.rxRequest.data[0];
             responseLength = 1;             /* For 1 character responses */
+            uint8_t* status = response;     /* Result character in the response */
+            uint8_t line[20];               /* line of iHex in binary */
+            uint8_t* data = line;           /* Data to be programmed */
+            uint8_t dataLength = 0;
+            uint16_t byteAddress = 0;       /* Address of the data */
+            uint8_t endOfImage = FALSE;     /* Last record has been received */
+            uint8_t quiet = FALSE;          /* No response to a broadcast */
 /* ---- Erase Command ----- */
 /* This erases each page up to the top of application memory */
             if(command=='X')
@@ -208,7 +269,7 @@ discarded */
                 response[0] = 'Y';           /* Send OK back. */
             }
 
-/* ---- Page Programming ----- */
+/* ---- iHex Line ----- */
 /* iHex start of line. Parse the line into byte valued array. */
 /* Only allow 16 byte lines max. 12 bytes precede data field, then 43 characters
 max. */
@@ -216,7 +277,6 @@ max. */
             {
 /* Convert hex to byte binary and place in a line buffer */
 /* For iHex, line[0] has length, line[1], line[2] has address, line[3] has type */
-                uint8_t line[20];               /* line of iHex in binary */
                 uint8_t hexGood = TRUE;
                 uint8_t checksum = 0;
                 uint8_t dataCount = 0;
@@ -237,89 +297,178 @@ max. */
                     response[0] = 'L';
                 else if(checksum != 0)
                     response[0] = 'C';
+/* Data goes into Flash in whole words, so a line must start on a word. */
+                else if ((line[2] & 1) != 0)
+                    response[0] = 'L';
                 else
                 {
                     response[0] = 'Y';
-/* line[1] and line[2] have the byte address */
-                    uint16_t byteAddress = (line[1] << 8) + line[2];
-/* Fill the page buffer writing the line, with data going in 16 bit words */
-/* TODO deal with odd byte addresses in iHex */
-                    uint8_t indx;
-                    for (indx=4; indx<dataCount-1; indx+=2)
+/* line[1] and line[2] have the byte address, data starts at line[4] */
+                    byteAddress = (line[1] << 8) + line[2];
+                    data = line+4;
+                    dataLength = dataCount-5;
+                    endOfImage = (line[3] == 1);
+                }
+            }
+
+/* ---- Binary Record ----- */
+/* 'B', two byte address, raw data bytes, two byte CRC-16 over the address and
+data. The response is 'B', a status character and the address in hex. */
+            else if (command=='B')
+            {
+                uint8_t* record = rxMessage.message.rxRequest.data;
+                uint8_t recordLength = rxMessage.length-12;
+                byteAddress = (record[1] << 8) + record[2];
+                response[0] = 'B';
+                response[1] = 'Y';
+                for (uint8_t i = 0; i < 4; i++)
+                    response[2+i] = nybbleToHex((byteAddress >> (12-4*i)) & 0x0F);
+                responseLength = 6;
+                status = response+1;
+/* Data must be whole words, so the record length is odd. */
+                if ((recordLength < 5) || ((recordLength & 1) == 0))
+                    response[1] = 'L';
+                else
+                {
+                    uint16_t crc = 0;
+                    for (uint8_t i = 1; i < recordLength-2; i++)
+                        crc = _crc_xmodem_update(crc, record[i]);
+                    if (crc != ((record[recordLength-2] << 8) + record[recordLength-1]))
+                        response[1] = 'C';
+                    else
                     {
-/* If we move outside the application area, bomb out with a NAK */
-                        if((byteAddress >= APP_END) || (byteAddress < APP_START))
+                        data = record+3;
+                        dataLength = recordLength-5;
+/* A record without data marks the end of the image */
+                        endOfImage = (dataLength == 0);
+                    }
+                }
+            }
+
+/* ---- Windowed Record ----- */
+/* 'W' or 'Z', sequence number, two byte address, data bytes, two byte CRC-16
+over all but the command. 'W' data is raw and must lie within a single page. 'Z'
+data is a compressed page and the address is that of the page. The page is
+built in RAM then written immediately. Both are acknowledged with 'W', as is
+the 'S' status query, except that broadcast records are not acknowledged. */
+            else if ((command=='W') || (command=='Z') || (command=='S'))
+            {
+                uint8_t* record = rxMessage.message.rxRequest.data;
+                uint8_t recordLength = rxMessage.length-12;
+                uint8_t sequence = record[1];
+                uint8_t recordBit = (1 << (sequence & 0x07));
+                uint8_t recordIdx = (sequence / 8);
+                byteAddress = (record[2] << 8) + record[3];
+                response[0] = 'W';
+                response[1] = 'Y';
+                status = response+1;
+                quiet = ((rxMessage.message.rxRequest.options & RX_BROADCAST) != 0);
+/* A status query only returns the acknowledgement. */
+                if (command == 'S') {}
+/* Raw data must be whole words, so the record length is even. */
+                else if ((recordLength < 6) || ((command == 'W') && ((recordLength & 1) != 0)))
+                    response[1] = 'L';
+                else
+                {
+                    uint16_t crc = 0;
+                    for (uint8_t i = 1; i < recordLength-2; i++)
+                        crc = _crc_xmodem_update(crc, record[i]);
+                    if (crc != ((record[recordLength-2] << 8) + record[recordLength-1]))
+                        response[1] = 'C';
+/* A record without data finishes the image if all records have arrived. */
+                    else if (recordLength == 6)
+                    {
+                        if (firstMissing < sequence) response[1] = 'N';
+                        else endOfImage = TRUE;
+                    }
+/* Ignore records already written, as the acknowledgement may have been lost. */
+                    else if ((recordReceived[recordIdx] & recordBit) == 0)
+                    {
+                        uint8_t recordDataLength = recordLength-6;
+                        uint16_t recordPage = (byteAddress & ~(PAGESIZE-1));
+                        uint16_t offset = byteAddress - recordPage;
+                        memset(pageBuffer, 0xFF, PAGESIZE);
+                        if ((recordPage < APP_START) || ((recordPage + PAGESIZE) > APP_END))
+                            response[1] = 'N';
+                        else if (command == 'Z')
                         {
-                            response[0] = 'N';
-                            break;
+                            if ((offset != 0) ||
+                                (decompressPage(record+4, recordDataLength, pageBuffer) == 0))
+                                response[1] = 'L';
                         }
-/* If page write in progress, need to wait for previous page write to complete. */
-/* Will not need to wait for page erase */
-                        if (writeInProgress)    
+                        else if ((offset + recordDataLength) > PAGESIZE)
+                            response[1] = 'N';
+                        else memcpy(pageBuffer+offset, record+4, recordDataLength);
+                        if (response[1] == 'Y')
                         {
-                            boot_spm_busy_wait();
-                            writeInProgress = FALSE;
-                        }
-/* Check if we previously hit a page boundary, or are just starting. */
-/* If we are starting a new page, keep its start address for later writing.
-This address must be on a page boundary. if not, pad out the buffer with 0xFFFF
-as these will not cause any changes in the Flash memory contents when written.
-Then erase */
-                        if (programState == pageStart)
-                        {
-                            pageByteAddress = (byteAddress & ~(PAGESIZE-1));
-                            for (uint16_t i=pageByteAddress; i<byteAddress; i+=2)
-                                boot_page_fill(i, 0xFFFF);      /* Padding */
-/* Check if erase is needed and get on with it. Wait for all prior write/erase
-to complete */
+/* Erase the page if this is the first time it has been touched. */
                             uint8_t page = (byteAddress / PAGESIZE);
                             uint8_t pageBit = (1 << (page & 0x07));
                             uint8_t addridx = (page / 8);
+                            boot_spm_busy_wait();
+                            writeInProgress = FALSE;
                             if ((pageEraseLock[addridx] & pageBit) == 0)
                             {
-                                boot_spm_busy_wait();
-                                boot_page_erase(byteAddress);
+                                boot_page_erase(recordPage);
                                 pageEraseLock[addridx] |= pageBit;
+                                boot_spm_busy_wait();
                             }
-                        }
-/* Fill page */
-                        boot_page_fill(byteAddress, (line[indx+1] << 8) + line[indx]);
-                        byteAddress += 2;
-                        programState = pageFilling;
-/* If we hit a page boundary, we need to write the page just filled.
-Also do this if we finish with the last line (record type in line[3] is 1) */
-                        if ((byteAddress % PAGESIZE) == 0)
-                        {
-                            boot_spm_busy_wait();
-                            boot_page_write(pageByteAddress);
+/* Fill the page buffer, where 0xFFFF leaves data already written unchanged. */
+                            for (uint16_t i = 0; i < PAGESIZE; i += 2)
+                                boot_page_fill(recordPage + i,
+                                               (pageBuffer[i+1] << 8) + pageBuffer[i]);
+                            boot_page_write(recordPage);
                             writeInProgress = TRUE;
-                            programState = pageStart;
+                            recordReceived[recordIdx] |= recordBit;
+                            while ((firstMissing < WINDOW_RECORDS) &&
+                                   (recordReceived[firstMissing / 8] & (1 << (firstMissing & 0x07))))
+                                firstMissing++;
                         }
                     }
-                    if (response[0] == 'Y')
-                    {
-/* The line has been written to the page buffer, and possibly a page write
-completed. Check if we have a file end record type, and have not just started
-writing a page. Then we need to write the last part page. */
-                        if ((programState != pageStart) && (line[3] == 1))
-                        {
-                            boot_spm_busy_wait();
-                            boot_page_write(pageByteAddress);
-                            writeInProgress = TRUE;
-                            programState = pageStart;
-                        }
-/* Check for end of file record and jump to application after enabling RWW section */
-                        if (line[3] == 1)
-                        {
-                            response[0] = 'J';
-                            sendDataMessageCoordinator(response,1);
-                            boot_spm_busy_wait();
+                }
+/* Acknowledge with the first missing record and a bitmap of those following. */
+                uint16_t map = 0;
+                for (uint8_t i = 0; i < ACK_MAP_BITS; i++)
+                {
+                    uint16_t next = firstMissing + 1 + i;
+                    if ((next < WINDOW_RECORDS) &&
+                        (recordReceived[next / 8] & (1 << (next & 0x07))))
+                        map |= (1 << i);
+                }
+                response[2] = nybbleToHex((firstMissing >> 4) & 0x0F);
+                response[3] = nybbleToHex(firstMissing & 0x0F);
+                for (uint8_t i = 0; i < 4; i++)
+                    response[4+i] = nybbleToHex((map >> (12-4*i)) & 0x0F);
+                responseLength = 8;
+            }
+
+/* ---- Page CRC Query ----- */
+/* Compute the CRC-16 of each page requested, reading back through the RWW
+section. */
+            else if (command == 'K')
+            {
+                uint8_t* query = rxMessage.message.rxRequest.data;
+                uint8_t firstPage = (hexToNybble(query[1]) << 4) + hexToNybble(query[2]);
+                uint8_t pages = (hexToNybble(query[3]) << 4) + hexToNybble(query[4]);
+                if (pages > PAGE_CRC_MAX) pages = PAGE_CRC_MAX;
 #ifdef RWWSRE
-                            boot_rww_enable();
+                boot_rww_enable_safe();
 #endif
-                            jumpToApp();    /* Jump to Application Reset vector 0x0000 */
-                        }
-                    }
+                response[0] = 'K';
+                response[1] = query[1];
+                response[2] = query[2];
+                response[3] = nybbleToHex(((PAGESIZE/2) >> 4) & 0x0F);
+                response[4] = nybbleToHex((PAGESIZE/2) & 0x0F);
+                responseLength = 5;
+                for (uint8_t page = firstPage; page < firstPage+pages; page++)
+                {
+                    uint16_t address = page*PAGESIZE;
+                    if ((address < APP_START) || (address >= APP_END)) break;
+                    uint16_t crc = 0;
+                    for (uint16_t i = 0; i < PAGESIZE; i++)
+                        crc = _crc_xmodem_update(crc, pgm_read_byte_near(address+i));
+                    for (uint8_t i = 0; i < 4; i++)
+                        response[responseLength++] = nybbleToHex((crc >> (12-4*i)) & 0x0F);
                 }
             }
 
@@ -351,7 +500,90 @@ writing a page. Then we need to write the last part page. */
                 responseLength = 33;
             }
             else response[0] = 'I';         /* invalid command or line */
-            sendDataMessageCoordinator(response,responseLength);
+
+/* ---- Page Programming ----- */
+/* Write data from an iHex line or binary record into the page buffer, with
+data going in 16 bit words. Windowed records have already been written and
+only pass through here to finish the image. */
+            if (((command == ':') || (command == 'B') || (command == 'W') || (command == 'Z'))
+                && (*status == 'Y'))
+            {
+/* An odd trailing byte, as at the end of an odd sized data section, is padded
+with 0xFF in the high byte of its word. */
+                uint8_t indx;
+                for (indx=0; indx<dataLength; indx+=2)
+                {
+/* If we move outside the application area, bomb out with a NAK */
+                    if((byteAddress >= APP_END) || (byteAddress < APP_START))
+                    {
+                        *status = 'N';
+                        break;
+                    }
+/* If page write in progress, need to wait for previous page write to complete. */
+/* Will not need to wait for page erase */
+                    if (writeInProgress)    
+                    {
+                        boot_spm_busy_wait();
+                        writeInProgress = FALSE;
+                    }
+/* Check if we previously hit a page boundary, or are just starting. */
+/* If we are starting a new page, keep its start address for later writing.
+This address must be on a page boundary. if not, pad out the buffer with 0xFFFF
+as these will not cause any changes in the Flash memory contents when written.
+Then erase */
+                    if (programState == pageStart)
+                    {
+                        pageByteAddress = (byteAddress & ~(PAGESIZE-1));
+                        for (uint16_t i=pageByteAddress; i<byteAddress; i+=2)
+                            boot_page_fill(i, 0xFFFF);      /* Padding */
+/* Check if erase is needed and get on with it. Wait for all prior write/erase
+to complete */
+                        uint8_t page = (byteAddress / PAGESIZE);
+                        uint8_t pageBit = (1 << (page & 0x07));
+                        uint8_t addridx = (page / 8);
+                        if ((pageEraseLock[addridx] & pageBit) == 0)
+                        {
+                            boot_spm_busy_wait();
+                            boot_page_erase(byteAddress);
+                            pageEraseLock[addridx] |= pageBit;
+                        }
+                    }
+/* Fill page */
+                    uint8_t upper = (indx+1 < dataLength) ? data[indx+1] : 0xFF;
+                    boot_page_fill(byteAddress, (upper << 8) + data[indx]);
+                    byteAddress += 2;
+                    programState = pageFilling;
+/* If we hit a page boundary, we need to write the page just filled. */
+                    if ((byteAddress % PAGESIZE) == 0)
+                    {
+                        boot_spm_busy_wait();
+                        boot_page_write(pageByteAddress);
+                        writeInProgress = TRUE;
+                        programState = pageStart;
+                    }
+                }
+/* The data has been written to the page buffer, and possibly a page write
+completed. At the end of the image, write any part page that is left, enable
+the RWW section and jump to the application. */
+                if ((*status == 'Y') && endOfImage)
+                {
+                    if (programState != pageStart)
+                    {
+                        boot_spm_busy_wait();
+                        boot_page_write(pageByteAddress);
+                        writeInProgress = TRUE;
+                        programState = pageStart;
+                    }
+                    *status = 'J';
+                    sendDataMessageCoordinator(response,responseLength);
+                    boot_spm_busy_wait();
+#ifdef RWWSRE
+                    boot_rww_enable();
+#endif
+                    jumpToApp();    /* Jump to Application Reset vector 0x0000 */
+                }
+            }
+            if (! quiet) sendDataMessageCoordinator(response,responseLength);
         }
     }
 }
@@ -475,6 +707,57 @@ uint8_t isHex(uint8_t hex)
     return (((hex - '0') <= 9) || ((hex - 'A') <= 5));
 }
 /*-----------------------------------------------------------------------------*/
+/* Decompress a page of LZSS data
+
+Each control byte gives the type of the next eight items, least significant bit
+first. A one is a literal byte. A zero is a match of two bytes, the distance
+back less one then the length less three, copied from data already in the page.
+The page must be filled with 0xFF beforehand as trailing 0xFF are not sent.
+
+@parameter uint8_t *source: compressed data
+@parameter uint8_t length: length of the compressed data
+@parameter uint8_t *page: page buffer to fill
+@returns uint16_t: number of bytes in the page, or zero if the data is bad
+*/
+
+uint16_t decompressPage(uint8_t* source, uint8_t length, uint8_t* page)
+{
+    uint16_t out = 0;
+    uint8_t in = 0;
+    uint8_t flags = 0;
+    uint8_t items = 0;
+    while (in < length)
+    {
+        if (items == 0)
+        {
+            flags = source[in++];
+            items = 8;
+        }
+        else if (flags & 1)
+        {
+            if (out >= PAGESIZE) return 0;
+            page[out++] = source[in++];
+            flags >>= 1;
+            items--;
+        }
+        else
+        {
+            if ((in + 1) >= length) return 0;
+            uint16_t distance = source[in++] + 1;
+            uint16_t count = source[in++] + 3;
+            if ((distance > out) || ((out + count) > PAGESIZE)) return 0;
+            while (count-- > 0)
+            {
+                page[out] = page[out-distance];
+                out++;
+            }
+            flags >>= 1;
+            items--;
+        }
+    }
+    return out;
+}
+/*-----------------------------------------------------------------------------*/
 /* Initialise the UART, setting baudrate, Rx/Tx enables, and flow controls
 
 Baud rate is derived from the header call to setbaud.h.
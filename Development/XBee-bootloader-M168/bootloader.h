@@ -38,10 +38,12 @@ Tested:     ATMega168 at 8MHz internal clock.
 #define TRUE 1
 #define FALSE 0
 
-/* Xbee parameters */
-#define RF_PAYLOAD          63
+/* Xbee parameters. ZigBee unicast without encryption allows 84 bytes */
+#define RF_PAYLOAD          84
 /* XBee Frame Types */
 #define DATA_RX             0x90
+/* Receive options bit set for a broadcast packet */
+#define RX_BROADCAST        0x02
 #define DATA_TX             0x10
 #define TRANSMIT_STATUS     0X8B
 #define MODEM_STATUS        0x8A
@@ -125,6 +127,14 @@ typedef struct
     } message;
 } txFrameType;
 
+/* Windowed records carry an 8 bit sequence number. The acknowledgement gives the
+first missing record and a bitmap of those following it. */
+#define WINDOW_RECORDS      256
+#define RECORD_FLAGS        (WINDOW_RECORDS/8)
+#define ACK_MAP_BITS        16
+/* Page CRCs returned in one response, limited by the response buffer */
+#define PAGE_CRC_MAX        14
+
 typedef enum {ready, inprogress, checksum, statemachine} messageError;
 typedef enum {pageStart, pageFilling, pageErasing, pageWriting} pState;
 
@@ -0,0 +1,674 @@
+/**
+@mainpage AVR/XBee Bootloader for the ATTiny841
+@version 0.0.0
+@author Ken Sarkies (www.jiggerjuice.info)
+@brief Size optimised bootloader for an ATTiny841 with an XBee
+
+This code provides the firmware update loader for the ATTiny441/841 watermeter
+board using an XBee version 2 in API mode. It takes only the windowed binary
+records of the ATMega168 bootloader (see XBee-bootloader-M168), so it works
+with the binary uploads of the GUI and of acqcontrol.
+
+The ATTiny841 has no bootload section and no fuse to move the reset vector, so
+the bootloader sits at the top of Flash (BASEADDR) and the reset vector always
+jumps to it. When the block holding the application vector table is written,
+the application reset vector is replaced by a jump to the bootloader and its
+target kept. The block below the bootloader holds the trampoline, a relative
+jump to that target. The trampoline is erased when the first record of an upload
+is written and only written again once every record has arrived, so a node left
+with a partial image stays in the bootloader after a reset. The application
+interrupt vectors are left in place and need no redirection.
+
+On reset the bootloader jumps to the application through the trampoline unless
+the bootloader pin is low or there is no trampoline.
+
+There is no hardware flow control on this board and the CPU is halted while
+Flash is written, so characters arriving at that time would be lost. Records
+are therefore checked and held in RAM as they arrive and only written once the
+serial line has been quiet for IDLE_TIME, or once the buffers are full as any
+further records would be dropped anyway. A single acknowledgement then covers
+all the records written. It has the form of the windowed record response of the
+ATMega168 bootloader followed by the number of records that can be held, as
+two hex characters, so that the uploader can limit its window. Records lost
+while the buffers are written show up as missing and are sent again.
+
+Flash is erased four pages at a time, so records are written in blocks of four
+pages. The block CRC query reports the block as the page size, which leads the
+uploader to send records of a whole block. The CRC of the block holding the
+vector table is computed with the application reset vector in place, so that it
+matches the image.
+
+Commands are:
+W - program a windowed record: sequence, two byte address, data, two byte CRC.
+Z - program a compressed block as a windowed record.
+S - return the windowed record acknowledgement.
+Kppnn - return the CRCs of nn blocks from block pp, both in hex (up to 8).
+Q - quit the bootloader and jump to application code if it is complete.
+
+Responses are 'W' and 'K' as above, 'I' for an invalid command, or 'N' to 'Q'
+if there is no application. Windowed record status characters are:
+'Y' command completed successfully
+'N' record outside the application area or without an application reset vector
+'L' invalid record length or compressed data
+'C' invalid CRC
+'J' jump to application occurred
+
+Records received as broadcasts are written but not acknowledged.
+
+@note
+Software: AVR-GCC 4.8.2
+@note
+Target:   ATTiny441/841
+@note
+Tested:   Simulator only (see simulator/).
+ */
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies (www.jiggerjuice.info)               *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include <string.h>
+#include "bootloader.h"
+#ifndef SIMULATOR
+#include <avr/boot.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include <util/delay.h>
+#endif
+
+/* Prototypes */
+
+static messageError parseMessage(uint8_t inputChar, uint8_t *messageState,
+                                 rxFrameType *message);
+static void sendDataMessageCoordinator(uint8_t *ch, uint8_t messageLength);
+static uint8_t decompressBlock(uint8_t* source, uint8_t length, uint8_t* block);
+static uint16_t trampolineTarget(void);
+static uint16_t rjmpTarget(uint16_t from, uint16_t opcode);
+static uint8_t hexToNybble(uint8_t hex);
+static uint8_t nybbleToHex(uint8_t x);
+
+/**********************************************************************
+	Start of Main Program
+*/
+
+/* No C runtime startup is linked, so main is placed at the start of the
+bootloader and the zero register cleared here. No global variables are used. */
+#ifndef SIMULATOR
+int main(void) __attribute__ ((OS_main, section (".init9")));
+
+/* Reset vector, a jump to the bootloader, programmed along with it. It is
+replaced in each application image as that block is written. */
+asm (".section .reset,\"ax\",@progbits\n"
+     "    rjmp main\n"
+     ".previous\n");
+#endif
+
+int main(void)
+{
+#ifndef SIMULATOR
+    asm volatile ("clr __zero_reg__");
+    MCUSR = 0;
+    wdt_disable();
+#endif
+    initxbee();
+/* Word address of the application reset handler, kept from the trampoline or
+from the vector table of the image being uploaded. */
+    uint16_t appReset = trampolineTarget();
+    if ((! progPinActive()) && (appReset != NO_APP)) jumpToApplication();
+
+    uartInit();
+    setXbeeWake();
+    rxFrameType rxMessage;
+    recordBuffer buffer[RECORD_BUFFERS];
+    uint8_t buffered = 0;               /* Records waiting to be written */
+    uint8_t recordReceived[RECORD_FLAGS];
+    memset(recordReceived,0,RECORD_FLAGS);
+    uint8_t blockWritten[BLOCK_FLAGS];  /* Blocks written in this upload */
+    memset(blockWritten,0,BLOCK_FLAGS);
+    uint16_t firstMissing = 0;          /* First windowed record not received */
+    uint8_t ackStatus = 0;              /* Status of an acknowledgement due, or 0 */
+    uint8_t trampolineErased = FALSE;
+    uint8_t messageState = 0;
+    uint8_t response[5+4*PAGE_CRC_MAX];
+    uint8_t responseLength;
+
+/*---------------------------------------------------------------------------*/
+/* Main loop. */
+    for(;;)
+    {
+        uint16_t inputChar = getch();
+        uint8_t command = 0;
+        uint8_t* record = rxMessage.message.rxRequest.data;
+        uint8_t recordLength = 0;
+/* ---- Message receive ----- */
+/* Build a message from each character. Windowed records are only checked and
+buffered here, leaving everything else until the line is quiet. A partial
+message is abandoned when the line goes quiet. */
+        if (inputChar != NO_DATA)
+        {
+            if (parseMessage(low(inputChar), &messageState, &rxMessage) != ready)
+                continue;
+            if (rxMessage.frameType != DATA_RX) continue;
+            command = record[0];
+            recordLength = rxMessage.length-12;
+        }
+        else messageState = 0;
+
+/* ---- Windowed Record ----- */
+/* 'W' or 'Z', sequence number, two byte address, data bytes, two byte CRC-16
+over all but the command. 'W' data is raw and must lie within a single block.
+'Z' data is a compressed block and the address is that of the block. */
+        if (((command == 'W') || (command == 'Z')) && (recordLength != 6))
+        {
+            uint8_t status = 'Y';
+            uint8_t sequence = record[1];
+            uint8_t recordBit = (1 << (sequence & 0x07));
+            uint8_t recordIdx = (sequence / 8);
+            uint16_t address = (record[2] << 8) + record[3];
+            uint16_t blockAddress = (address & ~(BLOCKSIZE-1));
+            uint8_t offset = address - blockAddress;
+            uint8_t dataLength = recordLength-6;
+            recordBuffer* slot = &buffer[buffered];
+            uint16_t crc = 0;
+            for (uint8_t i = 1; i < recordLength-2; i++)
+                crc = crcUpdate(crc, record[i]);
+            if ((recordLength < 6) || ((command == 'W') && ((recordLength & 1) != 0)))
+                status = 'L';
+            else if (crc != ((record[recordLength-2] << 8) + record[recordLength-1]))
+                status = 'C';
+/* Ignore records already received, as the acknowledgement may have been lost,
+and drop records that cannot be held so that they are sent again. */
+            else if ((recordReceived[recordIdx] & recordBit) ||
+                     (buffered >= RECORD_BUFFERS));
+            else if ((blockAddress + BLOCKSIZE) > TRAMPOLINE)
+                status = 'N';
+            else
+            {
+                memset(slot->data, 0xFF, BLOCKSIZE);
+                slot->address = blockAddress;
+                slot->offset = offset;
+                slot->length = dataLength;
+                if (command == 'Z')
+                {
+                    slot->length = BLOCKSIZE;
+                    if ((offset != 0) ||
+                        (decompressBlock(record+4, dataLength, slot->data) == 0))
+                        status = 'L';
+                }
+                else if ((offset + dataLength) > BLOCKSIZE) status = 'N';
+                else memcpy(slot->data+offset, record+4, dataLength);
+/* The application reset vector must be a relative jump. */
+                if ((status == 'Y') && (blockAddress == 0) && (offset == 0) &&
+                    ((((slot->data[1] << 8) + slot->data[0]) & ~RJMP_MASK) != RJMP))
+                    status = 'N';
+                if (status == 'Y')
+                {
+                    buffered++;
+                    recordReceived[recordIdx] |= recordBit;
+                    while ((firstMissing < WINDOW_RECORDS) &&
+                           (recordReceived[firstMissing / 8] & (1 << (firstMissing & 0x07))))
+                        firstMissing++;
+                }
+            }
+/* Broadcast records are never acknowledged. An error takes precedence. */
+            if ((rxMessage.message.rxRequest.options & RX_BROADCAST) == 0)
+            {
+                if ((ackStatus == 0) || (ackStatus == 'Y')) ackStatus = status;
+            }
+            if (buffered < RECORD_BUFFERS) continue;
+            command = 0;
+        }
+
+/* ---- Block Programming ----- */
+/* The line is quiet, the buffers are full or a command needs the records written
+first. Erase the
+trampoline before the first block is written. Parts of a block not carried by
+the record are kept if the block was already written in this upload. The
+application reset vector is kept and replaced by a jump to the bootloader. */
+        for (uint8_t i = 0; i < buffered; i++)
+        {
+            recordBuffer* slot = &buffer[i];
+            uint8_t block = (slot->address / BLOCKSIZE);
+            uint8_t blockBit = (1 << (block & 0x07));
+            uint8_t blockIdx = (block / 8);
+            if (! trampolineErased)
+            {
+                flashEraseBlock(TRAMPOLINE);
+                trampolineErased = TRUE;
+            }
+            if (blockWritten[blockIdx] & blockBit)
+            {
+                for (uint8_t j = 0; j < BLOCKSIZE; j++)
+                {
+                    if ((j < slot->offset) || (j >= slot->offset+slot->length))
+                        slot->data[j] = flashReadByte(slot->address+j);
+                }
+            }
+            if (slot->address == 0)
+            {
+                if (slot->offset == 0)
+                    appReset = rjmpTarget(0, (slot->data[1] << 8) + slot->data[0]);
+                slot->data[0] = low(BOOT_VECTOR);
+                slot->data[1] = high(BOOT_VECTOR);
+            }
+            flashEraseBlock(slot->address);
+            for (uint8_t page = 0; page < ERASE_PAGES; page++)
+                flashWritePage(slot->address + page*PAGESIZE, slot->data + page*PAGESIZE);
+            blockWritten[blockIdx] |= blockBit;
+/* Characters may have been lost, so wait for the start of the next frame */
+            messageState = 0;
+        }
+        buffered = 0;
+
+/* ---- Finish Image ----- */
+/* A windowed record without data finishes the image if all records have
+arrived. The trampoline is written and the application started. */
+        if ((command == 'W') && (recordLength == 6))
+        {
+            uint16_t crc = 0;
+            for (uint8_t i = 1; i < 4; i++)
+                crc = crcUpdate(crc, record[i]);
+            if (crc != ((record[4] << 8) + record[5])) ackStatus = 'C';
+            else if ((firstMissing < record[1]) || (appReset == NO_APP))
+                ackStatus = 'N';
+            else
+            {
+                uint16_t jump = RJMP | ((appReset - (TRAMPOLINE/2) - 1) & RJMP_MASK);
+                memset(buffer[0].data, 0xFF, PAGESIZE);
+                buffer[0].data[0] = low(jump);
+                buffer[0].data[1] = high(jump);
+                flashEraseBlock(TRAMPOLINE);
+                flashWritePage(TRAMPOLINE, buffer[0].data);
+                ackStatus = 'J';
+            }
+        }
+
+/* ---- Status Query ----- */
+        else if (command == 'S')
+        {
+            if (ackStatus == 0) ackStatus = 'Y';
+        }
+
+/* ---- Block CRC Query ----- */
+/* Compute the CRC-16 of each block requested, with the application reset
+vector in place of the jump to the bootloader. */
+        else if (command == 'K')
+        {
+            uint8_t firstBlock = (hexToNybble(record[1]) << 4) + hexToNybble(record[2]);
+            uint8_t blocks = (hexToNybble(record[3]) << 4) + hexToNybble(record[4]);
+            if (blocks > PAGE_CRC_MAX) blocks = PAGE_CRC_MAX;
+            response[0] = 'K';
+            response[1] = record[1];
+            response[2] = record[2];
+            response[3] = nybbleToHex(((BLOCKSIZE/2) >> 4) & 0x0F);
+            response[4] = nybbleToHex((BLOCKSIZE/2) & 0x0F);
+            responseLength = 5;
+            for (uint8_t block = firstBlock; block < firstBlock+blocks; block++)
+            {
+                uint16_t address = block*BLOCKSIZE;
+                if (address >= TRAMPOLINE) break;
+                uint16_t crc = 0;
+                for (uint8_t i = 0; i < BLOCKSIZE; i++)
+                {
+                    uint8_t data = flashReadByte(address+i);
+                    if ((address == 0) && (i < 2) && (appReset != NO_APP))
+                    {
+                        uint16_t vector = RJMP | ((appReset - 1) & RJMP_MASK);
+                        data = (i == 0) ? low(vector) : high(vector);
+                    }
+                    crc = crcUpdate(crc, data);
+                }
+                for (uint8_t i = 0; i < 4; i++)
+                    response[responseLength++] = nybbleToHex((crc >> (12-4*i)) & 0x0F);
+            }
+            sendDataMessageCoordinator(response,responseLength);
+        }
+
+/* ---- Exit bootloader ----- */
+        else if (command == 'Q')
+        {
+            if (trampolineTarget() == NO_APP)
+            {
+                response[0] = 'N';
+                sendDataMessageCoordinator(response,1);
+            }
+            else jumpToApplication();
+        }
+        else if (command != 0)
+        {
+            response[0] = 'I';
+            sendDataMessageCoordinator(response,1);
+        }
+
+/* ---- Acknowledgement ----- */
+/* Acknowledge with the first missing record, a bitmap of those following, and
+the number of records that can be held. */
+        if (ackStatus != 0)
+        {
+            uint16_t map = 0;
+            for (uint8_t i = 0; i < ACK_MAP_BITS; i++)
+            {
+                uint16_t next = firstMissing + 1 + i;
+                if ((next < WINDOW_RECORDS) &&
+                    (recordReceived[next / 8] & (1 << (next & 0x07))))
+                    map |= (1 << i);
+            }
+            response[0] = 'W';
+            response[1] = ackStatus;
+            response[2] = nybbleToHex((firstMissing >> 4) & 0x0F);
+            response[3] = nybbleToHex(firstMissing & 0x0F);
+            for (uint8_t i = 0; i < 4; i++)
+                response[4+i] = nybbleToHex((map >> (12-4*i)) & 0x0F);
+            response[8] = nybbleToHex((RECORD_BUFFERS >> 4) & 0x0F);
+            response[9] = nybbleToHex(RECORD_BUFFERS & 0x0F);
+            sendDataMessageCoordinator(response,10);
+            if (ackStatus == 'J') jumpToApplication();
+            ackStatus = 0;
+        }
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Create and send an outgoing XBee message data frame to the coordinator
+
+The address field is set to that of the coordinator (all zeros 64 bit address,
+unknown 16 bit address). The frame ID is zero so that no transmit status is
+returned to take up time on the serial line.
+
+@parameter uint8_t ch: character string to send
+@parameter uint8_t messageLength: length of the string
+*/
+
+void sendDataMessageCoordinator(uint8_t* ch, uint8_t messageLength)
+{
+    uint8_t length = messageLength+14;
+    sendch(0x7E);                       /* Start sending frame */
+    sendch(0);
+    sendch(length);
+    sendch(DATA_TX);
+    uint8_t checksum = DATA_TX;
+/* Frame ID, 64 bit address, 16 bit address, radius and options */
+    for (uint8_t idx=0; idx<13; idx++)
+    {
+        uint8_t header = ((idx == 9) || (idx == 10)) ? 0xFF : 0x00;
+        if (idx == 10) header = 0xFE;
+        sendch(header);
+        checksum += header;
+    }
+    for (uint8_t i=0; i<messageLength; i++)
+    {
+        sendch(ch[i]);
+        checksum += ch[i];
+    }
+    sendch(0xFF-checksum);
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Parse an incoming XBee message frame
+
+The message is an XBee data frame. This builds the message structure and tests for
+error conditions. The state variable must be set to zero on first entry. It
+resets to zero after a message has been received. Messages too long for the
+structure are dropped.
+
+@parameter uint8_t ch: the received character
+@parameter uint8_t *messageState: state variable for the message, changed and returned
+@parameter rxFrameType *message: structure containing the received message
+@returns ready if the message was received correctly, inprogress if still working,
+         otherwise error state
+*/
+
+messageError parseMessage(const uint8_t inputChar, uint8_t *messageState, rxFrameType *message)
+{
+/* Two byte length */
+    if (*messageState == 1) message->length = (inputChar << 8);
+    else if (*messageState == 2)
+    {
+        message->length += inputChar;
+        if (message->length > sizeof(message->message.array)+1)
+        {
+            *messageState = 0;
+            return statemachine;
+        }
+    }
+/* Frame type */
+    else if (*messageState == 3)
+    {
+        message->frameType = inputChar;
+        message->checksum = inputChar;
+    }
+/* Rest of message, may include addresses or just data depending on frame type */
+    else if (*messageState >3)
+    {
+        if (message->length + 3 > *messageState)
+        {
+            message->message.array[*messageState-4] = inputChar;
+            message->checksum += inputChar;
+        }
+/* Checksum is the last character */
+        else
+        {
+            *messageState = 0;
+            if (((message->checksum + inputChar + 1) & 0xFF) > 0) return checksum;
+            else return ready;
+        }
+    }
+/* Only messageState == 0 left, don't advance until Sync character found */
+    if (!((*messageState == 0) && (inputChar != 0x7E))) (*messageState)++;
+    return inprogress;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Decompress a block of LZSS data
+
+Each control byte gives the type of the next eight items, least significant bit
+first. A one is a literal byte. A zero is a match of two bytes, the distance
+back less one then the length less three, copied from data already in the block.
+The block must be filled with 0xFF beforehand as trailing 0xFF are not sent.
+
+@parameter uint8_t *source: compressed data
+@parameter uint8_t length: length of the compressed data
+@parameter uint8_t *block: block buffer to fill
+@returns uint8_t: number of bytes in the block, or zero if the data is bad
+*/
+
+uint8_t decompressBlock(uint8_t* source, uint8_t length, uint8_t* block)
+{
+    uint8_t out = 0;
+    uint8_t in = 0;
+    uint8_t flags = 0;
+    uint8_t items = 0;
+    while (in < length)
+    {
+        if (items == 0)
+        {
+            flags = source[in++];
+            items = 8;
+            continue;
+        }
+        if (flags & 1)
+        {
+            if (out >= BLOCKSIZE) return 0;
+            block[out++] = source[in++];
+        }
+        else
+        {
+            if ((in + 1) >= length) return 0;
+            uint16_t distance = source[in++] + 1;
+            uint16_t count = source[in++] + 3;
+            if ((distance > out) || ((out + count) > BLOCKSIZE)) return 0;
+            while (count-- > 0)
+            {
+                block[out] = block[out-distance];
+                out++;
+            }
+        }
+        flags >>= 1;
+        items--;
+    }
+    return out;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Find the application reset handler from the trampoline
+
+@returns uint16_t: word address of the application reset handler, or NO_APP if
+         there is no trampoline.
+*/
+
+uint16_t trampolineTarget(void)
+{
+    uint16_t opcode = (flashReadByte(TRAMPOLINE+1) << 8) + flashReadByte(TRAMPOLINE);
+    if ((opcode & ~RJMP_MASK) != RJMP) return NO_APP;
+    return rjmpTarget(TRAMPOLINE/2, opcode);
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Find the target of a relative jump, wrapping around 8K of Flash
+
+@parameter uint16_t from: word address of the jump
+@parameter uint16_t opcode: rjmp instruction
+@returns uint16_t: word address jumped to
+*/
+
+uint16_t rjmpTarget(uint16_t from, uint16_t opcode)
+{
+    return ((from + 1 + opcode) & RJMP_MASK);
+}
+
+/*-----------------------------------------------------------------------------*/
+uint8_t hexToNybble(uint8_t hex)
+{
+    return (hex - ((hex > '9') ? ('A'-10) : '0'));
+}
+/*-----------------------------------------------------------------------------*/
+uint8_t nybbleToHex(uint8_t x)
+{
+    return (x + ((x > 9) ? ('A'-10) : '0'));
+}
+
+#ifndef SIMULATOR
+/*-----------------------------------------------------------------------------*/
+/* Initialise the UART, setting baudrate, Rx/Tx enables, and flow controls
+
+Baud rate is derived from the header call to setbaud.h. There is no hardware
+flow control on this board.
+*/
+
+void uartInit(void)
+{
+    BAUD_RATE_HIGH_REG = UBRRH_VALUE;
+    BAUD_RATE_LOW_REG = UBRRL_VALUE;
+#if USE_2X
+    UART_STATUS_REG |= _BV(DOUBLE_RATE);
+#else
+    UART_STATUS_REG &= ~_BV(DOUBLE_RATE);
+#endif
+    UART_FORMAT_REG = (3 << FRAME_SIZE);                 // Set 8 bit frames
+    UART_CONTROL_REG |= _BV(ENABLE_RECEIVER_BIT) |
+                        _BV(ENABLE_TRANSMITTER_BIT);    // enable receive and transmit
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Send a character when the Tx is ready */
+
+void sendch(uint8_t c)
+{
+    UART_DATA_REG = c;                                  // send
+    while (!(UART_STATUS_REG & _BV(TRANSMIT_COMPLETE_BIT)));    // wait till gone
+    UART_STATUS_REG |= _BV(TRANSMIT_COMPLETE_BIT);      // reset TXCflag
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Get a character when the Rx is ready
+
+@returns uint16_t: the character, or NO_DATA if none arrives in IDLE_TIME.
+*/
+
+uint16_t getch(void)
+{
+    for (uint16_t wait = 0; wait < IDLE_TIME*100; wait++)
+    {
+        if (UART_STATUS_REG & _BV(RECEIVE_COMPLETE_BIT)) return UART_DATA_REG;
+        _delay_us(10);
+    }
+    return NO_DATA;
+}
+
+/*-----------------------------------------------------------------------------*/
+void initxbee(void)
+{
+#if AUTO_ENTER_APP == 1
+    cbi(PROG_PORT_DIR,PROG_PIN);
+#endif
+}
+
+/*-----------------------------------------------------------------------------*/
+void setXbeeWake(void)
+{
+#if XBEE_STAY_AWAKE == 1
+    sbi(SLEEP_RQ_PORT_DIR,SLEEP_RQ_PIN);
+    cbi(SLEEP_RQ_PORT,SLEEP_RQ_PIN);
+#endif
+}
+
+/*-----------------------------------------------------------------------------*/
+/* The bootloader pin is held low by the XBee to stay in the bootloader. */
+
+uint8_t progPinActive(void)
+{
+#if AUTO_ENTER_APP == 1
+    return ((inb(PROG_PORT) & _BV(PROG_PIN)) == 0);
+#else
+    return TRUE;
+#endif
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Erase a block of four pages. The CPU is halted until the erase is done. */
+
+void flashEraseBlock(uint16_t address)
+{
+    boot_page_erase(address);
+    boot_spm_busy_wait();
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Write a page of Flash that has already been erased */
+
+void flashWritePage(uint16_t address, uint8_t *data)
+{
+    for (uint8_t i = 0; i < PAGESIZE; i += 2)
+        boot_page_fill(address + i, (data[i+1] << 8) + data[i]);
+    boot_page_write(address);
+    boot_spm_busy_wait();
+}
+
+/*-----------------------------------------------------------------------------*/
+uint8_t flashReadByte(uint16_t address)
+{
+    return pgm_read_byte_near(address);
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Jump to the application through the trampoline */
+
+void jumpToApplication(void)
+{
+    void (*trampoline)(void) = (void (*)(void))(TRAMPOLINE/2);
+    trampoline();
+}
+#endif
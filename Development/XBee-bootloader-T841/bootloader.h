@@ -0,0 +1,132 @@
+/*          Bootloader Header file
+
+       Ken Sarkies (www.jiggerjuice.info)
+
+Bootloader for the ATTiny841 which has no bootload section
+
+version     0.0.0
+Software    AVR-GCC 4.8.2
+Target:     ATTiny441/841 watermeter board
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies (www.jiggerjuice.info)               *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef BOOTLOADER_H
+#define BOOTLOADER_H
+
+/* The simulator provides the hardware definitions and functions on a host. */
+#ifdef SIMULATOR
+#include "simulator/bootloader-sim.h"
+#else
+#include <avr/sfr_defs.h>
+#include <util/crc16.h>
+#include "../../libs/defines.h"
+#define crcUpdate(crc,data) _crc_xmodem_update(crc,data)
+#endif
+
+#define TRUE 1
+#define FALSE 0
+
+#define  high(x) ((uint8_t) (x >> 8) & 0xFF)
+#define  low(x) ((uint8_t) (x & 0xFF))
+
+/* Xbee parameters. ZigBee unicast without encryption allows 84 bytes */
+#define RF_PAYLOAD          84
+/* XBee Frame Types */
+#define DATA_RX             0x90
+#define DATA_TX             0x10
+/* Receive options bit set for a broadcast packet */
+#define RX_BROADCAST        0x02
+
+/* Flash is erased four pages at a time on the ATTiny441/841, so records are
+written a block of four pages at a time. */
+#define ERASE_PAGES         4
+#define BLOCKSIZE           (PAGESIZE*ERASE_PAGES)
+/* The block below the bootloader holds the trampoline, a jump to the
+application that is only written once an upload is complete. */
+#define TRAMPOLINE          (BASEADDR-BLOCKSIZE)
+#define BLOCKS              (TRAMPOLINE/BLOCKSIZE)
+#define BLOCK_FLAGS         ((BLOCKS+7)/8)
+/* Relative jump opcode. Any word in 8K is reached by wrapping around. */
+#define RJMP                0xC000
+#define RJMP_MASK           0x0FFF
+#define BOOT_VECTOR         (RJMP | (((BASEADDR/2)-1) & RJMP_MASK))
+#define NO_APP              0xFFFF
+
+/* Windowed records carry an 8 bit sequence number. The acknowledgement gives the
+first missing record and a bitmap of those following it, then the number of
+records that can be held before writing. */
+#define WINDOW_RECORDS      256
+#define RECORD_FLAGS        (WINDOW_RECORDS/8)
+#define ACK_MAP_BITS        16
+/* Records held in RAM until the serial line goes quiet, as Flash cannot be
+written while characters are arriving without flow control. */
+#define RECORD_BUFFERS      3
+/* Quiet time on the serial line (ms) before records are written */
+#define IDLE_TIME           5
+/* getch() result when the line has been quiet for IDLE_TIME */
+#define NO_DATA             0x100
+/* Block CRCs returned in one response */
+#define PAGE_CRC_MAX        8
+
+/* The rxFrameType is only expressed as an Rx Request as no other frame is of
+interest. */
+typedef struct
+{
+    uint16_t length;
+    uint8_t checksum;
+    uint8_t frameType;
+    union
+    {
+        uint8_t array[RF_PAYLOAD+11];
+        struct
+        {
+            uint8_t sourceAddress64[8];
+            uint8_t sourceAddress16[2];
+            uint8_t options;
+            uint8_t data[RF_PAYLOAD];
+        } rxRequest;
+    } message;
+} rxFrameType;
+
+/* A record waiting to be written. The block is filled with 0xFF outside the
+part carried by the record. */
+typedef struct
+{
+    uint16_t address;       /* Block address */
+    uint8_t offset;         /* Part of the block carried by the record */
+    uint8_t length;
+    uint8_t data[BLOCKSIZE];
+} recordBuffer;
+
+typedef enum {ready, inprogress, checksum, statemachine} messageError;
+
+/* Prototypes of the hardware dependent functions */
+void uartInit(void);
+void sendch(uint8_t c);
+uint16_t getch(void);
+void initxbee(void);
+void setXbeeWake(void);
+uint8_t progPinActive(void);
+void flashEraseBlock(uint16_t address);
+void flashWritePage(uint16_t address, uint8_t *data);
+uint8_t flashReadByte(uint16_t address);
+void jumpToApplication(void);
+
+#endif
@@ -0,0 +1,655 @@
+/**
+@mainpage ATTiny841 Bootloader Simulator
+@version 0.0.0
+@author Ken Sarkies (www.jiggerjuice.info)
+@brief Run the ATTiny841 bootloader on a host against a model uploader
+
+The bootloader is compiled for the host with the hardware functions replaced by
+a model of the Flash, the serial line and the radio link (see sim-libs.c). The
+uploader follows the acqcontrol firmware update engine: it reads the block CRCs,
+sends windowed records for the blocks that differ, compressed where smaller,
+limits its window to that advertised by the bootloader, resends lost records,
+verifies the block CRCs and sends the final record.
+
+A sequence of uploads is run and the simulated time for each reported:
+- a full image to a device holding only the bootloader,
+- a reset with the bootloader pin high, which must start the application,
+- the image with one block changed,
+- an upload stopped part way, after which a reset must stay in the bootloader,
+  then the same upload run to completion.
+
+The image is read from an iHex file, or made up with vector table, code-like
+words and a constant table.
+
+bootloader-sim [-i file.hex] [-s size] [-l loss%] [-r rate] [-d]
+ */
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies (www.jiggerjuice.info)               *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../bootloader.h"
+
+/* Uploader settings, as in the acqcontrol firmware update engine */
+#define HOST_RECORD_SIZE    64      /* Data bytes in a raw record */
+#define HOST_COMPRESSED     78      /* Largest compressed block in a record */
+#define HOST_WINDOW         8       /* Records outstanding before an ack */
+#define HOST_RATE           20      /* Records per second */
+#define HOST_RESEND_TIME    500000  /* Wait before sending again (us) */
+#define HOST_RESENDS        4       /* Sends of a record before giving up */
+#define HOST_QUERY          14      /* Block CRCs asked for at a time */
+#define HOST_BLOCKS         (SIM_FLASH_SIZE/PAGESIZE)
+
+enum HostState {hCompare, hTransfer, hVerify, hFinish, hDone, hFailed, hStopped};
+
+/* Image and uploader state */
+static uint8_t image[SIM_FLASH_SIZE];
+static int imageLength;
+static bool debug;
+static int rate = HOST_RATE;
+static enum HostState state;
+static uint64_t tickTime;
+static uint64_t stepTime;
+static int step;
+static int tokens;
+static int stopAt;                  /* Records acknowledged before stopping */
+static bool responseRcvd;
+static uint8_t response[RF_PAYLOAD];
+static int responseLength;
+static int pageSize;
+static int pageQuery;
+static uint16_t pageCrc[HOST_BLOCKS];
+static int recordCount;
+static uint16_t recordAddress[WINDOW_RECORDS];
+static bool recordCompressed[WINDOW_RECORDS];
+static bool received[WINDOW_RECORDS];
+static uint64_t sentTime[WINDOW_RECORDS];
+static int sends[WINDOW_RECORDS];
+static int firstMissing;
+static int window;
+static int compressedCount;
+static int recordsSent;
+
+static void hostStart(void);
+static void hostCompare(void);
+static void hostTransfer(void);
+static void hostFinish(void);
+static void hostSendRecord(const int sequence);
+static int hostCompress(const int block, uint8_t *out);
+static uint16_t hostBlockCrc(const int block);
+static int hexValue(const uint8_t *hex, const int digits);
+static int upload(const char *title, const int stop);
+static int resetTest(const char *title);
+static bool verify(void);
+static bool readHex(const char *file);
+static void makeImage(const int size);
+
+/*-----------------------------------------------------------------------------*/
+int main(int argc, char **argv)
+{
+    int size = 6144;
+    char *hexFile = NULL;
+    int c;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "i:s:l:r:d")) != -1)
+    {
+        switch (c)
+        {
+        case 'i':
+            hexFile = optarg;
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'l':
+            simLoss = atoi(optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'd':
+            debug = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-i file.hex] [-s size] [-l loss%%] [-r rate] [-d]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    srand(1);
+    if (hexFile != NULL)
+    {
+        if (! readHex(hexFile)) return 1;
+    }
+    else makeImage(size);
+    if ((imageLength < 2) || (imageLength > TRAMPOLINE) ||
+        ((((image[1] << 8) + image[0]) & ~RJMP_MASK) != RJMP))
+    {
+        fprintf(stderr, "Image must be up to %d bytes with a relative jump at 0\n",
+                TRAMPOLINE);
+        return 1;
+    }
+    printf("Image %d bytes, bootloader at 0x%04X, trampoline at 0x%04X, %d byte blocks\n",
+           imageLength, BASEADDR, TRAMPOLINE, BLOCKSIZE);
+    printf("Serial %d us/char, Flash %d us/op, radio %d ms, loss %d%%, rate %d/s\n\n",
+           SIM_BYTE_TIME, SIM_FLASH_TIME, SIM_RF_TIME/1000, simLoss, rate);
+
+/* Device holding only the bootloader, with its jump at the reset vector */
+    memset(simFlash, 0xFF, SIM_FLASH_SIZE);
+    simFlash[0] = low(BOOT_VECTOR);
+    simFlash[1] = high(BOOT_VECTOR);
+
+    int failures = 0;
+    failures += upload("Full image", 0);
+    failures += (resetTest("Reset with bootloader pin high") != SIM_JUMP);
+    int block = (imageLength/BLOCKSIZE)/2;
+    image[block*BLOCKSIZE+5] ^= 0x5A;
+    failures += upload("One block changed", 0);
+    for (int i = 1; i < 4; i++) image[(block+i)*BLOCKSIZE+9] ^= 0xA5;
+    image[1*BLOCKSIZE+3] ^= 0x33;
+    failures += upload("Four blocks changed, stopped part way", 2);
+    failures += (resetTest("Reset with bootloader pin high") != SIM_TIMEOUT);
+    failures += upload("Four blocks changed, run again", 0);
+    failures += (resetTest("Reset with bootloader pin high") != SIM_JUMP);
+    printf("%s\n", failures ? "FAILED" : "All passed");
+    return (failures > 0);
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Upload the image with the bootloader pin low
+
+@parameter char *title: description of the run
+@parameter int stop: stop once this many records are acknowledged, 0 to complete
+@returns int: 0 if the upload completed and the Flash matches the image
+*/
+
+int upload(const char *title, const int stop)
+{
+    simReset();
+    simProgPin = true;
+    simLimit = 600000000;
+    stopAt = stop;
+    hostStart();
+    int reason = setjmp(simJump);
+    if (reason == 0) bootloaderMain();
+    if (reason == SIM_JUMP) simDeliver();
+    printf("%s:\n", title);
+    printf("  %d records (%d compressed), %d sent, window %d\n",
+           recordCount, compressedCount, recordsSent, window);
+    printf("  %llu chars in, %llu out, %lu overruns, %lu frames lost, %lu erases, %lu writes\n",
+           (unsigned long long)simCount.rxBytes, (unsigned long long)simCount.txBytes,
+           simCount.overruns, simCount.framesLost, simCount.erases, simCount.writes);
+    if (state == hStopped)
+    {
+        printf("  stopped after %.2f s\n\n", (double)stepTime/1000000);
+        return 0;
+    }
+/* The final acknowledgement may be lost after the application has started */
+    if ((reason == SIM_JUMP) && (state == hFinish))
+        printf("  final acknowledgement lost\n");
+    bool ok = (reason == SIM_JUMP) && ((state == hDone) || (state == hFinish)) &&
+              (simCount.faults == 0) && verify();
+    printf("  %s in %.2f s\n\n", ok ? "completed and verified" : "FAILED",
+           (double)simTime/1000000);
+    return ok ? 0 : 1;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Reset with the bootloader pin high
+
+@returns int: SIM_JUMP if the application was started, SIM_TIMEOUT if the
+         bootloader kept running.
+*/
+
+int resetTest(const char *title)
+{
+    simReset();
+    simProgPin = false;
+    simLimit = 1000000;
+    state = hStopped;
+    int reason = setjmp(simJump);
+    if (reason == 0) bootloaderMain();
+    printf("%s: %s\n\n", title, (reason == SIM_JUMP) ?
+           "application started" : "stayed in the bootloader");
+    return reason;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Check the Flash against the image. The reset vector must jump to the
+bootloader and the trampoline to the application reset handler. */
+
+bool verify(void)
+{
+    uint16_t vector = (image[1] << 8) + image[0];
+    uint16_t appReset = (1 + vector) & RJMP_MASK;
+    uint16_t jump = RJMP | ((appReset - (TRAMPOLINE/2) - 1) & RJMP_MASK);
+    if ((simFlash[0] != low(BOOT_VECTOR)) || (simFlash[1] != high(BOOT_VECTOR)) ||
+        (simFlash[TRAMPOLINE] != low(jump)) || (simFlash[TRAMPOLINE+1] != high(jump)))
+        return false;
+    for (int i = 2; i < imageLength; i++)
+        if (simFlash[i] != image[i]) return false;
+    return true;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Uploader. Called by the simulator as time advances. */
+
+void hostStart(void)
+{
+    state = hCompare;
+    tickTime = 0;
+    step = 0;
+    tokens = 0;
+    responseRcvd = false;
+    pageSize = 0;
+    pageQuery = 0;
+    recordCount = 0;
+    compressedCount = 0;
+    recordsSent = 0;
+    firstMissing = 0;
+    window = HOST_WINDOW;
+}
+
+void hostReceive(const uint8_t *data, const int length)
+{
+    memcpy(response, data, length);
+    responseLength = length;
+    responseRcvd = true;
+    if (debug)
+        printf("%8.3f rx %c%c (%d)\n", (double)simTime/1000000, data[0],
+               (length > 1) ? data[1] : ' ', length);
+}
+
+uint64_t hostNextEvent(void)
+{
+    if ((state == hDone) || (state == hFailed) || (state == hStopped))
+        return (uint64_t)-1;
+    return tickTime;
+}
+
+void hostRun(void)
+{
+    if (simTime < tickTime) return;
+    tickTime = simTime + SIM_TICK;
+/* Airtime budget in thousandths of a record */
+    tokens += rate*(SIM_TICK/1000);
+    if (tokens > HOST_WINDOW*1000) tokens = HOST_WINDOW*1000;
+    switch (state)
+    {
+    case hCompare:
+    case hVerify:
+        hostCompare();
+        break;
+    case hTransfer:
+        hostTransfer();
+        break;
+    case hFinish:
+        hostFinish();
+        break;
+    default:
+        break;
+    }
+/* Stop the run once the uploader gives up */
+    if ((state == hFailed) && (simLimit > simTime)) simLimit = simTime;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Read the block CRCs. In the compare state list the records for blocks that
+differ, in the verify state check that none differ. */
+
+void hostCompare(void)
+{
+    int blocks = (pageSize > 0) ? (imageLength+pageSize-1)/pageSize : 1;
+    if (responseRcvd && (response[0] == 'K') && (responseLength >= 5) &&
+        (hexValue(response+1, 2) == pageQuery))
+    {
+        responseRcvd = false;
+        pageSize = 2*hexValue(response+3, 2);
+        blocks = (imageLength+pageSize-1)/pageSize;
+        int count = (responseLength-5)/4;
+        if ((pageSize == 0) || (count == 0))
+        {
+            state = hFailed;
+            return;
+        }
+        for (int i = 0; (i < count) && (pageQuery < HOST_BLOCKS); i++)
+            pageCrc[pageQuery++] = hexValue(response+5+4*i, 4);
+        step = 0;
+    }
+    if (pageQuery >= blocks)
+    {
+        if (state == hVerify)
+        {
+            for (int block = 0; block < blocks; block++)
+                if (pageCrc[block] != hostBlockCrc(block)) state = hFailed;
+            if (state == hVerify) state = hFinish;
+            step = 0;
+            return;
+        }
+        for (int block = 0; block < blocks; block++)
+        {
+            if (pageCrc[block] == hostBlockCrc(block)) continue;
+            uint8_t buffer[HOST_COMPRESSED];
+            int size = hostCompress(block, buffer);
+            bool compress = (size > 0) && (size < pageSize);
+            int rawSize = (pageSize < HOST_RECORD_SIZE) ? pageSize : HOST_RECORD_SIZE;
+            for (int offset = 0; offset < pageSize;
+                 offset += (compress ? pageSize : rawSize))
+            {
+                if (recordCount >= WINDOW_RECORDS-1)
+                {
+                    state = hFailed;
+                    return;
+                }
+                recordAddress[recordCount] = block*pageSize+offset;
+                recordCompressed[recordCount] = compress;
+                if (compress) compressedCount++;
+                recordCount++;
+            }
+        }
+        memset(received, 0, sizeof(received));
+        memset(sends, 0, sizeof(sends));
+        state = hTransfer;
+        return;
+    }
+    if ((tokens >= 1000) && ((step == 0) || (simTime - stepTime > HOST_RESEND_TIME)))
+    {
+        if (step++ >= HOST_RESENDS)
+        {
+            state = hFailed;
+            return;
+        }
+        tokens -= 1000;
+        stepTime = simTime;
+        uint8_t query[6];
+        sprintf((char*)query, "K%02X%02X", pageQuery & 0xFF, HOST_QUERY);
+        simSendFrame(query, 5);
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Take the latest acknowledgement then send records in the window that have
+not been sent or have timed out. */
+
+void hostTransfer(void)
+{
+    if (responseRcvd && (response[0] == 'W') && (responseLength >= 8))
+    {
+        responseRcvd = false;
+        if ((response[1] != 'Y') && (response[1] != 'C'))
+        {
+            state = hFailed;
+            return;
+        }
+        int ackMissing = hexValue(response+2, 2);
+        int map = hexValue(response+4, 4);
+        if (responseLength >= 10)
+        {
+            int advertised = hexValue(response+8, 2);
+            if ((advertised > 0) && (advertised <= HOST_WINDOW)) window = advertised;
+        }
+        for (int i = firstMissing; (i < ackMissing) && (i < recordCount); i++)
+            received[i] = true;
+        for (int i = 0; i < ACK_MAP_BITS; i++)
+        {
+            int sequence = ackMissing+1+i;
+            if ((map & (1 << i)) && (sequence < recordCount)) received[sequence] = true;
+        }
+        while ((firstMissing < recordCount) && received[firstMissing]) firstMissing++;
+    }
+    if ((stopAt > 0) && (firstMissing >= stopAt))
+    {
+        stepTime = simTime;
+        state = hStopped;
+        simLimit = simTime + 1000000;
+        return;
+    }
+    if (firstMissing >= recordCount)
+    {
+        pageQuery = 0;
+        step = 0;
+        state = hVerify;
+        return;
+    }
+    for (int sequence = firstMissing; (sequence < recordCount) &&
+         (sequence < firstMissing+window) && (tokens >= 1000); sequence++)
+    {
+        if (received[sequence]) continue;
+        if ((sends[sequence] > 0) && (simTime - sentTime[sequence] < HOST_RESEND_TIME))
+            continue;
+        if (sends[sequence]++ >= HOST_RESENDS)
+        {
+            state = hFailed;
+            return;
+        }
+        tokens -= 1000;
+        sentTime[sequence] = simTime;
+        hostSendRecord(sequence);
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Send the final record until the bootloader starts the application */
+
+void hostFinish(void)
+{
+    if (responseRcvd && (response[0] == 'W') && (response[1] == 'J'))
+    {
+        state = hDone;
+        return;
+    }
+    if ((tokens >= 1000) && ((step == 0) || (simTime - stepTime > HOST_RESEND_TIME)))
+    {
+        if (step++ >= HOST_RESENDS)
+        {
+            state = hFailed;
+            return;
+        }
+        tokens -= 1000;
+        stepTime = simTime;
+        hostSendRecord(-1);
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Send a windowed record, or the final record if the sequence is negative */
+
+void hostSendRecord(const int sequence)
+{
+    uint8_t message[RF_PAYLOAD];
+    int length = 4;
+    message[0] = 'W';
+    message[1] = (sequence < 0) ? recordCount : sequence;
+    message[2] = 0;
+    message[3] = 0;
+    if (sequence >= 0)
+    {
+        int address = recordAddress[sequence];
+        message[2] = high(address);
+        message[3] = low(address);
+        if (recordCompressed[sequence])
+        {
+            message[0] = 'Z';
+            length += hostCompress(address/pageSize, message+length);
+        }
+        else
+        {
+            int rawSize = (pageSize < HOST_RECORD_SIZE) ? pageSize : HOST_RECORD_SIZE;
+            for (int i = 0; i < rawSize; i++)
+                message[length++] = (address+i < imageLength) ? image[address+i] : 0xFF;
+        }
+        recordsSent++;
+    }
+    uint16_t crc = 0;
+    for (int i = 1; i < length; i++) crc = simCrcUpdate(crc, message[i]);
+    message[length++] = high(crc);
+    message[length++] = low(crc);
+    simSendFrame(message, length);
+    if (debug)
+        printf("%8.3f tx %c %d (%d)\n", (double)simTime/1000000, message[0],
+               message[1], length);
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Compress a block of the image as in the acqcontrol update engine
+
+@returns int: length of the compressed data, or zero if it does not fit.
+*/
+
+int hostCompress(const int block, uint8_t *out)
+{
+    uint8_t data[256];
+    for (int i = 0; i < pageSize; i++)
+        data[i] = (block*pageSize+i < imageLength) ? image[block*pageSize+i] : 0xFF;
+    int size = pageSize;
+    while ((size > 1) && (data[size-1] == 0xFF)) size--;
+    int length = 0;
+    int control = 0;
+    int items = 8;
+    int in = 0;
+    while (in < size)
+    {
+        if (items == 8)
+        {
+            if (length >= HOST_COMPRESSED) return 0;
+            control = length++;
+            out[control] = 0;
+            items = 0;
+        }
+        int bestLength = 0;
+        int bestDistance = 0;
+        for (int distance = 1; distance <= in; distance++)
+        {
+            int match = 0;
+            while ((in+match < size) && (match < 258) &&
+                   (data[in+match] == data[in+match-distance]))
+                match++;
+            if (match > bestLength)
+            {
+                bestLength = match;
+                bestDistance = distance;
+            }
+        }
+        if (bestLength >= 3)
+        {
+            if (length+2 > HOST_COMPRESSED) return 0;
+            out[length++] = bestDistance-1;
+            out[length++] = bestLength-3;
+            in += bestLength;
+        }
+        else
+        {
+            if (length+1 > HOST_COMPRESSED) return 0;
+            out[control] |= (1 << items);
+            out[length++] = data[in++];
+        }
+        items++;
+    }
+    return length;
+}
+
+/*-----------------------------------------------------------------------------*/
+uint16_t hostBlockCrc(const int block)
+{
+    uint16_t crc = 0;
+    for (int i = block*pageSize; i < (block+1)*pageSize; i++)
+        crc = simCrcUpdate(crc, (i < imageLength) ? image[i] : 0xFF);
+    return crc;
+}
+
+/*-----------------------------------------------------------------------------*/
+int hexValue(const uint8_t *hex, const int digits)
+{
+    int value = 0;
+    for (int i = 0; i < digits; i++)
+    {
+        uint8_t c = hex[i];
+        value = (value << 4) + (c - ((c > '9') ? ('A'-10) : '0'));
+    }
+    return value;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Read an iHex file into the image */
+
+bool readHex(const char *file)
+{
+    FILE *hex = fopen(file, "r");
+    if (hex == NULL)
+    {
+        fprintf(stderr, "Cannot open %s\n", file);
+        return false;
+    }
+    memset(image, 0xFF, SIM_FLASH_SIZE);
+    imageLength = 0;
+    char line[600];
+    while (fgets(line, sizeof(line), hex) != NULL)
+    {
+        if (line[0] != ':') continue;
+        int count = hexValue((uint8_t*)line+1, 2);
+        int address = hexValue((uint8_t*)line+3, 4);
+        int type = hexValue((uint8_t*)line+7, 2);
+        if (type != 0) continue;
+        for (int i = 0; (i < count) && (address+i < SIM_FLASH_SIZE); i++)
+            image[address+i] = hexValue((uint8_t*)line+9+2*i, 2);
+        if (address+count > imageLength) imageLength = address+count;
+    }
+    fclose(hex);
+    return true;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Make up an image: a vector table of relative jumps, then code-like words
+drawn from a small set with repeated sequences, then a table of constants. */
+
+void makeImage(const int size)
+{
+    static const uint16_t opcodes[] =
+        {0x9508, 0x2411, 0xE080, 0xE090, 0x9180, 0x9190, 0x9380, 0x9390,
+         0x0F88, 0x1F99, 0x2F08, 0x3081, 0xF409, 0xF011, 0xB98A, 0xB38B,
+         0x91CF, 0x93CF, 0x940E, 0x920F, 0x900F, 0x2F8C, 0x5081, 0xCFFD};
+    int opcodeCount = sizeof(opcodes)/sizeof(opcodes[0]);
+    imageLength = (size & ~1);
+    if (imageLength > SIM_FLASH_SIZE) imageLength = SIM_FLASH_SIZE;
+    memset(image, 0xFF, SIM_FLASH_SIZE);
+    int vectors = 30;
+    for (int i = 0; i < vectors; i++)
+    {
+        int target = (i == 0) ? vectors : vectors+2;
+        uint16_t jump = RJMP | ((target - i - 1) & RJMP_MASK);
+        image[2*i] = low(jump);
+        image[2*i+1] = high(jump);
+    }
+    int tableStart = imageLength - imageLength/8;
+    for (int word = vectors; word < tableStart/2; word++)
+    {
+        uint16_t opcode;
+        if ((word > vectors+16) && ((rand() % 4) == 0))
+        {
+            int back = 2 + (rand() % 14);
+            opcode = (image[2*(word-back)+1] << 8) + image[2*(word-back)];
+        }
+        else if ((rand() % 8) == 0) opcode = rand() & 0xFFFF;
+        else opcode = opcodes[rand() % opcodeCount];
+        image[2*word] = low(opcode);
+        image[2*word+1] = high(opcode);
+    }
+    for (int i = tableStart; i < imageLength; i++) image[i] = ((i & 0x0F) < 4) ? i : 0;
+}
@@ -0,0 +1,96 @@
+/*      ATTiny841 Bootloader Simulator Header file
+
+       Ken Sarkies (www.jiggerjuice.info)
+
+Hardware definitions and functions for running the bootloader on a host. Time
+is counted in microseconds and advanced by the serial line and Flash operations.
+
+version     0.0.0
+Software    GCC
+Target:     Linux
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies (www.jiggerjuice.info)               *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef BOOTLOADER_SIM_H
+#define BOOTLOADER_SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
+
+/* ATTiny841 Flash and the bootloader address set in the makefile */
+#define SIM_FLASH_SIZE      8192
+#define PAGESIZE            16
+#ifndef BASEADDR
+#define BASEADDR            0x1C00
+#endif
+
+/* Timing in microseconds: a character at 9600 baud, a Flash erase or write
+(datasheet maximum), the XBee latency for a unicast hop, CPU time to handle a
+character at 8MHz, and the update engine cycle time. */
+#define SIM_BYTE_TIME       1042
+#define SIM_FLASH_TIME      4500
+#define SIM_RF_TIME         20000
+#define SIM_CHAR_TIME       30
+#define SIM_TICK            10000
+
+/* The USART holds two characters while the CPU is not reading it */
+#define SIM_UART_FIFO       2
+
+/* Reasons for leaving the bootloader */
+#define SIM_JUMP            1
+#define SIM_TIMEOUT         2
+
+#define crcUpdate(crc,data) simCrcUpdate(crc,data)
+
+typedef struct
+{
+    unsigned long erases;
+    unsigned long writes;
+    unsigned long rxBytes;          /* Characters received by the bootloader */
+    unsigned long txBytes;          /* Characters sent by the bootloader */
+    unsigned long overruns;         /* Characters lost while the CPU was busy */
+    unsigned long framesLost;       /* Frames lost over the air */
+    unsigned long faults;           /* Writes to the bootloader area */
+} simCounters;
+
+extern uint8_t simFlash[SIM_FLASH_SIZE];
+extern uint64_t simTime;
+extern uint64_t simLimit;
+extern bool simProgPin;
+extern int simLoss;
+extern simCounters simCount;
+extern jmp_buf simJump;
+
+/* Simulator functions */
+void simReset(void);
+void simSendFrame(const uint8_t *data, const int length);
+void simDeliver(void);
+uint16_t simCrcUpdate(uint16_t crc, uint8_t data);
+
+/* Uploader functions called by the simulator */
+void hostReceive(const uint8_t *data, const int length);
+void hostRun(void);
+uint64_t hostNextEvent(void);
+
+/* The bootloader main program */
+int bootloaderMain(void);
+
+#endif
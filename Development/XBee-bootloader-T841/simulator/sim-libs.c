@@ -0,0 +1,305 @@
+/*      ATTiny841 Bootloader Simulator hardware library
+
+Substitute hardware functions for the bootloader, modelling the Flash, the
+USART without flow control, and the XBee radio link to the uploader.
+
+Characters from the XBee arrive at the serial line rate whether or not the CPU
+is reading them. The USART holds only two characters, so any more arriving while
+the CPU is busy writing Flash or sending are lost. Sending a character holds the
+CPU for its time on the line. Frames pass over the radio link after a fixed
+latency and may be lost at random.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies (www.jiggerjuice.info)               *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "../bootloader.h"
+
+#define RX_QUEUE            65536
+#define HOST_FRAMES         16
+
+uint8_t simFlash[SIM_FLASH_SIZE];
+uint64_t simTime;
+uint64_t simLimit;
+bool simProgPin;
+int simLoss;
+simCounters simCount;
+jmp_buf simJump;
+
+/* Characters on their way to the bootloader and their arrival times */
+static uint8_t rxData[RX_QUEUE];
+static uint64_t rxTime[RX_QUEUE];
+static int rxHead;
+static int rxTail;
+static uint64_t rxLast;
+
+/* Frames on their way to the uploader */
+static struct
+{
+    uint64_t time;
+    int length;
+    uint8_t data[RF_PAYLOAD];
+} hostFrame[HOST_FRAMES];
+static int hostFrames;
+static uint8_t txFrame[RF_PAYLOAD+20];
+static int txLength;
+
+static bool simFrameLost(void);
+static void simOverrun(void);
+static void simRun(void);
+
+/*-----------------------------------------------------------------------------*/
+/* Clear the serial line and radio link before a run */
+
+void simReset(void)
+{
+    rxHead = 0;
+    rxTail = 0;
+    rxLast = 0;
+    hostFrames = 0;
+    txLength = 0;
+    simTime = 0;
+    memset(&simCount, 0, sizeof(simCount));
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Send data from the uploader to the bootloader
+
+The data is wrapped in an XBee receive frame and arrives after the radio latency,
+following any characters still being sent to the bootloader.
+
+@parameter uint8_t *data: data to send
+@parameter int length: length of the data
+*/
+
+void simSendFrame(const uint8_t *data, const int length)
+{
+    if (simFrameLost()) return;
+    uint8_t frame[RF_PAYLOAD+16];
+    int frameLength = 0;
+    frame[frameLength++] = 0x7E;
+    frame[frameLength++] = 0;
+    frame[frameLength++] = length+12;
+    frame[frameLength++] = DATA_RX;
+    for (int i = 0; i < 11; i++) frame[frameLength++] = 0;
+    memcpy(frame+frameLength, data, length);
+    frameLength += length;
+    uint8_t checksum = 0;
+    for (int i = 3; i < frameLength; i++) checksum += frame[i];
+    frame[frameLength++] = 0xFF - checksum;
+    uint64_t arrival = simTime + SIM_RF_TIME;
+    if (arrival < rxLast + SIM_BYTE_TIME) arrival = rxLast + SIM_BYTE_TIME;
+    for (int i = 0; (i < frameLength) && (rxTail < RX_QUEUE); i++)
+    {
+        rxData[rxTail] = frame[i];
+        rxTime[rxTail++] = arrival;
+        rxLast = arrival;
+        arrival += SIM_BYTE_TIME;
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Pass frames still on their way to the uploader after leaving the bootloader */
+
+void simDeliver(void)
+{
+    while (hostFrames > 0)
+    {
+        if (simTime < hostFrame[0].time) simTime = hostFrame[0].time;
+        simRun();
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/* CRC-16 (XModem) as _crc_xmodem_update() in avr-libc */
+
+uint16_t simCrcUpdate(uint16_t crc, uint8_t data)
+{
+    crc ^= ((uint16_t)data << 8);
+    for (int bit = 0; bit < 8; bit++)
+    {
+        if (crc & 0x8000) crc = (crc << 1) ^ 0x1021;
+        else crc <<= 1;
+    }
+    return crc;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Lose a frame over the air at the rate given */
+
+bool simFrameLost(void)
+{
+    if ((simLoss > 0) && ((rand() % 100) < simLoss))
+    {
+        simCount.framesLost++;
+        return true;
+    }
+    return false;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Drop characters that arrived while the CPU was busy beyond those held */
+
+void simOverrun(void)
+{
+    int arrived = 0;
+    while ((rxHead+arrived < rxTail) && (rxTime[rxHead+arrived] <= simTime))
+        arrived++;
+    if (arrived > SIM_UART_FIFO)
+    {
+        int drop = arrived - SIM_UART_FIFO;
+        int keep = rxHead + SIM_UART_FIFO;
+        memmove(rxData+keep, rxData+keep+drop, rxTail-keep-drop);
+        memmove(rxTime+keep, rxTime+keep+drop, (rxTail-keep-drop)*sizeof(uint64_t));
+        rxTail -= drop;
+        simCount.overruns += drop;
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Pass frames that have arrived to the uploader and let it act */
+
+void simRun(void)
+{
+    while ((hostFrames > 0) && (hostFrame[0].time <= simTime))
+    {
+        hostReceive(hostFrame[0].data, hostFrame[0].length);
+        hostFrames--;
+        memmove(hostFrame, hostFrame+1, hostFrames*sizeof(hostFrame[0]));
+    }
+    hostRun();
+}
+
+/*-----------------------------------------------------------------------------*/
+void uartInit(void)
+{
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Send a character, holding the CPU for its time on the line. A completed
+transmit frame is passed over the air to the uploader. */
+
+void sendch(uint8_t c)
+{
+    simTime += SIM_BYTE_TIME;
+    simCount.txBytes++;
+    if ((txLength == 0) && (c != 0x7E)) return;
+    if (txLength < (int)sizeof(txFrame)) txFrame[txLength++] = c;
+    if ((txLength > 3) && (txLength >= txFrame[2]+4))
+    {
+        int length = txFrame[2]-14;
+        if ((txFrame[3] == DATA_TX) && (length > 0) && (length <= RF_PAYLOAD) &&
+            (hostFrames < HOST_FRAMES) && (! simFrameLost()))
+        {
+            hostFrame[hostFrames].time = simTime + SIM_RF_TIME;
+            hostFrame[hostFrames].length = length;
+            memcpy(hostFrame[hostFrames].data, txFrame+17, length);
+            hostFrames++;
+        }
+        txLength = 0;
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Get a character, waiting up to IDLE_TIME while the uploader acts.
+
+Leaves the bootloader if the time limit of the run is passed.
+*/
+
+uint16_t getch(void)
+{
+    uint64_t deadline = simTime + IDLE_TIME*1000;
+    simOverrun();
+    for (;;)
+    {
+        if (simTime > simLimit) longjmp(simJump, SIM_TIMEOUT);
+        simRun();
+        if ((rxHead < rxTail) && (rxTime[rxHead] <= simTime))
+        {
+            uint8_t c = rxData[rxHead++];
+            if (rxHead == rxTail)
+            {
+                rxHead = 0;
+                rxTail = 0;
+            }
+            simTime += SIM_CHAR_TIME;
+            simCount.rxBytes++;
+            return c;
+        }
+        uint64_t next = hostNextEvent();
+        if ((hostFrames > 0) && (hostFrame[0].time < next)) next = hostFrame[0].time;
+        if ((rxHead < rxTail) && (rxTime[rxHead] < next)) next = rxTime[rxHead];
+        if (next > deadline)
+        {
+            simTime = deadline;
+            return NO_DATA;
+        }
+        if (next > simTime) simTime = next;
+    }
+}
+
+/*-----------------------------------------------------------------------------*/
+void initxbee(void)
+{
+}
+
+/*-----------------------------------------------------------------------------*/
+void setXbeeWake(void)
+{
+}
+
+/*-----------------------------------------------------------------------------*/
+uint8_t progPinActive(void)
+{
+    return simProgPin;
+}
+
+/*-----------------------------------------------------------------------------*/
+void flashEraseBlock(uint16_t address)
+{
+    address &= ~(BLOCKSIZE-1);
+    if (address >= BASEADDR) simCount.faults++;
+    else memset(simFlash+address, 0xFF, BLOCKSIZE);
+    simTime += SIM_FLASH_TIME;
+    simCount.erases++;
+}
+
+/*-----------------------------------------------------------------------------*/
+/* Write a page. Flash bits can only be cleared, as in the device. */
+
+void flashWritePage(uint16_t address, uint8_t *data)
+{
+    address &= ~(PAGESIZE-1);
+    if (address >= BASEADDR) simCount.faults++;
+    else for (int i = 0; i < PAGESIZE; i++) simFlash[address+i] &= data[i];
+    simTime += SIM_FLASH_TIME;
+    simCount.writes++;
+}
+
+/*-----------------------------------------------------------------------------*/
+uint8_t flashReadByte(uint16_t address)
+{
+    return simFlash[address % SIM_FLASH_SIZE];
+}
+
+/*-----------------------------------------------------------------------------*/
+void jumpToApplication(void)
+{
+    longjmp(simJump, SIM_JUMP);
+}
@@ -135,6 +135,35 @@ void NodeConfigWidget::on_commandButton_clicked()
     }
 }
 
+//-----------------------------------------------------------------------------
+/** @brief Queue a Command for the Node.
+
+This posts the user defined data message to the node mailbox in acqcontrol. It
+is delivered when the node next reports, so a sleeping node need not be woken.
+The result is pushed back later.
+*/
+void NodeConfigWidget::on_queueButton_clicked()
+{
+    QByteArray queueCommand;
+    queueCommand.clear();
+    queueCommand.append('M');
+    queueCommand.append(row);
+    queueCommand.append('S');
+    queueCommand.append('D');
+    queueCommand.append(NodeConfigFormUi.commandLine->text());
+    comCommand = 'M';
+    response = 0;
+    int error = sendCommand(&queueCommand, tcpSocket);
+    if ((error > 0) || (response != 'Y'))
+    {
+        QMessageBox::warning(this,"","Unable to queue the command.");
+#ifdef DEBUG
+        qDebug() << "Unable to queue the command.";
+#endif
+    }
+    else NodeConfigFormUi.mailboxLabel->setText("Queued until the node reports");
+}
+
 //-----------------------------------------------------------------------------
 /** @brief Wake the node.
 
@@ -196,6 +225,16 @@ void NodeConfigWidget::readXbeeProcess()
 {
     if (tcpSocket == 0) return;
     QByteArray reply = tcpSocket->readAll();
+// Mailbox results and firmware update progress may be pushed by acqcontrol at
+// any time. Take off any such messages before looking for the response to a
+// command.
+    while ((reply.size() > 2) && ((reply[1] == 'm') || (reply[1] == 'f'))
+           && (reply[0] > 2) && (reply.size() >= reply[0]))
+    {
+        if (reply[1] == 'm') mailboxResult(reply.left(reply[0]));
+        reply.remove(0, reply[0]);
+    }
+    if (reply.size() == 0) return;
     int length = reply[0];
     char command = reply[1];
     int status = reply[2];
@@ -234,6 +273,9 @@ void NodeConfigWidget::readXbeeProcess()
         case 'E':
             response = status;
             break;
+        case 'M':
+            response = status;
+            break;
         case 'r':
             response = status;
             for (int i = 3; i < reply.size(); i++)
@@ -281,6 +323,27 @@ void NodeConfigWidget::readXbeeProcess()
     setComStatus(comReceived);
 }
 
+//-----------------------------------------------------------------------------
+/** @brief Show the result of a queued command.
+
+The message has the row, the message type, a status and any response from the
+node. Results for other nodes are ignored.
+
+@parameter  QByteArray message: the pushed message.
+*/
+void NodeConfigWidget::mailboxResult(const QByteArray message)
+{
+    if ((message.size() < 5) || (message[2] != row)) return;
+    QString result;
+    if (message[4] == 'Y') result = "Response: " + QString(message.mid(5));
+    else if (message[4] == 'T') result = "No response from the node";
+    else result = "Unable to deliver the command";
+    NodeConfigFormUi.mailboxLabel->setText(result);
+#ifdef DEBUG
+    qDebug() << "Mailbox result" << result;
+#endif
+}
+
 //-----------------------------------------------------------------------------
 /** @brief Notify of connection failure.
 
@@ -57,6 +57,7 @@ private slots:
     void accept();
     void on_wakeButton_clicked();
     void on_commandButton_clicked();
+    void on_queueButton_clicked();
     void on_sleepButton_clicked();
     void readXbeeProcess();
     void displayError(QAbstractSocket::SocketError socketError);
@@ -69,6 +70,7 @@ private:
                       int row, bool remote, int countMax);
     int sendString(QByteArray *command, QTcpSocket *tcpSocket,
                       int row, int timeout);
+    void mailboxResult(const QByteArray message);
 // Variables
     QTcpSocket *tcpSocket;
     int row;
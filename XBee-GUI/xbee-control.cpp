@@ -36,6 +36,7 @@ acquisition network.
 #include <QTextStream>
 #include <QFile>
 #include <QFileDialog>
+#include <QVector>
 #include <QDebug>
 #include <cstdlib>
 #include <iostream>
@@ -315,16 +316,17 @@ void XbeeControlTool::on_queryNodeButton_clicked()
 This assumes the existence of an on-board bootloader in the AVR.
 
 Open a selected file with the new firmware, reset the AVR and download the iHex
-lines.
+lines, or binary records if selected.
 
-@returns int: error number. 0=OK, 1=erase fail, 2=upload fail, 3=command fail.
+@returns int: error number. 0=OK, 1=erase fail, 2=upload fail, 3=command fail,
+4=image not accepted, 5=update job refused.
 */
 
 int XbeeControlTool::on_firmwareButton_clicked()
 {
     QString errorMessage;
 /* Open file for reading */
-    bool error = false;
+    int error = 0;
 /* Get the selected row (actually gets the first one selected */
     int row = 0;
     for (row = 0; row < tableLength; row++)
@@ -347,14 +349,20 @@ int XbeeControlTool::on_firmwareButton_clicked()
         QFile file(filename);
         if (file.open(QIODevice::ReadOnly))
         {
-/* Read file and transmit to node */
-            error = loadHexGUI(&file, row);
+/* Read file and transmit to node, or have acqcontrol update all selected
+nodes */
+            if (XbeeControlFormUi.serverUpload->isChecked())
+                error = loadHexServer(&file);
+            else
+                error = loadHexGUI(&file, row);
         }
     }
     if (error == 0)  return 0;
     if (error == 1) errorMessage = "Timeout waiting for erase to complete";
     if (error == 2) errorMessage = "Timeout waiting for a sent line to program";
     if (error == 3) errorMessage = "General Command Timeout";
+    if (error == 4) errorMessage = "Firmware image not accepted";
+    if (error == 5) errorMessage = "Firmware update job refused";
     QMessageBox::warning(this,"",errorMessage);
     return error;
 }
@@ -375,6 +383,18 @@ void XbeeControlTool::readXbeeProcess()
 {
     if (tcpSocket == 0) return;
     QByteArray reply = tcpSocket->readAll();
+// Firmware update progress may be pushed by acqcontrol at any time once asked
+// for. Take off any such messages before looking for the response to a
+// command. A progress message answers a progress command waiting for one.
+    while ((reply.size() > 2) && (reply[1] == 'f') && (reply[0] > 2)
+           && (reply.size() >= reply[0]))
+    {
+        firmwareProgress(reply.left(reply[0]));
+        reply.remove(0, reply[0]);
+        if ((comCommand == 'f') && (getComStatus() == comSent))
+            setComStatus(comReceived);
+    }
+    if (reply.size() == 0) return;
     int length = reply[0];
     char command = reply[1];
     int status = reply[2];
@@ -413,6 +433,15 @@ void XbeeControlTool::readXbeeProcess()
         case 'E':
             response = status;
             break;
+        case 'F':
+            response = status;
+            break;
+        case 'G':
+            response = status;
+            break;
+        case 'H':
+            response = status;
+            break;
         case 'r':
             response = status;
             for (int i = 3; i < reply.size(); i++)
@@ -744,6 +773,311 @@ int XbeeControlTool::sendAtCommand(const QByteArray *xbeeCommand, QTcpSocket *tc
     return errorCode;
 }
 
+//-----------------------------------------------------------------------------
+/** @brief Send a binary firmware record and wait for the bootloader response.
+
+The record is sent with the binary data command. If no response arrives within
+half a second the record is sent again, up to three times.
+
+Globals: dataReplyMessage, response
+
+@param[in]  QByteArray record: binary record starting with the 'B' or 'W'
+            command.
+@param[in]  int row:  Table row number for remote node to address.
+@returns    char: status character from the response, or zero if none came.
+*/
+
+char XbeeControlTool::sendFirmwareRecord(const QByteArray *record, int row)
+{
+    QByteArray firmwareCommand;
+    for (int resend = 0; resend < 4; resend++)
+    {
+        firmwareCommand.clear();
+        firmwareCommand.append('U');
+        firmwareCommand.append(char(row));
+        firmwareCommand.append(*record);
+        comCommand = firmwareCommand.at(0);
+        if (sendCommand(&firmwareCommand,tcpSocket) > 0) return 0;
+        response = 0;
+        dataReplyMessage.clear();
+        int count = 0;
+        while((response == 0) && (count++ < 5))
+        {
+            millisleep(100);
+            firmwareCommand.clear();
+            firmwareCommand.append('s');
+            firmwareCommand.append(char(row));
+            comCommand = firmwareCommand.at(0);
+            sendCommand(&firmwareCommand,tcpSocket);
+        }
+        if ((response != 0) && (dataReplyMessage.size() > 1) &&
+            (dataReplyMessage.at(0) == record->at(0)))
+            return dataReplyMessage.at(1);
+#ifdef DEBUG
+        qDebug() << "Binary record timed out. Retry.";
+#endif
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+/** @brief Send a binary firmware image in windowed records.
+
+Up to FIRMWARE_WINDOW records are sent before any acknowledgement is needed.
+The bootloader responds to each record with the first record it has not yet
+received and a bitmap of the records following it. A bootloader that holds
+records in RAM before writing them also gives the number it can take, and the
+window is limited to that. The latest response is
+polled for, and records remaining unacknowledged after WINDOW_RESEND_POLLS polls
+are sent again, so only lost records are repeated. Only the records listed are
+sent, each numbered by its place in the list. The caller sends the final record.
+
+Globals: dataReplyMessage, response
+
+@param[in]  QList<QByteArray> records: windowed records to send.
+@param[in]  int row:  Table row number for remote node to address.
+@returns    int: failure point, 0 if OK, 7 if timeout, 10 if a record was
+            rejected, 11 if there are too many records.
+*/
+
+int XbeeControlTool::sendFirmwareWindowed(const QList<QByteArray> *recordList,
+                                          int row)
+{
+    int records = recordList->size();
+    if (records >= WINDOW_RECORDS) return 11;
+    QVector<bool> received(records, false);
+    QVector<int> sentPoll(records, 0);
+    QVector<int> sends(records, 0);
+    QByteArray firmwareCommand;
+    int firstMissing = 0;
+    int window = FIRMWARE_WINDOW;
+    int poll = 0;
+    while (firstMissing < records)
+    {
+/* Send records in the window that have not been sent or have timed out */
+        for (int sequence = firstMissing; (sequence < records) &&
+             (sequence < firstMissing+window); sequence++)
+        {
+            if (received[sequence]) continue;
+            if ((sends[sequence] > 0) &&
+                (poll - sentPoll[sequence] < WINDOW_RESEND_POLLS)) continue;
+            if (sends[sequence]++ > 3) return 7;
+#ifdef DEBUG
+            if (sends[sequence] > 1)
+                qDebug() << "Windowed record" << sequence << "resent";
+#endif
+            firmwareCommand.clear();
+            firmwareCommand.append('U');
+            firmwareCommand.append(char(row));
+            firmwareCommand.append(recordList->at(sequence));
+            comCommand = firmwareCommand.at(0);
+            if (sendCommand(&firmwareCommand,tcpSocket) > 0) return 7;
+            sentPoll[sequence] = poll;
+        }
+/* Poll for the latest acknowledgement, which covers all records so far */
+        millisleep(WINDOW_POLL_TIME);
+        poll++;
+        response = 0;
+        dataReplyMessage.clear();
+        firmwareCommand.clear();
+        firmwareCommand.append('s');
+        firmwareCommand.append(char(row));
+        comCommand = firmwareCommand.at(0);
+        sendCommand(&firmwareCommand,tcpSocket);
+        if ((response != 0) && (dataReplyMessage.size() >= 8) &&
+            (dataReplyMessage.at(0) == 'W'))
+        {
+/* A corrupted record is simply missing, but others will never be accepted */
+            char status = dataReplyMessage.at(1);
+            if ((status != 'Y') && (status != 'C')) return 10;
+            bool ok;
+            int ackMissing = dataReplyMessage.mid(2,2).toInt(&ok,16);
+            int map = dataReplyMessage.mid(4,4).toInt(&ok,16);
+            if (dataReplyMessage.size() >= 10)
+            {
+                int advertised = dataReplyMessage.mid(8,2).toInt(&ok,16);
+                if (ok && (advertised > 0) && (advertised < window))
+                    window = advertised;
+            }
+            for (int i = firstMissing; (i < ackMissing) && (i < records); i++)
+                received[i] = true;
+            for (int i = 0; i < ACK_MAP_BITS; i++)
+            {
+                int sequence = ackMissing+1+i;
+                if ((map & (1 << i)) && (sequence < records))
+                    received[sequence] = true;
+            }
+            while ((firstMissing < records) && received[firstMissing])
+                firstMissing++;
+        }
+        XbeeControlFormUi.uploadProgressBar->setValue(firstMissing);
+        qApp->processEvents();
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+/** @brief Read the CRC of each Flash page covered by an image.
+
+The bootloader returns the CRC-16 (XModem) of a block of pages at a time along
+with the page size.
+
+Globals: dataReplyMessage
+
+@param[in]  int imageSize: bytes in the image.
+@param[in]  int row:  Table row number for remote node to address.
+@param[out] QVector<quint16> crcs: CRC of each page from page zero.
+@param[out] int pageSize: Flash page size in bytes.
+@returns    bool: true if all CRCs were read.
+*/
+
+bool XbeeControlTool::readPageCrcs(int imageSize, int row, QVector<quint16> *crcs,
+                                   int *pageSize)
+{
+    crcs->clear();
+    *pageSize = 0;
+    while ((*pageSize == 0) || (crcs->size()*(*pageSize) < imageSize))
+    {
+        QByteArray query = QString("K%1%2").arg(crcs->size(),2,16,QChar('0'))
+                                           .arg(PAGE_CRC_QUERY,2,16,QChar('0'))
+                                           .toUpper().toLatin1();
+        if (sendFirmwareRecord(&query, row) == 0) return false;
+        bool ok;
+        int first = dataReplyMessage.mid(1,2).toInt(&ok,16);
+        int words = dataReplyMessage.mid(3,2).toInt(&ok,16);
+        int pages = (dataReplyMessage.size()-5)/4;
+        if ((first != crcs->size()) || (words == 0) || (pages <= 0)) return false;
+        *pageSize = 2*words;
+        for (int i = 0; i < pages; i++)
+            crcs->append(dataReplyMessage.mid(5+4*i,4).toInt(&ok,16));
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+/** @brief Have acqcontrol update the firmware of all selected nodes.
+
+The file is converted to a binary image and loaded into acqcontrol, then an
+update job is started for all nodes selected in the table. The job runs in
+acqcontrol and continues if the GUI is closed. Progress is pushed back and
+shown in the progress bar.
+
+@param[in]  QFile file: already opened for loading.
+@returns    int error code: 0 if OK, 3 if send command error, 4 if the image
+            was not accepted, 5 if the job was refused.
+*/
+
+int XbeeControlTool::loadHexServer(QFile* file)
+{
+    QByteArray rows;
+    for (int row = 0; row < tableLength; row++)
+    {
+        if (table->item(row,6)->checkState() == Qt::Checked)
+            rows.append(char(row));
+    }
+    QByteArray image;
+    if (! hexToImage(file, &image)) return 4;
+/* Clear the image in acqcontrol then load it in blocks */
+    QByteArray firmwareCommand;
+    firmwareCommand.append('F');
+    firmwareCommand.append(char(0));
+    comCommand = firmwareCommand.at(0);
+    response = 0;
+    if (sendCommand(&firmwareCommand,tcpSocket) > 0) return 3;
+    if (response != 'Y') return 4;
+    for (int address = 0; address < image.size(); address += FIRMWARE_CHUNK)
+    {
+        firmwareCommand.clear();
+        firmwareCommand.append('F');
+        firmwareCommand.append(char(0));
+        firmwareCommand.append((char)(address >> 8));
+        firmwareCommand.append((char)address);
+        firmwareCommand.append(image.mid(address, FIRMWARE_CHUNK));
+        comCommand = firmwareCommand.at(0);
+        response = 0;
+        if (sendCommand(&firmwareCommand,tcpSocket) > 0) return 3;
+        if (response != 'Y') return 4;
+    }
+/* Start the job with default concurrency and airtime budget. Several nodes are
+updated together by broadcasting the image to them. */
+    updateState.clear();
+    updateProgress.clear();
+    for (int i = 0; i < rows.size(); i++)
+    {
+        updateState[rows.at(i)] = 0;
+        updateProgress[rows.at(i)] = 0;
+    }
+    firmwareCommand.clear();
+    firmwareCommand.append((rows.size() > 1) ? 'H' : 'G');
+    firmwareCommand.append(char(0));
+    firmwareCommand.append(char(0));
+    firmwareCommand.append(char(0));
+    firmwareCommand.append(rows);
+    comCommand = firmwareCommand.at(0);
+    response = 0;
+    if (sendCommand(&firmwareCommand,tcpSocket) > 0) return 3;
+    if (response != 'Y')
+    {
+        updateState.clear();
+        return 5;
+    }
+    XbeeControlFormUi.uploadProgressBar->setVisible(true);
+    XbeeControlFormUi.uploadProgressBar->setMinimum(0);
+    XbeeControlFormUi.uploadProgressBar->setMaximum(100);
+    XbeeControlFormUi.uploadProgressBar->setValue(0);
+/* Ask for progress to be pushed as the job runs. */
+    firmwareCommand.clear();
+    firmwareCommand.append('f');
+    firmwareCommand.append(char(0));
+    firmwareCommand.append(char(1));
+    comCommand = firmwareCommand.at(0);
+    if (sendCommand(&firmwareCommand,tcpSocket) > 0) return 3;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+/** @brief Show progress of a firmware update run by acqcontrol.
+
+The message has the number of nodes in the status byte, then the row, state and
+percentage complete of each. The progress bar shows the average over all nodes
+in the job. When all have finished, any failures are reported.
+
+@param[in]  QByteArray message: progress message from acqcontrol.
+*/
+
+void XbeeControlTool::firmwareProgress(const QByteArray message)
+{
+    if (updateState.isEmpty()) return;
+    int count = message[2];
+    for (int i = 0; (i < count) && (5+3*i < message.size()); i++)
+    {
+        int row = message[3+3*i];
+        if (! updateState.contains(row)) continue;
+        updateState[row] = message[4+3*i];
+        updateProgress[row] = message[5+3*i];
+    }
+    int total = 0;
+    bool finished = true;
+    QString failed;
+    QMap<int,int>::const_iterator node;
+    for (node = updateState.constBegin(); node != updateState.constEnd(); ++node)
+    {
+        total += updateProgress[node.key()];
+        if (node.value() < FIRMWARE_DONE) finished = false;
+        if (node.value() == FIRMWARE_FAILED)
+            failed.append(QString(" %1").arg(node.key()));
+    }
+    XbeeControlFormUi.uploadProgressBar->setValue(total/updateState.size());
+    if (finished)
+    {
+        updateState.clear();
+        updateProgress.clear();
+        XbeeControlFormUi.uploadProgressBar->setVisible(false);
+        if (! failed.isEmpty())
+            QMessageBox::warning(this,"",QString("Firmware update failed on rows%1").arg(failed));
+    }
+}
+
 //-----------------------------------------------------------------------------
 /** @brief Load a .hex file to either Flash or EEPROM with GUI feedback
 
@@ -836,12 +1170,17 @@ int XbeeControlTool::loadHexGUI(QFile* file, int row)
     firmwareCommand.clear();
     firmwareCommand.append('S');
     firmwareCommand.append(char(row));
-/* Clear all FLASH */
+/* Clear all FLASH, unless binary records are used, as then only pages that
+have changed are erased when written. */
     response = 0;
-    firmwareCommand.append('X');
-    comCommand = firmwareCommand.at(0);
-    errorCode = sendCommand(&firmwareCommand,tcpSocket);
-    if (errorCode > 0) failPoint = 4;
+    if (XbeeControlFormUi.binaryUpload->isChecked()) response = 'Y';
+    else
+    {
+        firmwareCommand.append('X');
+        comCommand = firmwareCommand.at(0);
+        errorCode = sendCommand(&firmwareCommand,tcpSocket);
+        if (errorCode > 0) failPoint = 4;
+    }
 /* Ask for a confirmation or error code, loop until something received
 or abort if nothing comes back in a reasonable time. */
     int count = 0;
@@ -860,7 +1199,60 @@ or abort if nothing comes back in a reasonable time. */
         comCommand = firmwareCommand.at(0);
         errorCode = sendCommand(&firmwareCommand,tcpSocket);
     }
-    if (failPoint == 0)
+/* Convert the file to a binary image. Read back the CRC of each page in the
+node and send windowed records only for pages that differ, with only lost
+records being sent again. A page is sent compressed if it fits in one record
+and is smaller. Read the CRCs again to verify the pages before sending the final
+record, which starts the application. */
+    if ((failPoint == 0) && XbeeControlFormUi.binaryUpload->isChecked())
+    {
+        QByteArray image;
+        QVector<quint16> crcs;
+        int pageSize = 0;
+        if (! hexToImage(file, &image)) failPoint = 9;
+        else if (! readPageCrcs(image.size(), row, &crcs, &pageSize)) failPoint = 12;
+        if (failPoint == 0)
+        {
+            while (image.size() % pageSize) image.append((char)0xFF);
+            int rawSize = qMin(pageSize, BINARY_RECORD_SIZE);
+            QList<QByteArray> records;
+            for (int address = 0; address < image.size(); address += pageSize)
+            {
+                QByteArray page = image.mid(address, pageSize);
+                int pageNumber = address/pageSize;
+                if ((pageNumber < crcs.size()) && (crc16(page) == crcs.at(pageNumber)))
+                    continue;
+                QByteArray compressed = compressPage(page);
+                if ((pageSize <= 256) && (compressed.size() <= COMPRESSED_RECORD_SIZE) &&
+                    (compressed.size() < pageSize))
+                    records.append(windowedRecord('Z', records.size(), address,
+                                                  compressed));
+                else for (int offset = 0; offset < pageSize; offset += rawSize)
+                    records.append(windowedRecord('W', records.size(), address+offset,
+                                                  page.mid(offset, rawSize)));
+            }
+#ifdef DEBUG
+            qDebug() << "Sending" << records.size() << "records for"
+                     << image.size()/pageSize << "pages";
+#endif
+            XbeeControlFormUi.uploadProgressBar->setMaximum(records.size());
+            failPoint = sendFirmwareWindowed(&records, row);
+            if ((failPoint == 0) && ! readPageCrcs(image.size(), row, &crcs, &pageSize))
+                failPoint = 12;
+            for (int page = 0; (failPoint == 0) && (page*pageSize < image.size()); page++)
+                if (crc16(image.mid(page*pageSize, pageSize)) != crcs.at(page))
+                    failPoint = 13;
+/* Finish the image, which is only accepted when all records have arrived */
+            if (failPoint == 0)
+            {
+                QByteArray record = windowedRecord('W', records.size(), 0, QByteArray());
+                char status = sendFirmwareRecord(&record, row);
+                if (status == 0) failPoint = 7;
+                else if (status != 'J') failPoint = 10;
+            }
+        }
+    }
+    else if (failPoint == 0)
     {
 /* Open file stream, read each line, test and send off to target */
         QTextStream stream(file);
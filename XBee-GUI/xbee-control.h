@@ -30,10 +30,32 @@ Title:    XBee Control and Display GUI Tool
 #include <QString>
 #include <QStandardItemModel>
 #include <QFile>
+#include <QMap>
+#include <QVector>
 
 #define DEFAULT_TCP_PORT    58532        // port for the external command I/F
 #define DEFAULT_TCP_ADDRESS "127.0.0.1"
 
+// Data bytes in a binary firmware record. A power of two to fill pages exactly.
+#define BINARY_RECORD_SIZE  64
+// Windowed firmware transfer: records outstanding, acknowledgement polling
+// interval (ms), and polls before an unacknowledged record is sent again.
+// The bootloader counts records in 8 bits and maps 16 beyond the first missing.
+#define FIRMWARE_WINDOW     8
+#define WINDOW_POLL_TIME    50
+#define WINDOW_RESEND_POLLS 10
+#define WINDOW_RECORDS      256
+#define ACK_MAP_BITS        16
+// Page CRCs asked of the bootloader at a time
+#define PAGE_CRC_QUERY      14
+// Largest compressed page sent in a single record
+#define COMPRESSED_RECORD_SIZE 78
+// Firmware update run by acqcontrol: image bytes per load command, and the
+// final states of a node reported in the progress messages.
+#define FIRMWARE_CHUNK      128
+#define FIRMWARE_DONE       8
+#define FIRMWARE_FAILED     9
+
 #ifdef WIN32
 #include <Windows.h>
 #define millisleep(a) Sleep(a)
@@ -77,6 +99,12 @@ private:
     int sendAtCommand(const QByteArray *atCommand, QTcpSocket *tcpSocket,
                       const int row, const bool remote, const int timeout);
     int loadHexGUI(QFile* file, int row);
+    char sendFirmwareRecord(const QByteArray *record, int row);
+    int sendFirmwareWindowed(const QList<QByteArray> *records, int row);
+    bool readPageCrcs(int imageSize, int row, QVector<quint16> *crcs,
+                      int *pageSize);
+    int loadHexServer(QFile* file);
+    void firmwareProgress(const QByteArray message);
 // Variables
     QTcpSocket *tcpSocket;
     QString errorMessage;
@@ -90,6 +118,9 @@ private:
     int tableLength;
     QStandardItemModel *table;
     char response;
+// Nodes in a firmware update run by acqcontrol, with their state and progress
+    QMap<int,int> updateState;
+    QMap<int,int> updateProgress;
 };
 
 #endif
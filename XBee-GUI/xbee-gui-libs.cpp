@@ -135,3 +135,144 @@ QString convertNum(const QByteArray response, const uchar startIndex,
     return commandData;
 }
 
+//-----------------------------------------------------------------------------
+/** @brief Read an Intel Hex file into a binary image
+
+Data records are placed in the image at their addresses with any gaps filled by
+0xFF, being the erased state of Flash. Extended address records are ignored as
+the target AVRs have no more than 64K of Flash.
+
+@parameter  QFile *file: already opened for reading.
+@parameter  QByteArray *image: the image, starting at address zero.
+@returns    true if the file was read without error.
+*/
+
+bool hexToImage(QFile *file, QByteArray *image)
+{
+    image->clear();
+    QTextStream stream(file);
+    while (! stream.atEnd())
+    {
+        QString line = stream.readLine().trimmed();
+        if (line.isEmpty()) continue;
+        if (line[0] != ':') return false;
+        QByteArray record = QByteArray::fromHex(line.mid(1).toLatin1());
+        if (record.size() < 5) return false;
+        uchar checksum = 0;
+        for (int i = 0; i < record.size(); i++) checksum += (uchar)record[i];
+        int length = (uchar)record[0];
+        if ((checksum != 0) || (record.size() != length+5)) return false;
+        int address = ((uchar)record[1] << 8) + (uchar)record[2];
+        int type = record[3];
+        if (type == 1) break;
+        if (type != 0) continue;
+        if (image->size() < address+length)
+            image->append(QByteArray(address+length-image->size(), (char)0xFF));
+        image->replace(address, length, record.mid(4, length));
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+/** @brief Compute the CRC-16 (XModem) of a byte array
+
+This matches _crc_xmodem_update() in avr-libc as used by the bootloader.
+*/
+
+quint16 crc16(const QByteArray data)
+{
+    quint16 crc = 0;
+    for (int i = 0; i < data.size(); i++)
+    {
+        crc ^= ((quint16)(uchar)data[i] << 8);
+        for (int bit = 0; bit < 8; bit++)
+        {
+            if (crc & 0x8000) crc = (crc << 1) ^ 0x1021;
+            else crc <<= 1;
+        }
+    }
+    return crc;
+}
+
+//-----------------------------------------------------------------------------
+/** @brief Build a windowed firmware record
+
+The record is the command, the sequence number, the two byte address, the data
+and a CRC-16 over all but the command. The command is 'W' for raw data or 'Z'
+for a compressed page. A 'W' record without data finishes the image.
+*/
+
+QByteArray windowedRecord(const char command, const int sequence,
+                          const int address, const QByteArray data)
+{
+    QByteArray record;
+    record.append((char)sequence);
+    record.append((char)(address >> 8));
+    record.append((char)address);
+    record.append(data);
+    quint16 crc = crc16(record);
+    record.append((char)(crc >> 8));
+    record.append((char)crc);
+    record.prepend(command);
+    return record;
+}
+
+//-----------------------------------------------------------------------------
+/** @brief Compress a Flash page for a 'Z' record
+
+LZSS as decompressed by the bootloader. Each control byte gives the type of the
+next eight items, least significant bit first. A one is a literal byte. A zero
+is a match of two bytes, the distance back less one then the length less three,
+found by searching the page so far. Trailing 0xFF are dropped as the bootloader
+fills the page with 0xFF first, but at least one byte is kept so that the record
+is not taken as the final one.
+
+@param[in]  QByteArray page: Flash page of up to 256 bytes.
+@returns    QByteArray: compressed page.
+*/
+
+QByteArray compressPage(const QByteArray page)
+{
+    QByteArray out;
+    int size = page.size();
+    while ((size > 1) && ((uchar)page.at(size-1) == 0xFF)) size--;
+    int control = 0;
+    int items = 8;
+    int in = 0;
+    while (in < size)
+    {
+        if (items == 8)
+        {
+            control = out.size();
+            out.append((char)0);
+            items = 0;
+        }
+        int bestLength = 0;
+        int bestDistance = 0;
+        for (int distance = 1; (distance <= in) && (distance <= 256); distance++)
+        {
+            int match = 0;
+            while ((in+match < size) && (match < 258) &&
+                   (page.at(in+match) == page.at(in+match-distance)))
+                match++;
+            if (match > bestLength)
+            {
+                bestLength = match;
+                bestDistance = distance;
+            }
+        }
+        if (bestLength >= 3)
+        {
+            out.append((char)(bestDistance-1));
+            out.append((char)(bestLength-3));
+            in += bestLength;
+        }
+        else
+        {
+            out[control] = (char)(out.at(control) | (1 << items));
+            out.append(page.at(in++));
+        }
+        items++;
+    }
+    return out;
+}
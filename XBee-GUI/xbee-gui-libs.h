@@ -25,6 +25,7 @@ Title:    XBee Control and Display GUI Tool Common Code Library
 #include <QMessageBox>
 #include <QtNetwork>
 #include <QTcpSocket>
+#include <QFile>
 #include <QTextStream>
 #include <QDebug>
 #include <cstdlib>
@@ -42,4 +43,9 @@ void setComStatus(const comStatus status);
 void ssleep(const int seconds);
 QString convertNum(const QByteArray response, const uchar startIndex,
                    const uchar length, const int base);
+bool hexToImage(QFile *file, QByteArray *image);
+quint16 crc16(const QByteArray data);
+QByteArray windowedRecord(const char command, const int sequence,
+                          const int address, const QByteArray data);
+QByteArray compressPage(const QByteArray page);
 
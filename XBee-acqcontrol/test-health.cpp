@@ -0,0 +1,85 @@
+/**
+@brief XBee Acquisition Control node health test
+
+A report with a failed delivery is encoded as the node firmware does, with the
+Tx Status code in the top six bits of the data word, then decoded as the data
+callback does. The code must reach the health record unchanged.
+
+Returns zero if all checks pass.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee-acqcontrol.h"
+#include "xbee-health.h"
+#include <stdio.h>
+#include <stdint.h>
+
+char debug;
+
+/* Tx Status codes of a failed delivery */
+#define NETWORK_ACK_FAILURE     0x21
+#define ROUTE_NOT_FOUND         0x25
+
+static int failures;
+
+/*--------------------------------------------------------------------------*/
+/** @brief Check a byte of the health record
+
+@parameter  const char *name: what is checked.
+@parameter  int value: value found.
+@parameter  int expected: value expected.
+*/
+static void check(const char *name, const int value, const int expected)
+{
+    if (value != expected)
+    {
+        printf("FAIL %s: %d, expected %d\n", name, value, expected);
+        failures++;
+    }
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Send an 'S' report through the data word to the health of a node
+
+@parameter  int row: node table row.
+@parameter  uint8_t delivery: Tx Status code held by the node.
+*/
+static void sendDelivery(const int row, const uint8_t delivery)
+{
+/* Data word has count 16 bits, voltage 10 bits, status 6 bits */
+    uint32_t parameter = delivery;
+    uint32_t count = 5 + (((uint32_t)512 & 0x3FF)<<16) + ((parameter & 0x3F)<<26);
+    healthReport(row, 'S', count >> 26, true);
+}
+
+int main(void)
+{
+    char record[HEALTH_RECORD];
+    int row = 1;
+    sendDelivery(row, NETWORK_ACK_FAILURE);
+    sendDelivery(row, NETWORK_ACK_FAILURE);
+    sendDelivery(row, ROUTE_NOT_FOUND);
+    check("record length", healthRecord(row, record), HEALTH_RECORD);
+    check("row", record[0], row);
+    check("'S' reports", (record[9] << 8) + record[10], 3);
+    check("last code", (uint8_t)record[20], ROUTE_NOT_FOUND);
+    check("most frequent code", (uint8_t)record[21], NETWORK_ACK_FAILURE);
+    if (failures == 0) printf("PASS health delivery codes\n");
+    return (failures > 0);
+}
@@ -0,0 +1,79 @@
+/**
+@brief XBee Acquisition Control background task test
+
+A periodic task is left without the main loop calling taskRun for three and a
+half periods. When it does run, the three periods passed over must be counted
+as late and the task must run only once.
+
+Returns zero if all checks pass.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee-tasks.h"
+#include <stdio.h>
+#include <unistd.h>
+
+char debug;
+
+#define PERIOD                  100     // Task period in ms
+
+static int failures;
+static int calls;
+
+/*--------------------------------------------------------------------------*/
+/** @brief Check a value
+
+@parameter  const char *name: what is checked.
+@parameter  int value: value found.
+@parameter  int expected: value expected.
+*/
+static void check(const char *name, const int value, const int expected)
+{
+    if (value != expected)
+    {
+        printf("FAIL %s: %d, expected %d\n", name, value, expected);
+        failures++;
+    }
+}
+
+static void count(void *)
+{
+    calls++;
+}
+
+int main(void)
+{
+    if (taskStart() < 0)
+    {
+        printf("FAIL task timer\n");
+        return 1;
+    }
+    int id = taskAdd("count", count, NULL, 0, PERIOD);
+/* The run due now and the three due after it are all passed before the loop
+gets to the task. */
+    usleep((3*PERIOD + PERIOD/2)*1000);
+    taskRun();
+    taskEntry entry;
+    check("task", taskInfo(id, &entry), true);
+    check("calls", calls, 1);
+    check("runs", entry.runs, 1);
+    check("late", entry.late, 3);
+    if (failures == 0) printf("PASS task periods skipped\n");
+    return (failures > 0);
+}
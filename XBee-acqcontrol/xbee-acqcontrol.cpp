@@ -54,6 +54,17 @@ Compiler: gcc 4.8.2
 
 #include "xbee.h"
 #include "xbee-acqcontrol.h"
+#include "xbee-firmware-update.h"
+#include "xbee-mailbox.h"
+#include "xbee-wake-control.h"
+#include "xbee-tx-scheduler.h"
+#include "xbee-fragment.h"
+#include "xbee-gap.h"
+#include "xbee-liveness.h"
+#include "xbee-tasks.h"
+#include "xbee-metrics.h"
+#include "xbee-health.h"
+#include "xbee-rssi.h"
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
@@ -61,6 +72,7 @@ Compiler: gcc 4.8.2
 #include <unistd.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -91,6 +103,10 @@ bool localATResponseRcvd;       /* Signal response to a local AT command receive
 uint8_t localATLength;
 char localATResponseData[SIZE]; /* The data record received with a local AT response */
 FILE *fp;                       /* File for results */
+/* The results file is written by libxbee callbacks and flushed by the task
+thread, so every use of fp holds this mutex. It is recursive as the callbacks
+call dataFileCheck and the print functions with it held. */
+pthread_mutex_t fileMutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 FILE *fpd;                      /* File for XBee remode node table */
 FILE *log;                      /* File for libxbee logging */
 int flushCount;                 /* Number of records to flush buffers to disk. */
@@ -122,6 +138,9 @@ void modemStatusCallback(struct xbee *xbee, struct xbee_con *con,
 int min(int x, int y) {if (x>y) return y; else return x;}
 int findRowBy64BitAddress(unsigned char *addr);
 int findRowBy16BitAddress(uint16_t addr);
+int ackOptions(const int row, const int sequence, char *ack);
+int reportAccept(const int row, const int sequence,
+                 const unsigned long int dataField);
 void debugDumpNodeTable(void);
 void debugDumpPacket(struct xbee_pkt **pkt);
 void printNodeID(struct xbee_pkt **pkt);
@@ -129,6 +148,9 @@ void printRemoteATResponse(struct xbee_pkt **pkt);
 void printLocalATResponse(struct xbee_pkt **pkt);
 void printTxStatus(struct xbee_pkt **pkt);
 void printModemStatus(struct xbee_pkt **pkt);
+void dataReceive(struct xbee *xbee, struct xbee_con *con,
+                 struct xbee_pkt **pkt, void **data, const bool reassembled);
+int dataFileRotate();
 
 /*++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
 /** @brief XBee Acquisition Control Main Program
@@ -256,6 +278,13 @@ log file */
         return 1;
     }
 
+/* All frames from here on are sent through the transmit scheduler. */
+    if (! txSchedulerStart())
+    {
+        closelog();
+        return 1;
+    }
+
 #ifdef DEBUG
     if (debug)
         printf("XBee Instance Started\n");
@@ -282,6 +311,7 @@ and new remote XBee nodes */
     if (debug)
         printf("Connections probed and opened\n");
 #endif
+    livenessStart(time(NULL));
 
 /*--------------------------------------------------------------------------*/
 /* Setup the Internet command interface socket. */
@@ -303,17 +333,42 @@ and new remote XBee nodes */
 
 /* keep track of the biggest file descriptor */
     fdmax = listener;
+
+/* Add the timer for background tasks, which run in the main loop. */
+    int timer = taskStart();
+    if (timer < 0)
+    {
+        closelog();
+        return 1;
+    }
+    FD_SET(timer, &master);
+    if (timer > fdmax) fdmax = timer;
+    taskAdd("liveness", livenessUpdate, NULL, LIVENESS_TICK*1000,
+            LIVENESS_TICK*1000);
+    taskAdd("flush", dataFileFlush, NULL, TASK_FLUSH_PERIOD, TASK_FLUSH_PERIOD);
+
+/* Add the local port serving the metrics, if it can be opened. */
+    int metrics = metricsStart();
+    if (metrics >= 0)
+    {
+        FD_SET(metrics, &master);
+        if (metrics > fdmax) fdmax = metrics;
+    }
+
     int fdnumber = fdmax;
     dataResponseRcvd = false;
+    firmwareImageClear();
 
 /*--------------------------------------------------------------------------*/
-/* Main loop. This handles only the Internet interface. The remote node
-interface is handled in callback functions via libxbee. */
+/* Main loop. This handles the Internet interface, the metrics port and runs the
+background tasks. The remote node interface is handled in callback functions
+via libxbee. */
 
     for(;;)
     {
-/* Check Internet connections. When data arrives command_handler is called */
-        check_connections(&master, &fdmax, listener);
+/* Check Internet connections. When data arrives command_handler is called, and
+when the task timer fires the tasks due are run. */
+        check_connections(&master, &fdmax, listener, timer, metrics);
         if (fdnumber > fdmax)
         {
             syslog(LOG_INFO, "New connection %d\n",fdmax);
@@ -354,7 +409,50 @@ R send a remote AT command to the selected node. The command follows in the
    data field.
 r check for a response to a previously sent remote AT command.
 S send an ASCII string to a remote node on the established data connection.
+U send binary data to a remote node on the established data connection. The
+   length of the data is taken from the message length.
 s check for a response to a previously sent node MCU command.
+M post a message to the mailbox of a sleeping node, with the type 'S' for a
+   string to the node MCU or 'R' for a remote AT command, then the message. It is
+   delivered when the node next reports and the result is pushed back to this
+   client as an 'm' message with the row, type, a status of 'Y' with the
+   response, 'N' if it could not be sent or 'T' if there was no response.
+C set a parameter of a node to be carried in the ACK to its next report, with
+   'W' and a two byte wake interval, 'A' and a byte to keep the XBee awake or
+   not, 'B' and a byte giving the cycles between battery readings, or 'T' alone
+   to set the node clock.
+W put the wake interval of a node under automatic control with a nonzero byte,
+   or release it with zero, followed by the shortest and longest intervals in
+   WDT ticks as two bytes each (zero for defaults). With no data the interval
+   last set is returned in two bytes, zero if the node is not under control.
+O return the process metrics in the Prometheus text format, as served on the
+   local metrics port. The text is sent in as many replies as needed, each with
+   a status of '+' if more follows or 'Y' for the last.
+J return the name and accounting of a background task, given its index in a
+   byte: the name in TASK_NAME bytes, then four bytes each of the period in ms,
+   the number of runs, the periods skipped, the total runtime in ms and the
+   longest run in microseconds. 'N' is returned if there is no such task.
+Y return the liveness of the node in the row: 'U' not heard since startup, 'A'
+   heard within the deadline set from its wake interval, or 'S' stale, followed
+   by the seconds since it was last heard in four bytes (all ones if never).
+   With a nonzero byte the client is sent a 'y' message with the row and state
+   whenever a node changes state, and with zero it is no longer sent them.
+K return the link and protocol health of every node, HEALTH_RECORD bytes each,
+   in as many replies as needed with a status of '+' if more follows or 'Y' for
+   the last. Each has the row, two bytes each of the 'C', 'T', 'N', 'E' and 'S'
+   reports, the cycles completed and abandoned, the percentages of cycles
+   completed and completed at the first attempt, two bytes of the ACK round trip
+   in ms, the signal strength in -dBm, and the last and most frequent delivery
+   failure codes. With a nonzero byte the client is sent a 'k' message with the
+   record of the node whenever a cycle of a node ends, and with zero it is not.
+F load a block of firmware image, with a two byte address then data. With no
+   address the image is cleared.
+G start a firmware update job, with the number of nodes to update at once,
+   the airtime budget in records per second (zero for defaults) then the rows.
+f return the progress of the firmware update job, with the row field holding
+   the number of nodes then the row, state and percentage of each. With a
+   nonzero byte the client is also sent this as an 'f' message whenever a node
+   changes state or progress, and with zero it is no longer sent them.
 N return the number of rows in the node table.
 I return the information held about the node in the row.
 X restart the XBee instance (not recommended).
@@ -406,11 +504,31 @@ bool command_handler(const int listener, unsigned char *buf)
             printf(" row %d string ", buf[2]);
             for (uint i=3; i<commandLength; i++) printf("%c", buf[i]);
         }
+        else if (command == 'M')
+        {
+            printf(" row %d mailbox %c ", buf[2], buf[3]);
+            for (uint i=4; i<commandLength; i++) printf("%c", buf[i]);
+        }
+        else if (command == 'U')
+        {
+            printf(" row %d data ", buf[2]);
+            for (uint i=3; i<commandLength; i++) printf("%02X", buf[i]);
+        }
         else if (command == 'E')
         {
             printf(" serial number ");
             for (uint i=3; i<commandLength; i++) printf("%02X", buf[i]);
         }
+        else if (command == 'W')
+        {
+            printf(" row %d wake control", buf[2]);
+            for (uint i=3; i<commandLength; i++) printf(" %d", buf[i]);
+        }
+        else if (command == 'C')
+        {
+            printf(" row %d parameter %c", buf[2], buf[3]);
+            for (uint i=4; i<commandLength; i++) printf(" %d", buf[i]);
+        }
         else if ((command == 'I') ||(command == 'Q') ||(command == 'D') ||(command == 'V'))
                 printf(" row %d", row);
         printf("\n");
@@ -426,7 +544,9 @@ misinterpreted as end of string. */
         case 'L':
             for (j=0; j<commandLength-3; j++) str[j] = buf[j+3];
             replyLength = 3;
-            ret = xbee_connTx(localATCon, NULL, str, commandLength-3);
+            if ((commandLength > 4) && (str[0] == 'D') && (str[1] == 'B'))
+                rssiClientQuery();
+            ret = txSend(localATCon, -1, str, commandLength-3, txCommand);
             reply[2] = ret;
 #ifdef DEBUG
             if (debug)
@@ -462,7 +582,7 @@ misinterpreted as end of string. */
         case 'R':
             for (j=0; j<commandLength-3; j++) str[j] = buf[j+3];
             replyLength = 3;
-            ret = xbee_connTx(nodeInfo[row].atCon, NULL, str, commandLength-3);
+            ret = txSend(nodeInfo[row].atCon, row, str, commandLength-3, txCommand);
             reply[2] = ret;
 #ifdef DEBUG
             if (debug)
@@ -503,7 +623,7 @@ MCU. */
                 strLength++;
             }
             replyLength = 3;
-            ret = xbee_connTx(nodeInfo[row].dataCon, NULL, str, strLength);
+            ret = fragmentSend(nodeInfo[row].dataCon, row, str, strLength, txCommand);
             reply[2] = ret;
 #ifdef DEBUG
             if (debug)
@@ -515,6 +635,171 @@ MCU. */
 #endif
             break;
 
+/* Post a string or remote AT command to the mailbox of a node, for delivery
+when it next reports. */
+        case 'M':
+            replyLength = 3;
+            reply[2] = 'N';
+            if ((commandLength > 4) &&
+                mailboxPost(row, buf[3], buf+4, commandLength-4, listener))
+                reply[2] = 'Y';
+            break;
+
+/* Set a parameter of a node to be sent in the ACK to its next report. An
+update not yet accepted by the node is sent again. */
+        case 'C':
+            replyLength = 3;
+            reply[2] = 'Y';
+            if ((row >= numberNodes) || (commandLength < 4)) reply[2] = 'N';
+            else if ((buf[3] == ACK_WAKE) && (commandLength > 5))
+            {
+                nodeInfo[row].configWake = (buf[4] << 8) + buf[5];
+                nodeInfo[row].configFlags |= CONFIG_WAKE;
+                nodeInfo[row].configSent &= ~CONFIG_WAKE;
+            }
+            else if ((buf[3] == ACK_AWAKE) && (commandLength > 4))
+            {
+                nodeInfo[row].configAwake = buf[4];
+                nodeInfo[row].configFlags |= CONFIG_AWAKE;
+                nodeInfo[row].configSent &= ~CONFIG_AWAKE;
+            }
+            else if ((buf[3] == ACK_BATTERY) && (commandLength > 4))
+            {
+                nodeInfo[row].configBattery = buf[4];
+                nodeInfo[row].configFlags |= CONFIG_BATTERY;
+                nodeInfo[row].configSent &= ~CONFIG_BATTERY;
+            }
+            else if (buf[3] == ACK_TIME)
+            {
+                nodeInfo[row].configFlags |= CONFIG_TIME;
+                nodeInfo[row].configSent &= ~CONFIG_TIME;
+            }
+            else reply[2] = 'N';
+            break;
+
+/* Put the wake interval of a node under control or release it. */
+        case 'W':
+            replyLength = 3;
+            reply[2] = 'Y';
+            if (commandLength == 3)
+            {
+                temp = wakeControlInterval(row);
+                reply[replyLength++] = (char) (temp >> 8);
+                reply[replyLength++] = (char) (temp);
+            }
+            else if ((commandLength < 8) ||
+                     ! wakeControlSet(row, buf[3] > 0, (buf[4] << 8) + buf[5],
+                                      (buf[6] << 8) + buf[7]))
+                reply[2] = 'N';
+            break;
+
+/* Return the process metrics. All but the last part are sent here. */
+        case 'O':
+            {
+                char *text = (char *)malloc(METRICS_BUFFER);
+                replyLength = 3;
+                reply[2] = 'N';
+                if (text == NULL) break;
+                int length = metricsRender(text, METRICS_BUFFER);
+                int sent = 0;
+                for (;;)
+                {
+                    int part = min(length - sent, METRICS_PART);
+                    replyLength = 3;
+                    reply[2] = (sent + part < length) ? '+' : 'Y';
+                    memcpy(reply+replyLength, text+sent, part);
+                    replyLength += part;
+                    sent += part;
+                    if (sent >= length) break;
+                    reply[0] = replyLength;
+                    reply[1] = command;
+                    send(listener, reply, replyLength, 0);
+                }
+                free(text);
+            }
+            break;
+
+/* Return the accounting of a background task. */
+        case 'J':
+            replyLength = 3;
+            reply[2] = 'N';
+            {
+                taskEntry entry;
+                if ((commandLength > 3) && taskInfo(buf[3], &entry))
+                {
+                    reply[2] = 'Y';
+                    memcpy(reply+replyLength, entry.name, TASK_NAME);
+                    replyLength += TASK_NAME;
+                    uint32_t field[5] = {entry.period, entry.runs, entry.late,
+                                         (uint32_t)(entry.runtime/1000), entry.longest};
+                    for (i=0; i<5; i++)
+                    {
+                        reply[replyLength++] = (char) (field[i] >> 24);
+                        reply[replyLength++] = (char) (field[i] >> 16);
+                        reply[replyLength++] = (char) (field[i] >> 8);
+                        reply[replyLength++] = (char) (field[i]);
+                    }
+                }
+            }
+            break;
+
+/* Return the health of all nodes, or subscribe to it. All but the last part
+are sent here. */
+        case 'K':
+            replyLength = 3;
+            reply[2] = 'Y';
+            if (commandLength > 3) healthClientSet(listener, buf[3] > 0);
+            else
+            {
+                int partNodes = METRICS_PART/HEALTH_RECORD;
+                for (i=0; i<numberNodes; i++)
+                {
+                    replyLength += healthRecord(i, reply+replyLength);
+                    if ((i == numberNodes-1) || ((i+1) % partNodes > 0)) continue;
+                    reply[0] = replyLength;
+                    reply[1] = command;
+                    reply[2] = '+';
+                    send(listener, reply, replyLength, 0);
+                    replyLength = 3;
+                }
+                reply[2] = 'Y';
+            }
+            break;
+
+/* Return the liveness of a node, or subscribe to changes of liveness. */
+        case 'Y':
+            replyLength = 3;
+            reply[2] = 'Y';
+            if (commandLength > 3) livenessClientSet(listener, buf[3] > 0);
+            else
+            {
+                time_t lastHeard;
+                reply[replyLength++] = livenessState(row, &lastHeard);
+                temp = (lastHeard > 0) ? time(NULL) - lastHeard : 0xFFFFFFFF;
+                reply[replyLength++] = (char) (temp >> 24);
+                reply[replyLength++] = (char) (temp >> 16);
+                reply[replyLength++] = (char) (temp >> 8);
+                reply[replyLength++] = (char) (temp);
+            }
+            break;
+
+/* Send binary data to a remote node on its established data connection.
+Use the libxbee connTx command as there may be zeros which would be
+misinterpreted as end of string. This is used for firmware records. */
+        case 'U':
+            for (j=0; j<commandLength-3; j++) str[j] = buf[j+3];
+            replyLength = 3;
+            ret = txSend(nodeInfo[row].dataCon, row, str, commandLength-3, txBulk);
+            reply[2] = ret;
+#ifdef DEBUG
+            if (debug)
+            {
+                printf("Data Record sent: length %d", commandLength-3);
+                printf(" status returned %s\n", xbee_errorToStr(ret));
+            }
+#endif
+            break;
+
 /* Check for a response to a previously sent data command to the node MCU.
 If no response was received, a short message is sent back without data.*/
         case 's':
@@ -537,6 +822,42 @@ If no response was received, a short message is sent back without data.*/
             }
             break;
 
+/* Load a block of firmware image into the update engine, or clear it. */
+        case 'F':
+            replyLength = 3;
+            reply[2] = 'Y';
+            if (commandLength < 5) firmwareImageClear();
+            else if (! firmwareImageLoad((buf[3] << 8) + buf[4], buf+5,
+                                         commandLength-5))
+                reply[2] = 'N';
+            break;
+
+/* Start a firmware update job for the rows given. The job continues after
+the client disconnects. */
+        case 'G':
+            replyLength = 3;
+            reply[2] = 'N';
+            if ((commandLength > 5) &&
+                firmwareJobStart(buf+5, commandLength-5, buf[3], buf[4], false))
+                reply[2] = 'Y';
+            break;
+
+/* Start a firmware update job that broadcasts the image to all rows given at
+once, then repairs each node. The format is as for 'G'. */
+        case 'H':
+            replyLength = 3;
+            reply[2] = 'N';
+            if ((commandLength > 5) &&
+                firmwareJobStart(buf+5, commandLength-5, buf[3], buf[4], true))
+                reply[2] = 'Y';
+            break;
+
+/* Return the progress of the firmware update job. */
+        case 'f':
+            if (commandLength > 3) firmwareClientSet(listener, buf[3] > 0);
+            replyLength = firmwareJobProgress(reply);
+            break;
+
 /* Return the number of nodes currently in the table */
         case 'N':
             replyLength = 3;
@@ -732,13 +1053,16 @@ with the data received.
 @parameter  fd_set *master: list of file descriptors 
 @parameter  int *fd_max: number of file descriptors in list
 @parameter  int listener: file handler for the socket created 
+@parameter  int timer: file handler for the task timer
+@parameter  int metrics: file handler for the metrics port, or -1
 @returns    updated *master and *fd_max
 @returns    0: OK
             1: failed select
             2: failed accept
 */
 
-int check_connections(fd_set *master, int *fd_max, const int listener)
+int check_connections(fd_set *master, int *fd_max, const int listener,
+                      const int timer, const int metrics)
 {
 fd_set read_fds;
 int fdmax = *fd_max;
@@ -757,8 +1081,12 @@ int fd,nbytes;
     {
         if (FD_ISSET(fd, &read_fds))
         {
+/* The task timer has fired. */
+            if (fd == timer) taskRun();
+/* A request for the metrics is answered and closed at once. */
+            else if (fd == metrics) metricsServe(metrics);
 /* Check the local listening socket (means a new connection has arrived). */
-            if (fd == listener)
+            else if (fd == listener)
             {
                 addrlen = sizeof remoteaddr;
 /* accept() doesn't block because we know there is a new connection pending */
@@ -781,13 +1109,20 @@ int fd,nbytes;
                 {
 /* got error or connection was closed by client. Remove from the list (in case
 of error just let client die as we are running as a background process) */
+                    firmwareClientSet(fd, false);
+                    mailboxClientRemove(fd);
+                    livenessClientSet(fd, false);
+                    healthClientSet(fd, false);
                     close(fd);
                     FD_CLR(fd, master); /* remove from master set */
                 }
                 else
                 {
 /* we got some data from a client so call a command handler. */
+                    uint64_t start = metricsTime();
                     command_handler(fd, buf);
+                    metricsCount(metricClientCommands);
+                    metricsLatency(metricClientCommand, start);
                 }
             } /* finished handling new or data from client */
         } /* finished connection ready */
@@ -1474,14 +1809,31 @@ before any other node MCU command is sent to any node.
 - 'S' xx xx aa aa … (11 bytes) Repeat message in response to delivery failure.
 - 'N' xx xx aa aa … (11 bytes) Repeat message in response to a NAK.
 - 'T' xx xx aa aa … (11 bytes) Repeat message in response to a timeout.
+  Each of these may have a sequence number of SEQUENCE_LENGTH hex characters
+  after the command, and may be followed by an inter-pulse interval histogram of
+  HISTOGRAM_LENGTH bytes: a checksum then HISTOGRAM_BINS counts, all in hex.
 - 'X' (1 byte) Remote will abandon the communication attempt.
 - 'A' (1 byte) Remote accepts the communication.
+- 'H' nn cccc … Counts of past wake intervals, newest first, asked for after a
+  gap in the reports.
 - 'D' aa aa … (unlimited bytes) Debug message.
+- 'B' s aaaa (6 bytes) Bootloader response to a binary firmware record.
+- 'W' s nn mmmm (8 bytes) Bootloader response to a windowed firmware record.
+- 'K' pp ww cccc … Bootloader response to a page CRC query.
+- '+' m i n … Fragment i of n of message m, handled when the message is whole.
 
 Refer to the documentation for a description and analysis of the protocol. The
 protocol maintains a state across calls to this function so that in the last
 stage the probability of lost data is minimized.
 
+Intervals in which a node was not heard, and cycles it abandoned, are recorded
+in the data file as they are found.
+
+A node may send up to REPORT_WINDOW sequenced reports before the first is
+acknowledged. They are accepted in order only and the ACK carries the sequence
+of the last accepted, acknowledging all before it. Accepted reports are held
+until the node confirms with its final 'A', then all are stored.
+
 TODO The data received is oriented to 32 bit counts. Needs generalization to
 other data types.
 
@@ -1494,16 +1846,31 @@ other data types.
 void dataCallback(struct xbee *xbee, struct xbee_con *con,
                   struct xbee_pkt **pkt, void **data)
 {
-/* Query the local coordinator XBee for the last received signal strength.
-This may not be a good idea and could upset the flow of the program especially
-when many nodes are present. But it is the only way to get RSS. Use sparingly
-by setting "-e 3". RSS will be printed out in the local AT callback. */
-#ifdef DEBUG
-    {
-        if ((debug > 2) && localATCon) xbee_conTx(localATCon, NULL, "DB");
-    }
-#endif
+    pthread_mutex_lock(&fileMutex);
+    dataReceive(xbee, con, pkt, data, false);
+    pthread_mutex_unlock(&fileMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Process a frame received on the data connection
 
+Called from dataCallback with the file mutex held, and again for a message
+reassembled from fragments. The frame accounting has then already been done for
+each fragment, so is not repeated for the whole message.
+
+@param struct xbee *xbee. The XBee instance created in setupXbeeInstance().
+@param struct xbee_con *con. Connection (not used).
+@param struct xbee_pkt **pkt. Packet from the XBee that invoked this callback.
+@param void **data. Data (not used).
+@param bool reassembled. The packet is a message reassembled from fragments.
+*/
+
+void dataReceive(struct xbee *xbee, struct xbee_con *con,
+                 struct xbee_pkt **pkt, void **data, const bool reassembled)
+{
+/* Note the time of arrival for the latency of the ACK and of this callback. */
+    uint64_t received = metricsTime();
+    if (! reassembled && ((*pkt)->dataLen > 0)) metricsFrame((*pkt)->data[0]);
     int row = findRowBy64BitAddress((*pkt)->address.addr64);
     char timeString[20];
     time_t now;
@@ -1546,6 +1913,31 @@ by setting "-e 3". RSS will be printed out in the local AT callback. */
 #endif
 /* Add 16 bit address to node table in case it was not already saved. */
     nodeInfo[row].adr = (((uint16_t)(*pkt)->address.addr16[0] << 8)+(*pkt)->address.addr16[1]);
+/* Any packet shows that the node is alive. */
+    if (! reassembled)
+    {
+        livenessHeard(row, now);
+        healthRssi(row, (*pkt)->rssi);
+        rssiFrame(row);
+    }
+/* A message too long for one frame comes in fragments. Once all are in, the
+message is handled as though it had come in a single packet. */
+    if ((writeLength > 0) && ((*pkt)->data[0] == FRAGMENT_MARK))
+    {
+        unsigned char message[FRAGMENT_MESSAGE];
+        int length = fragmentReceive(row, (*pkt)->data, (*pkt)->dataLen, message);
+        if (length <= 0) return;
+        struct xbee_pkt *whole =
+            (struct xbee_pkt *)malloc(sizeof(struct xbee_pkt) + length);
+        if (whole == NULL) return;
+        memcpy(whole, *pkt, sizeof(struct xbee_pkt));
+        memcpy(whole->data, message, length);
+        whole->data[length] = 0;
+        whole->dataLen = length;
+        dataReceive(xbee, con, &whole, data, true);
+        free(whole);
+        return;
+    }
 /* Determine if the packet received is a data packet and check for errors.
 The command is that sent by the application layer protocol in the remote. */
     char command = (*pkt)->data[0];
@@ -1560,7 +1952,28 @@ Error is signalled if length or checksum are wrong. */
                          || (command == 'E') || (command == 'S'))
     {
         nodeInfo[row].protocolState = 1;        /* Start of protocol cycle. */
-        if (writeLength != 11) error = badLength;
+        nodeInfo[row].histogramValid = false;
+/* A sequence number is recognised from the length. The fields that follow are
+moved along by it. */
+        int sequence = -1;
+        int offset = 0;
+        if ((writeLength == 11+SEQUENCE_LENGTH) ||
+            (writeLength == 11+SEQUENCE_LENGTH+HISTOGRAM_LENGTH))
+        {
+            offset = SEQUENCE_LENGTH;
+            sequence = 0;
+            for (int i=0; i<SEQUENCE_LENGTH; i++)
+            {
+                unsigned int digit=0;
+                char hex = (*pkt)->data[i+1];
+                if ((hex >= '0') && (hex <= '9')) digit = hex - '0';
+                else if ((hex >= 'A') && (hex <= 'F')) digit = hex + 10 - 'A';
+                else error = badHex;
+                sequence = (sequence << 4) + digit;
+            }
+        }
+        else if ((writeLength != 11) && (writeLength != 11+HISTOGRAM_LENGTH))
+            error = badLength;
         if (error == none)
         {
 /* Convert hex ASCII checksum and count to an integer from the latter part of
@@ -1568,7 +1981,7 @@ the string */
             for (int i=0; i<DATA_LENGTH-2; i++)
             {
                 unsigned int digit=0;
-                char hex = (*pkt)->data[i+3];
+                char hex = (*pkt)->data[i+3+offset];
                 if ((hex >= '0') && (hex <= '9')) digit = hex - '0';
                 else if ((hex >= 'A') && (hex <= 'F')) digit = hex + 10 - 'A';
                 else error = badHex;
@@ -1579,7 +1992,7 @@ the string */
             for (int i=0; i<2; i++)
             {
                 unsigned int digit=0;
-                char hex = (*pkt)->data[i+1];
+                char hex = (*pkt)->data[i+1+offset];
                 if ((hex >= '0') && (hex <= '9')) digit = hex - '0';
                 else if ((hex >= 'A') && (hex <= 'F')) digit = hex + 10 - 'A';
                 else error = badHex;
@@ -1591,9 +2004,37 @@ the string */
 /* Checksum should add up to zero, so send an ACK, otherwise send a NAK */
             if (checksum != 0) error = badChecksum;
         }
+/* Convert the inter-pulse interval histogram if present. The first pair of hex
+digits is a checksum that makes the bin counts add up to zero. Bin 0 holds the
+intervals under one node fine tick, bin n those from 2^(n-1) to 2^n-1 ticks. */
+        if ((error == none) && (writeLength == 11+offset+HISTOGRAM_LENGTH))
+        {
+            unsigned char checksum = 0;
+            for (int i=0; i<HISTOGRAM_BINS+1; i++)
+            {
+                unsigned char value = 0;
+                for (int j=0; j<2; j++)
+                {
+                    unsigned int digit=0;
+                    char hex = (*pkt)->data[11+offset+2*i+j];
+                    if ((hex >= '0') && (hex <= '9')) digit = hex - '0';
+                    else if ((hex >= 'A') && (hex <= 'F')) digit = hex + 10 - 'A';
+                    else error = badHex;
+                    value = (value << 4) + digit;
+                }
+                if (i > 0) nodeInfo[row].histogram[i-1] = value;
+                checksum += value;
+            }
+            if (checksum != 0) error = badChecksum;
+            else if (error == none) nodeInfo[row].histogramValid = true;
+        }
+/* The top six bits of the data word hold the retry count, or the delivery
+status for an 'S' report. */
+        healthReport(row, command, count >> 26, error == none);
         xbee_err txError;
-        char ackResponse[3];
+        char ackResponse[ACK_LENGTH];
         ackResponse[1] = command;
+        ackResponse[2] = 0;
         if (error != none)
         {
 #ifdef DEBUG
@@ -1607,8 +2048,11 @@ the string */
             }
 #endif
 /* Negative Acknowledge */
+            metricsDecodeError(error);
             ackResponse[0] = 'N';
-            txError = xbee_conTx(con, NULL, ackResponse);
+            txError = txPost(con, row, (unsigned char*)ackResponse,
+                             strlen(ackResponse), txAck, received) ? XBEE_ENONE : XBEE_ENOMEM;
+            metricsCount((txError == XBEE_ENONE) ? metricNakSent : metricAckQueueFull);
         }
         else
         {
@@ -1619,15 +2063,32 @@ the string */
                 if (fp != NULL) fprintf(fp,"Sent ACK %s\n",nodeInfo[row].nodeIdent);
             }
 #endif
-/* Store data field aside for later recording. */
-            for (int i=0; i<DATA_LENGTH; i++) remoteData[i][row] = (*pkt)->data[i+1];
+/* Record any intervals missed since the last report from this node. */
+            int missed = gapReport(row, now);
+            if ((missed > 0) && (fp != NULL))
+                fprintf(fp,"Gap %s %s Missed %d\n",
+                        nodeInfo[row].nodeIdent, timeString, missed);
+/* Take the report in sequence and store the data field aside for later
+recording. */
+            int last = reportAccept(row, sequence, count);
+            for (int i=0; i<DATA_LENGTH; i++) remoteData[i][row] = (*pkt)->data[i+1+offset];
             dataField = count;
-/* Check if there are any pending data transmissions to the remote and send now */
-// txError = xbee_conTx(con, NULL, "P");    /* Insert application packet for test */
-// usleep(500000);                 /* Insert delay for test */
-/* Acknowledge */
+/* Let the wake controller adjust the interval for this node and move it to
+its transmit slot */
+            wakeControlReport(row, command, dataField);
+            wakeControlPhase(row, command, now);
+/* Acknowledge, with the sequence accepted, any parameter updates and the
+mailbox flag as options. */
             ackResponse[0] = 'A';
-            txError = xbee_conTx(con, NULL, ackResponse);
+            ackOptions(row, last, ackResponse+2);
+            txError = txPost(con, row, (unsigned char*)ackResponse,
+                             strlen(ackResponse), txAck, received) ? XBEE_ENONE : XBEE_ENOMEM;
+            metricsCount((txError == XBEE_ENONE) ? metricAckSent : metricAckQueueFull);
+            if (txError == XBEE_ENONE) healthAckSent(row);
+/* Ask the coordinator for the signal strength of the report if the frame did
+not carry it. The query is rate limited. */
+            if ((txError == XBEE_ENONE) && ((*pkt)->rssi == 0))
+                rssiSample(localATCon, row, now);
 /* Advance the protocol state to indicate acceptance of any response as ACK. */
             nodeInfo[row].protocolState = 2;
         }
@@ -1641,11 +2102,71 @@ the string */
         }
 #endif
     }
+/* This is a response from the bootloader to a binary or windowed firmware
+record or a page CRC query. It is checked first as the node may have been reset
+into the bootloader part way through a protocol cycle. Windowed responses are cumulative so only
+the latest need be kept. Responses for nodes being updated by the firmware
+update engine are passed to it. */
+    else if ((command == 'B') || (command == 'W') || (command == 'K'))
+    {
+        nodeInfo[row].protocolState = 1;
+        if (firmwareDataResponse(row, (*pkt)->data, writeLength)) return;
+        int length = min(SIZE-1,writeLength);
+        for (int i=0; i<length; i++) dataResponseData[i] = (*pkt)->data[i];
+        dataResponseData[length] = 0;
+        dataResponseRcvd = true;
+    }
+/* This is the history of past wake intervals that the node sends when asked
+after a gap. Each interval is recorded, oldest first, with the time it is
+estimated to have ended, so that the missed intervals are filled in. It follows
+the final 'A' of the cycle, so it is checked before the accept below in case
+the 'A' was lost. */
+    else if (command == 'H')
+    {
+        unsigned int value[1+GAP_HISTORY];
+        memset(value, 0, sizeof(value));
+        bool valid = (writeLength >= GAP_HISTORY_HEADER);
+        for (int i=1; valid && (i<writeLength); i++)
+        {
+            int field = 0;
+            if (i >= GAP_HISTORY_HEADER)
+                field = 1 + (i - GAP_HISTORY_HEADER)/GAP_HISTORY_COUNT;
+            unsigned int digit=0;
+            char hex = (*pkt)->data[i];
+            if ((hex >= '0') && (hex <= '9')) digit = hex - '0';
+            else if ((hex >= 'A') && (hex <= 'F')) digit = hex + 10 - 'A';
+            else valid = false;
+            if (field > GAP_HISTORY) valid = false;
+            else value[field] = (value[field] << 4) + digit;
+        }
+        int intervals = value[0];
+        if (writeLength != GAP_HISTORY_HEADER + intervals*GAP_HISTORY_COUNT)
+            valid = false;
+#ifdef DEBUG
+        if (debug) printf("History %s %d intervals%s\n", nodeInfo[row].nodeIdent,
+                          intervals, valid ? "" : " invalid");
+#endif
+        if (valid && (fp != NULL))
+        {
+            for (int i=intervals-1; i>=0; i--)
+            {
+                char intervalString[20];
+                time_t end = gapIntervalEnd(row, i);
+                if (end == 0) end = now;
+                strftime(intervalString, sizeof(intervalString),"%FT%H:%M:%S",
+                         localtime(&end));
+                fprintf(fp,"Backfill %s %s Interval %d Count %u\n",
+                        nodeInfo[row].nodeIdent, intervalString, i, value[1+i]);
+            }
+            dataFileCheck();
+        }
+    }
 /* If the protocol state has reached the final stage, any response apart from
-the Parameter Change or data commands is accepted as ACK since this is the
-only response possible. The only way now that a cycle can give a wrong
+the data commands and the bootloader and history responses is accepted as ACK
+since this is the only response possible. The only way now that a cycle can give a wrong
 result is if the response was not detected as a data packet. In that case
-the remote will clear its data but the base will not record it. */
+the remote will clear its data but the base will not record it.
+The node is now awake waiting for any messages in its mailbox. */
     else if (nodeInfo[row].protocolState == 2)
     {
         nodeInfo[row].protocolState = 1;         /* Reset protocol state */
@@ -1653,6 +2174,13 @@ the remote will clear its data but the base will not record it. */
 //        printf("Remote Accepted\n");
 #endif
         storeData = true;
+/* Parameter updates sent in the ACK have now been accepted. */
+        nodeInfo[row].configFlags &= ~nodeInfo[row].configSent;
+        if (nodeInfo[row].configSent & CONFIG_TIME) nodeInfo[row].timeSync = now;
+        nodeInfo[row].configSent = 0;
+        gapComplete(row);
+        healthComplete(row);
+        mailboxDeliver(row);
     }
 /* Abandon the communication and discard the current count value as the remote
 has detected ongoing errors and will now not reset its count. */
@@ -1667,24 +2195,43 @@ has detected ongoing errors and will now not reset its count. */
         }
 #endif
         storeData = false;
+        nodeInfo[row].rxCount = 0;
+        gapAbandon(row);
+        healthAbandon(row);
+        if (fp != NULL)
+        {
+            fprintf(fp,"Abandoned %s %s\n", nodeInfo[row].nodeIdent, timeString);
+            dataFileCheck();
+        }
     }
 
 /* This is the response to a Parameter Change command which passes an arbitrary
-string to the remote node. */
+string to the remote node. It may be for a message from the mailbox. */
     else if (command == 'P')
     {
+        if (mailboxResponse(row, MAILBOX_STRING, (*pkt)->data, writeLength)) return;
         dataResponseRcvd = true;
         for (int i=1; i< min(SIZE,writeLength); i++)
             dataResponseData[i] = (*pkt)->data[i+1];
     }
 
+/* This is the response to an action command from the mailbox, outside of a
+protocol cycle. */
+    else if (command == 'A')
+    {
+        mailboxResponse(row, MAILBOX_STRING, (*pkt)->data, writeLength);
+        return;
+    }
+
 /* This is a transmission from a simple test firmware that doesn't follow the
 protocol but only sends a single transmission. */
     else if (command == 'D')
     {
         storeData = true;
+        nodeInfo[row].histogramValid = false;
 /* Store data field aside for later recording. */
         for (int i=0; i<DATA_LENGTH; i++) remoteData[i][row] = (*pkt)->data[i+1];
+        reportAccept(row, -1, dataField);
     }
 
 /* Print out received data to the file once it is verified. */
@@ -1696,15 +2243,141 @@ protocol but only sends a single transmission. */
             (float)((dataField >> 16) & 0x3FF)*0.004799415, (dataField >> 26));
     }
 #endif
+/* All reports held for the node are stored, oldest first. */
     if (storeData && (fp != NULL))
     {
-        fprintf(fp,"Command Received %c %s %s Count %lu Voltage %f V Parameter %lu\n",
-            command, nodeInfo[row].nodeIdent, timeString, (dataField & 0xFFFF),
-            (float)((dataField >> 16) & 0x3FF)*0.004799415, (dataField >> 26));
+        for (int r=0; r<nodeInfo[row].rxCount; r++)
+        {
+            reportRecord *record = &nodeInfo[row].rxRecord[r];
+            fprintf(fp,"Command Received %c %s %s Count %lu Voltage %f V Parameter %lu",
+                command, nodeInfo[row].nodeIdent, timeString,
+                (record->dataField & 0xFFFF),
+                (float)((record->dataField >> 16) & 0x3FF)*0.004799415,
+                (record->dataField >> 26));
+/* Append the interval histogram bin counts, shortest intervals first. */
+            if (record->histogramValid)
+            {
+                fprintf(fp," Histogram");
+                for (int i=0; i<HISTOGRAM_BINS; i++)
+                    fprintf(fp," %u",record->histogram[i]);
+            }
+/* Append the signal strength if the XBee gives it in the frame. */
+            if (((*pkt)->rssi > 0) && (r == nodeInfo[row].rxCount-1))
+                fprintf(fp," RSSI -%u",(*pkt)->rssi);
+            fprintf(fp,"\n");
+        }
         dataFileCheck();
     }
+    if (storeData) nodeInfo[row].rxCount = 0;
 /* If we are hearing from this then it is a valid node */
     if (row < numberNodes) nodeInfo[row].valid = true;
+    metricsLatency(metricRxCallback, received);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Build the options carried in the ACK to a data report
+
+Each option has a tag character, a hex digit giving the number of characters
+in the value, then the value in hex. The node applies the parameter updates
+before it sleeps, so no separate command has to reach it while awake. The node
+clock is set at intervals of TIME_SYNC_INTERVAL. The updates are noted as sent
+and are cleared once the node has accepted the ACK. Any that do not fit in the
+frame are left for the next ACK.
+
+The sequence of the last report accepted in order goes first, so that it is
+never left out.
+
+@param int row: node table row.
+@param int sequence: last report sequence accepted, or -1 if not sequenced.
+@param char *ack: buffer following the two ACK characters, terminated on return.
+@returns int: number of characters added.
+*/
+
+int ackOptions(const int row, const int sequence, char *ack)
+{
+    int length = 0;
+    char option[12];
+    time_t now = time(NULL);
+    if (now - nodeInfo[row].timeSync >= TIME_SYNC_INTERVAL)
+        nodeInfo[row].configFlags |= CONFIG_TIME;
+    nodeInfo[row].configSent = 0;
+    if (sequence >= 0)
+        length += sprintf(ack+length, "%c2%02X", ACK_SEQUENCE, sequence);
+    if (mailboxPending(row))
+        length += sprintf(ack+length, "%c0", ACK_MAILBOX);
+    for (uint8_t flag = CONFIG_WAKE; flag <= CONFIG_HISTORY; flag <<= 1)
+    {
+        if (! (nodeInfo[row].configFlags & flag)) continue;
+        if (flag == CONFIG_WAKE)
+            sprintf(option, "%c4%04X", ACK_WAKE, nodeInfo[row].configWake);
+        else if (flag == CONFIG_AWAKE)
+            sprintf(option, "%c1%01X", ACK_AWAKE, nodeInfo[row].configAwake > 0);
+        else if (flag == CONFIG_BATTERY)
+            sprintf(option, "%c2%02X", ACK_BATTERY, nodeInfo[row].configBattery);
+        else if (flag == CONFIG_PHASE)
+            sprintf(option, "%c4%04X", ACK_PHASE, nodeInfo[row].configPhase);
+        else if (flag == CONFIG_HISTORY)
+            sprintf(option, "%c2%02X", ACK_HISTORY, nodeInfo[row].configHistory);
+        else
+            sprintf(option, "%c8%08X", ACK_TIME, (uint32_t)now);
+        if (length + 2 + (int)strlen(option) > ACK_PAYLOAD) continue;
+        strcpy(ack+length, option);
+        length += strlen(option);
+        nodeInfo[row].configSent |= flag;
+    }
+    ack[length] = 0;
+    return length;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Take a data report into those held for a node
+
+A report without a sequence number, or any report when none are held, is taken
+as it comes. Otherwise only the next in order is taken. One already taken is a
+retry after a lost ACK, and one a little ahead is out of order, to be sent
+again after those before it. Any other sequence means that the node has
+restarted, so the reports held, which it never saw acknowledged, are dropped.
+
+@param int row: node table row.
+@param int sequence: sequence number of the report, or -1 if none.
+@param unsigned long int dataField: data word of the report.
+@returns int: sequence of the last report taken in order, or -1 if none.
+*/
+
+int reportAccept(const int row, const int sequence,
+                 const unsigned long int dataField)
+{
+    nodeEntry *node = &nodeInfo[row];
+    if (sequence < 0) node->rxCount = 0;
+    else if (node->rxCount > 0)
+    {
+        uint8_t ahead = sequence - node->rxSequence;
+        uint8_t behind = node->rxSequence - sequence;
+        if (((behind > 0) && (behind <= node->rxCount)) ||
+            ((ahead > 0) && (ahead < REPORT_WINDOW)))
+        {
+#ifdef DEBUG
+            if (debug) printf("Report %s sequence %d not taken, expected %d\n",
+                              node->nodeIdent, sequence, node->rxSequence);
+#endif
+            return (uint8_t)(node->rxSequence - 1);
+        }
+        if (ahead > 0) node->rxCount = 0;
+    }
+/* The oldest report is dropped if the node has gone on without confirming. */
+    if (node->rxCount >= REPORT_WINDOW)
+    {
+        node->rxCount--;
+        memmove(&node->rxRecord[0], &node->rxRecord[1],
+                node->rxCount*sizeof(reportRecord));
+    }
+    reportRecord *record = &node->rxRecord[node->rxCount++];
+    record->dataField = dataField;
+    record->histogramValid = node->histogramValid;
+    memcpy(record->histogram, node->histogram, sizeof(record->histogram));
+    if (sequence < 0) return -1;
+    node->rxSequence = sequence + 1;
+    return sequence;
 }
 
 /*--------------------------------------------------------------------------*/
@@ -1714,7 +2387,9 @@ This is a callback required by libxbee. It interprets incoming packets on the
 remote AT connection.
 
 The response is stored in a global array. This should be read before any other
-remote AT command is sent to any node.
+remote AT command is sent to any node. It is also offered to the firmware update
+engine which needs the sleep mode of nodes being updated, and to the mailbox with
+the command in front.
 
 Globals:
 bool remoteATResponseRcvd
@@ -1737,6 +2412,18 @@ void remoteATCallback(struct xbee *xbee, struct xbee_con *con,
     remoteATLength = (*pkt)->dataLen;
     for (int i=0; i < min(SIZE,remoteATLength); i++)
         remoteATResponseData[i] = (*pkt)->data[i];
+    int row = findRowBy64BitAddress((*pkt)->address.addr64);
+    if (row < numberNodes)
+    {
+        firmwareATResponse(row, (*pkt)->atCommand, (*pkt)->data, (*pkt)->dataLen);
+        unsigned char response[SIZE];
+        response[0] = (*pkt)->atCommand[0];
+        response[1] = (*pkt)->atCommand[1];
+        int length = 2;
+        for (int i=0; (i < (*pkt)->dataLen) && (length < SIZE); i++)
+            response[length++] = (*pkt)->data[i];
+        mailboxResponse(row, MAILBOX_REMOTE_AT, response, length);
+    }
 }
 
 /*--------------------------------------------------------------------------*/
@@ -1765,6 +2452,28 @@ void localATCallback(struct xbee *xbee, struct xbee_con *con,
 #ifdef DEBUG
     if (debug) printLocalATResponse(pkt);
 #endif
+/* A sample of signal strength is recorded with the time of the report that it
+measured. A response to the sampler alone is kept from clients. */
+    int row;
+    uint8_t rssi;
+    time_t measured;
+    bool sampler = rssiResponse((*pkt)->atCommand, (*pkt)->status, (*pkt)->data,
+                                (*pkt)->dataLen, &row, &rssi, &measured);
+    if ((row >= 0) && (row < numberNodes))
+    {
+        healthRssi(row, rssi);
+        pthread_mutex_lock(&fileMutex);
+        if (fp != NULL)
+        {
+            char timeString[20];
+            strftime(timeString, sizeof(timeString),"%FT%H:%M:%S",
+                     localtime(&measured));
+            fprintf(fp,"Signal %s %s RSSI -%u\n",
+                    nodeInfo[row].nodeIdent, timeString, rssi);
+        }
+        pthread_mutex_unlock(&fileMutex);
+    }
+    if (sampler) return;
     localATResponseRcvd = true;
     localATLength = (*pkt)->dataLen;
     for (int i=0; i < min(SIZE,localATLength); i++)
@@ -1797,6 +2506,7 @@ void ioCallback(struct xbee *xbee, struct xbee_con *con,
     struct tm *tmp = localtime(&now);
     strftime(timeString, sizeof(timeString),"%FT%H:%M:%S",tmp);
     int row = findRowBy64BitAddress((*pkt)->address.addr64);
+    pthread_mutex_lock(&fileMutex);
     if (fp != NULL)
     {
         if (row == numberNodes) fprintf(fp,"Node Unknown ");
@@ -1859,6 +2569,7 @@ write the next word field directly as the set of digital ports. */
     if (fp != NULL) fprintf(fp, "\n");
 /* Write to the disk now to ensure it is available */
     dataFileCheck();
+    pthread_mutex_unlock(&fileMutex);
 #ifdef DEBUG
     if (debug) printf("\n");
 #endif
@@ -1914,6 +2625,41 @@ void modemStatusCallback(struct xbee *xbee, struct xbee_con *con,
 
 /*--------------------------------------------------------------------------*/
 /* UTILITY FUNCTIONS */
+/*--------------------------------------------------------------------------*/
+/** @brief Flush the data file to disk
+
+Run as a background task so that records are not held in the buffers for long
+when few reports are arriving.
+
+@param void *: not used.
+*/
+
+void dataFileFlush(void *)
+{
+    pthread_mutex_lock(&fileMutex);
+    if (fp != NULL)
+    {
+        uint64_t start = metricsTime();
+        fflush(fp);
+        metricsCount(metricFileFlushes);
+        metricsLatency(metricFileFlush, start);
+    }
+    pthread_mutex_unlock(&fileMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Advance the node liveness wheel
+
+Run as a background task at each tick of the wheel.
+
+@param void *: not used.
+*/
+
+void livenessUpdate(void *)
+{
+    livenessTick(time(NULL));
+}
+
 /*--------------------------------------------------------------------------*/
 /** @brief Check the data file usage.
 
@@ -1923,17 +2669,36 @@ limit has been reached, close and reopen another file.
 If the file hasn't been opened, create it.
 
 Globals:
-The file descriptor fp and the record counters.
+The file descriptor fp and the record counters, protected by the file mutex.
 
 @returns bool: file successfully opened.
 */
 
 int dataFileCheck()
+{
+    pthread_mutex_lock(&fileMutex);
+    int opened = dataFileRotate();
+    pthread_mutex_unlock(&fileMutex);
+    return opened;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Flush, close or open the data file as needed.
+
+Called from dataFileCheck with the file mutex held.
+
+@returns bool: file successfully opened.
+*/
+
+int dataFileRotate()
 {
     if ((fp != NULL) && (flushCount++ > FLUSH_LIMIT))
     {
         flushCount = 0;
+        uint64_t start = metricsTime();
         fflush(fp);
+        metricsCount(metricFileFlushes);
+        metricsLatency(metricFileFlush, start);
     }
     if ((fp != NULL) && (fileCount++ > FILE_LIMIT))
     {
@@ -2130,12 +2895,22 @@ void deleteNodeTableRow(int row)
 {
     if (row > numberNodes) return;
     closeRemoteConnection(row);             /* Close off its connections if any */
+    mailboxNodeRemove(row);
+    wakeControlNodeRemove(row);
+    fragmentNodeRemove(row);
+    gapNodeRemove(row);
+    livenessNodeRemove(row);
+    healthNodeRemove(row);
+    rssiNodeRemove(row);
     numberNodes--;
     for (int i=row; i<numberNodes; i++)
         nodeInfo[i] = nodeInfo[i+1];
     nodeInfo[numberNodes].dataCon = NULL;
     nodeInfo[numberNodes].ioCon = NULL;
     nodeInfo[numberNodes].atCon = NULL;     /* Nullify defunct row pointers */
+    nodeInfo[numberNodes].configFlags = 0;
+    nodeInfo[numberNodes].configSent = 0;
+    nodeInfo[numberNodes].rxCount = 0;
     writeNodeFile();
 }
 
@@ -2272,6 +3047,7 @@ portion.
 void debugDumpPacket(struct xbee_pkt **pkt)
 {
 #ifdef DEBUG
+    pthread_mutex_lock(&fileMutex);
     if (debug > 1)
     {
         char timeString[20];
@@ -2304,6 +3080,7 @@ void debugDumpPacket(struct xbee_pkt **pkt)
             fprintf(fp,"\n");
         }
     }
+    pthread_mutex_unlock(&fileMutex);
 #endif
 }
 
@@ -2317,6 +3094,7 @@ packet.
 void printNodeID(struct xbee_pkt **pkt)
 {
 #ifdef DEBUG
+    pthread_mutex_lock(&fileMutex);
     if (debug > 1)
     {
         uint16_t adr = ((*pkt)->data[0] << 8) + (*pkt)->data[1];
@@ -2362,6 +3140,7 @@ void printNodeID(struct xbee_pkt **pkt)
             fprintf(fp,"\n");
         }
     }
+    pthread_mutex_unlock(&fileMutex);
 #endif
 }
 
@@ -2375,6 +3154,7 @@ packet.
 void printRemoteATResponse(struct xbee_pkt **pkt)
 {
 #ifdef DEBUG
+    pthread_mutex_lock(&fileMutex);
     if (debug > 1)
     {
         printf("Remote AT Response: length %d, data ",(*pkt)->dataLen);
@@ -2387,6 +3167,7 @@ void printRemoteATResponse(struct xbee_pkt **pkt)
             fprintf(fp,"\n");
         }
     }
+    pthread_mutex_unlock(&fileMutex);
 #endif
 }
 
@@ -2400,6 +3181,7 @@ packet.
 void printLocalATResponse(struct xbee_pkt **pkt)
 {
 #ifdef DEBUG
+    pthread_mutex_lock(&fileMutex);
     if (debug > 1)
     {
         printf("Local AT Response: length %d, data ",(*pkt)->dataLen);
@@ -2412,6 +3194,7 @@ void printLocalATResponse(struct xbee_pkt **pkt)
             fprintf(fp,"\n");
         }
     }
+    pthread_mutex_unlock(&fileMutex);
 #endif
 }
 
@@ -2425,6 +3208,7 @@ packet.
 void printTxStatus(struct xbee_pkt **pkt)
 {
 #ifdef DEBUG
+    pthread_mutex_lock(&fileMutex);
     if (debug > 1)
     {
         int row = findRowBy16BitAddress(((uint16_t)(*pkt)->data[1] << 8) + (*pkt)->data[2]);
@@ -2459,6 +3243,7 @@ void printTxStatus(struct xbee_pkt **pkt)
             fprintf(fp,"\n");
         }
     }
+    pthread_mutex_unlock(&fileMutex);
 #endif
 }
 
@@ -2472,6 +3257,7 @@ packet.
 void printModemStatus(struct xbee_pkt **pkt)
 {
 #ifdef DEBUG
+    pthread_mutex_lock(&fileMutex);
     if (debug > 1)
     {
         char timeString[20];
@@ -2487,6 +3273,7 @@ void printModemStatus(struct xbee_pkt **pkt)
             fprintf(fp,"Modem Status: %s Status %02X\n",timeString,(*pkt)->data[0]);
         }
     }
+    pthread_mutex_unlock(&fileMutex);
 #endif
 }
 
@@ -36,6 +36,35 @@ Title:    XBee Acquisition Control process
 
 // Length of data field in a data message
 #define DATA_LENGTH             10
+// Inter-pulse interval histogram optionally following the data field
+#define HISTOGRAM_BINS           8
+#define HISTOGRAM_LENGTH        (2+2*HISTOGRAM_BINS)
+// Length of the sequence number following the command in a data message, and
+// the most reports a node may send before one is acknowledged
+#define SEQUENCE_LENGTH          2
+#define REPORT_WINDOW            4
+
+// Options carried in the ACK to a data report. Each has a tag, a hex digit
+// giving the number of characters in the value, then the value in hex.
+#define ACK_LENGTH              40
+#define ACK_PAYLOAD             32  // Largest frame data taken by the node
+#define ACK_MAILBOX            'M'  // Messages waiting, no value
+#define ACK_WAKE               'W'  // Wake interval in WDT ticks
+#define ACK_AWAKE              'A'  // Keep the XBee awake, 1 on, 0 off
+#define ACK_BATTERY            'B'  // Cycles between battery readings
+#define ACK_TIME               'T'  // Time in seconds since the epoch
+#define ACK_PHASE              'O'  // WDT counter to load, setting the phase
+#define ACK_SEQUENCE           'Q'  // Last report sequence received in order
+#define ACK_HISTORY            'H'  // Past intervals to send back after the cycle
+// Bits in the node table flags of parameter updates waiting to be sent
+#define CONFIG_WAKE           0x01
+#define CONFIG_AWAKE          0x02
+#define CONFIG_BATTERY        0x04
+#define CONFIG_TIME           0x08
+#define CONFIG_PHASE          0x10
+#define CONFIG_HISTORY        0x20
+// Seconds between resetting the clock of each node
+#define TIME_SYNC_INTERVAL    3600
 
 #define DATA_PATH           "/data/XBee/"
 #define LOG_FILE            DATA_PATH"/libxbee.log"
@@ -48,6 +77,7 @@ Title:    XBee Acquisition Control process
 
 #include "xbee.h"
 #include <stdint.h>
+#include <time.h>
 
 /* Serial Port Parameters */
 
@@ -80,6 +110,15 @@ enum FlowType
     FLOW_XONXOFF
 };
 
+/* A data report accepted from a node and held until the node confirms that it
+has been acknowledged. */
+
+typedef struct {
+    unsigned long int dataField;        // Count, battery voltage and parameter
+    bool histogramValid;
+    uint8_t histogram[HISTOGRAM_BINS];
+} reportRecord;
+
 /* Structure for a node table entry.
 The node table holds all useful information about the nodes in the XBee
 network. */
@@ -101,6 +140,19 @@ typedef struct {
     struct xbee_con *dataCon;// libxbee connection for data reception;
     struct xbee_con *atCon; // libxbee connection for AT commands reception;
     struct xbee_con *ioCon; // libxbee connection for I/O received frames
+    uint8_t histogram[HISTOGRAM_BINS];  // Inter-pulse intervals from last report
+    bool histogramValid;    // A histogram came with the last report
+    uint8_t configFlags;    // Parameter updates waiting to go in an ACK
+    uint8_t configSent;     // Updates in the last ACK, cleared once accepted
+    uint16_t configWake;    // Wake interval to set
+    uint8_t configAwake;    // Stay awake setting to set
+    uint8_t configBattery;  // Battery reading interval to set
+    uint16_t configPhase;   // WDT counter to load to move the node to its slot
+    uint8_t configHistory;  // Past intervals to ask for after a gap
+    time_t timeSync;        // Time the node clock was last set
+    uint8_t rxSequence;     // Sequence of the next report expected in order
+    uint8_t rxCount;        // Reports accepted and waiting to be stored
+    reportRecord rxRecord[REPORT_WINDOW];
 } nodeEntry;
 
 /* Error detected in data packet */
@@ -165,7 +217,8 @@ XBEE_ESHUTDOWN             = -29,
 bool command_handler(const int listener, unsigned char *buf);
 void *get_in_addr(const struct sockaddr *sa);
 int init_socket(int *listener);
-int check_connections(fd_set *master, int *fd_max, const int listener);
+int check_connections(fd_set *master, int *fd_max, const int listener,
+                      const int timer, const int metrics);
 int setupXbeeInstance();
 void openRemoteConnection(int row);
 void openRemoteConnections();
@@ -175,6 +228,8 @@ int openGlobalConnections();
 int closeGlobalConnections();
 int nodeProbe();
 int dataFileCheck();
+void dataFileFlush(void *arg);
+void livenessUpdate(void *arg);
 int fillNodeTable();
 void deleteNodeTableRow(int row);
 void writeNodeFile(void);
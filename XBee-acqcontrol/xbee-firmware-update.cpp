@@ -0,0 +1,1075 @@
+/**
+@brief XBee Acquisition Control firmware update engine
+
+This allows firmware updates to be run by acqcontrol on behalf of a client. The
+client loads a binary image then starts a job for a set of nodes. The job runs
+in its own thread and continues if the client disconnects.
+
+Each node is taken through its update in turn: the sleep mode of an end device
+is changed so that it stays awake, the node is reset into the bootloader with
+the XBee DIO11 and DIO12 pins, the CRC of each Flash page is read back so that
+only pages differing from the image are sent as windowed records, the page CRCs
+are read again to verify them, and the node is reset back into the application.
+Pages are compressed where they fit in a single record and are smaller. A
+bootloader that holds records in RAM before writing them gives the number it can
+take in its acknowledgement, and the window is limited to that.
+
+Several nodes may be updated at once. They share an airtime budget given as a
+number of records per second over all nodes. Each change of state or progress
+is pushed as an 'f' message to the clients that have asked for it.
+
+In a broadcast job all nodes are taken into the bootloader together. Once every
+node has compared its pages, the records for pages differing in any node are
+broadcast once to the whole group, unacknowledged. Each node is then asked for
+its acknowledgement bitmap and only the records it missed are sent by unicast.
+The airtime used for the image is then much the same for any number of nodes.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee.h"
+#include "xbee-acqcontrol.h"
+#include "xbee-firmware-update.h"
+#include "xbee-tx-scheduler.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+extern char debug;
+extern struct xbee *xbee;
+
+/* Image and job, protected by the mutex */
+static pthread_mutex_t firmwareMutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char firmwareImage[FIRMWARE_IMAGE_SIZE];
+static int firmwareImageLength;
+static bool firmwareJobActive;
+static firmwareSession session[MAXNODES];
+static int sessionCount;
+static int jobConcurrent;
+static int jobRate;
+static int jobRecords;
+static bool jobBroadcast;
+static struct xbee_con *broadcastCon;
+static int broadcastNext;       // Next record to broadcast, -1 until the list is made
+static int broadcastCount;
+static uint64_t broadcastTime;
+static int broadcastPageSize;
+static uint16_t broadcastAddress[FIRMWARE_WINDOW_RECORDS];
+static bool broadcastCompressed[FIRMWARE_WINDOW_RECORDS];
+static int clientList[FIRMWARE_CLIENTS];
+static int clientCount;
+
+/* Local Prototypes */
+static void *firmwareEngine(void *arg);
+static void firmwareStep(firmwareSession *node, int *tokens);
+static void firmwareBroadcast(int *tokens);
+static int firmwareRecordList(const bool *changed, const int pages,
+                              const int pageSize, uint16_t *address,
+                              bool *compressed);
+static bool firmwareNodeRecords(firmwareSession *node);
+static void firmwareSetState(firmwareSession *node, const FirmwareState state);
+static void firmwarePush(const firmwareSession *node);
+static bool firmwareRemoteAT(const int row, const char *command,
+                             const unsigned char parameter, const bool set);
+static bool firmwareSendRecord(struct xbee_con *con, const int row,
+                               const int sequence, const int address,
+                               const bool compressed, const int pageSize);
+static int firmwareCompressPage(const int page, const int pageSize,
+                                unsigned char *out);
+static bool firmwareSendQuery(const int row, const int page, const int pages);
+static bool firmwareSendStatus(const int row);
+static uint16_t firmwarePageCrc(const int page, const int pageSize);
+static uint16_t firmwareCrc(uint16_t crc, const unsigned char data);
+static uint64_t firmwareTime(void);
+
+/*--------------------------------------------------------------------------*/
+/** @brief Clear the firmware image
+
+The image is filled with 0xFF, the erased state of Flash.
+*/
+void firmwareImageClear(void)
+{
+    pthread_mutex_lock(&firmwareMutex);
+    if (! firmwareJobActive)
+    {
+        memset(firmwareImage, 0xFF, FIRMWARE_IMAGE_SIZE);
+        firmwareImageLength = 0;
+    }
+    pthread_mutex_unlock(&firmwareMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Load a block of data into the firmware image
+
+@parameter  uint16_t address: byte address of the data in Flash.
+@parameter  unsigned char *data: data to load.
+@parameter  int length: number of bytes.
+@returns    false if a job is running or the data is outside the image.
+*/
+bool firmwareImageLoad(const uint16_t address, const unsigned char *data,
+                       const int length)
+{
+    bool ok = false;
+    pthread_mutex_lock(&firmwareMutex);
+    if ((! firmwareJobActive) && (address + length <= FIRMWARE_IMAGE_SIZE))
+    {
+        memcpy(firmwareImage+address, data, length);
+        if (address + length > firmwareImageLength)
+            firmwareImageLength = address + length;
+        ok = true;
+    }
+    pthread_mutex_unlock(&firmwareMutex);
+    return ok;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Start a firmware update job
+
+The job is run in a separate thread and only one job may run at a time. A
+broadcast job updates all nodes at once.
+
+@parameter  unsigned char *rows: node table rows to update.
+@parameter  int count: number of rows.
+@parameter  int concurrent: nodes to update at once, 0 for the default.
+@parameter  int rate: records per second over all nodes, 0 for the default.
+@parameter  bool broadcast: broadcast the records to all nodes together.
+@returns    false if the job could not be started.
+*/
+bool firmwareJobStart(const unsigned char *rows, const int count,
+                      const int concurrent, const int rate, const bool broadcast)
+{
+    pthread_mutex_lock(&firmwareMutex);
+    jobRecords = (firmwareImageLength + FIRMWARE_RECORD_SIZE - 1)/FIRMWARE_RECORD_SIZE;
+    bool ok = (! firmwareJobActive) && (jobRecords > 0) &&
+              (jobRecords < FIRMWARE_WINDOW_RECORDS) &&
+              (count > 0) && (count <= MAXNODES);
+    for (int i = 0; ok && (i < count); i++)
+        ok = (rows[i] < numberNodes) && (nodeInfo[rows[i]].dataCon != NULL)
+                                     && (nodeInfo[rows[i]].atCon != NULL);
+    if (ok)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            memset(&session[i], 0, sizeof(firmwareSession));
+            session[i].row = rows[i];
+            session[i].state = fwQueued;
+            session[i].window = FIRMWARE_WINDOW;
+        }
+        sessionCount = count;
+        jobConcurrent = (concurrent > 0) ? concurrent : FIRMWARE_CONCURRENT;
+        jobRate = (rate > 0) ? rate : FIRMWARE_RECORD_RATE;
+        jobBroadcast = broadcast;
+        if (broadcast) jobConcurrent = count;
+        broadcastNext = -1;
+        pthread_t thread;
+        firmwareJobActive = true;
+        ok = (pthread_create(&thread, NULL, firmwareEngine, NULL) == 0);
+        if (ok) pthread_detach(thread);
+        else firmwareJobActive = false;
+    }
+    pthread_mutex_unlock(&firmwareMutex);
+    syslog(LOG_INFO, "Firmware update %sjob %s for %d nodes\n",
+           broadcast ? "broadcast " : "", ok ? "started" : "refused", count);
+    return ok;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Report progress of the current or last firmware update job
+
+The reply has the number of nodes in the status byte, then for each node its
+row, state and percentage of the image acknowledged.
+
+@parameter  char *reply: reply buffer, filled from reply[2].
+@returns    length of the reply.
+*/
+int firmwareJobProgress(char *reply)
+{
+    int replyLength = 3;
+    pthread_mutex_lock(&firmwareMutex);
+    reply[2] = sessionCount;
+    for (int i = 0; i < sessionCount; i++)
+    {
+        reply[replyLength++] = session[i].row;
+        reply[replyLength++] = session[i].state;
+        reply[replyLength++] = session[i].percent;
+    }
+    pthread_mutex_unlock(&firmwareMutex);
+    return replyLength;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Take a bootloader response for a node being updated
+
+This is called from the data callback. Windowed record responses are
+cumulative so only the latest is kept. Page CRC responses are kept separately.
+
+@parameter  int row: node table row.
+@parameter  unsigned char *data: response from the bootloader.
+@parameter  int length: length of the response.
+@returns    true if the response was taken by the engine.
+*/
+bool firmwareDataResponse(const int row, const unsigned char *data,
+                          const int length)
+{
+    bool taken = false;
+    pthread_mutex_lock(&firmwareMutex);
+    for (int i = 0; firmwareJobActive && (i < sessionCount); i++)
+    {
+        if ((session[i].row == row) && (session[i].state > fwQueued) &&
+            (session[i].state < fwDone))
+        {
+            if ((length >= 8) && (data[0] == 'W'))
+            {
+                memcpy(session[i].response, data, 8);
+                session[i].responseRcvd = true;
+/* A bootloader that buffers records advertises how many it can take */
+                if (length >= 10)
+                {
+                    char field[3] = {(char)data[8], (char)data[9], 0};
+                    int window = strtol(field, NULL, 16);
+                    if ((window > 0) && (window <= FIRMWARE_WINDOW))
+                        session[i].window = window;
+                }
+            }
+            if ((length >= 5) && (length <= SIZE) && (data[0] == 'K'))
+            {
+                memcpy(session[i].pageResponse, data, length);
+                session[i].pageResponseLength = length;
+                session[i].pageResponseRcvd = true;
+            }
+            taken = true;
+        }
+    }
+    pthread_mutex_unlock(&firmwareMutex);
+    return taken;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Take a remote AT response for a node being updated
+
+Only the sleep mode query is of interest.
+
+@parameter  int row: node table row.
+@parameter  unsigned char *atCommand: two character AT command.
+@parameter  unsigned char *data: parameter returned.
+@parameter  int length: length of the parameter.
+*/
+void firmwareATResponse(const int row, const unsigned char *atCommand,
+                        const unsigned char *data, const int length)
+{
+    if ((atCommand[0] != 'S') || (atCommand[1] != 'M') || (length < 1)) return;
+    pthread_mutex_lock(&firmwareMutex);
+    for (int i = 0; firmwareJobActive && (i < sessionCount); i++)
+    {
+        if ((session[i].row == row) && (session[i].state == fwSleepMode))
+        {
+            session[i].sleepMode = data[0];
+            session[i].sleepModeRcvd = true;
+        }
+    }
+    pthread_mutex_unlock(&firmwareMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Register or remove a client receiving progress messages
+
+Clients that disconnect must be removed.
+
+@parameter  int fd: client socket.
+@parameter  bool subscribe: add the client, otherwise remove it.
+*/
+void firmwareClientSet(const int fd, const bool subscribe)
+{
+    pthread_mutex_lock(&firmwareMutex);
+    int i;
+    for (i = 0; i < clientCount; i++) if (clientList[i] == fd) break;
+    if (subscribe && (i == clientCount) && (clientCount < FIRMWARE_CLIENTS))
+        clientList[clientCount++] = fd;
+    else if (! subscribe && (i < clientCount))
+        clientList[i] = clientList[--clientCount];
+    pthread_mutex_unlock(&firmwareMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Firmware update engine thread
+
+Queued nodes are started while fewer than the allowed number are active, and
+each active node is stepped through its update. Record sends are drawn from a
+token bucket refilled at the job rate. The thread ends when all nodes are done.
+*/
+static void *firmwareEngine(void *arg)
+{
+    (void)arg;
+    int tokens = 0;
+    uint64_t refillTime = firmwareTime();
+    broadcastCon = NULL;
+    if (jobBroadcast)
+    {
+        struct xbee_conAddress address;
+        memset(&address, 0, sizeof(address));
+        address.addr64_enabled = 1;
+        address.addr64[6] = 0xFF;
+        address.addr64[7] = 0xFF;
+        xbee_err ret = xbee_conNew(xbee, &broadcastCon, "Data", &address);
+        if (ret != XBEE_ENONE)
+        {
+            broadcastCon = NULL;
+            syslog(LOG_INFO, "Firmware broadcast connection failed, using unicast\n");
+        }
+    }
+    for(;;)
+    {
+/* Refill the airtime budget, allowing no more than one window to accumulate */
+        uint64_t now = firmwareTime();
+        int refill = (int)((now - refillTime)*jobRate/1000);
+        if (refill > 0)
+        {
+            tokens += refill;
+            if (tokens > FIRMWARE_WINDOW) tokens = FIRMWARE_WINDOW;
+            refillTime += (uint64_t)refill*1000/jobRate;
+        }
+/* Start queued nodes if there is room, and check for completion */
+        int active = 0;
+        int finished = 0;
+        for (int i = 0; i < sessionCount; i++)
+        {
+            if (session[i].state >= fwDone) finished++;
+            else if (session[i].state > fwQueued) active++;
+        }
+        if (finished == sessionCount) break;
+        for (int i = 0; (i < sessionCount) && (active < jobConcurrent); i++)
+        {
+            if (session[i].state == fwQueued)
+            {
+                firmwareSetState(&session[i], fwSleepMode);
+                active++;
+            }
+        }
+        for (int i = 0; i < sessionCount; i++)
+        {
+            if ((session[i].state > fwQueued) && (session[i].state < fwDone))
+                firmwareStep(&session[i], &tokens);
+        }
+        if (jobBroadcast) firmwareBroadcast(&tokens);
+        usleep(FIRMWARE_TICK*1000);
+    }
+    if (broadcastCon != NULL) xbee_conEnd(broadcastCon);
+    broadcastCon = NULL;
+    pthread_mutex_lock(&firmwareMutex);
+    firmwareJobActive = false;
+    pthread_mutex_unlock(&firmwareMutex);
+    syslog(LOG_INFO, "Firmware update job finished\n");
+    return NULL;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Broadcast the image to a group of nodes
+
+Once no node is still getting ready, the records for pages differing in any
+waiting node are listed and given to each of them. Nodes with a different page
+size, or all nodes if the list is too long or there is no broadcast connection,
+go on to a unicast transfer of their own. The records are then broadcast in
+turn, no faster than the ZigBee broadcast transaction table allows. When all have
+been sent, each node goes on to find and repair the records it missed.
+
+@parameter  int *tokens: records that may be sent, reduced for each one sent.
+*/
+static void firmwareBroadcast(int *tokens)
+{
+    uint64_t now = firmwareTime();
+    if (broadcastNext < 0)
+    {
+        int pageSize = 0;
+        for (int i = 0; i < sessionCount; i++)
+        {
+            if ((session[i].state > fwQueued) && (session[i].state < fwTransfer))
+                return;
+            if (session[i].broadcastWait && (pageSize == 0))
+                pageSize = session[i].pageSize;
+        }
+        bool changed[FIRMWARE_PAGES];
+        int imagePages = 0;
+        memset(changed, 0, sizeof(changed));
+        if (pageSize > 0)
+        {
+            imagePages = (firmwareImageLength+pageSize-1)/pageSize;
+            for (int i = 0; i < sessionCount; i++)
+            {
+                if (! session[i].broadcastWait || (session[i].pageSize != pageSize))
+                    continue;
+                for (int page = 0; page < imagePages; page++)
+                    changed[page] = changed[page] ||
+                        (firmwarePageCrc(page, pageSize) != session[i].pageCrc[page]);
+            }
+        }
+        broadcastCount = firmwareRecordList(changed, imagePages, pageSize,
+                                            broadcastAddress, broadcastCompressed);
+#ifdef DEBUG
+        if (debug)
+            printf("Firmware broadcast of %d records\n", broadcastCount);
+#endif
+        for (int i = 0; i < sessionCount; i++)
+        {
+            firmwareSession *node = &session[i];
+            if (! node->broadcastWait) continue;
+            if ((broadcastCon != NULL) && (broadcastCount >= 0) &&
+                (node->pageSize == pageSize))
+            {
+                node->recordCount = broadcastCount;
+                memcpy(node->recordAddress, broadcastAddress, sizeof(broadcastAddress));
+                memcpy(node->recordCompressed, broadcastCompressed,
+                       sizeof(broadcastCompressed));
+            }
+            else
+            {
+                node->broadcastWait = false;
+                if (! firmwareNodeRecords(node)) firmwareSetState(node, fwRestore);
+            }
+        }
+        broadcastPageSize = pageSize;
+        broadcastNext = 0;
+        broadcastTime = now;
+        return;
+    }
+    if (broadcastNext < broadcastCount)
+    {
+        if ((*tokens > 0) && (now - broadcastTime >= FIRMWARE_BROADCAST_TIME))
+        {
+            (*tokens)--;
+            broadcastTime = now;
+            firmwareSendRecord(broadcastCon, -1, broadcastNext,
+                               broadcastAddress[broadcastNext],
+                               broadcastCompressed[broadcastNext],
+                               broadcastPageSize);
+            broadcastNext++;
+        }
+        return;
+    }
+/* Every record has been sent once to the waiting nodes. */
+    for (int i = 0; i < sessionCount; i++)
+    {
+        firmwareSession *node = &session[i];
+        if (! node->broadcastWait) continue;
+        node->broadcastWait = false;
+        node->repair = true;
+        for (int sequence = 0; sequence < node->recordCount; sequence++)
+        {
+            node->sends[sequence] = 1;
+            node->sentTime[sequence] = now;
+        }
+    }
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Step a node through its update
+
+Any failure to communicate with the node takes it to the restore state so that
+the bootloader pin is released, then marks it as failed.
+
+@parameter  firmwareSession *node: node being updated.
+@parameter  int *tokens: records that may be sent, reduced for each one sent.
+*/
+static void firmwareStep(firmwareSession *node, int *tokens)
+{
+    uint64_t now = firmwareTime();
+    int row = node->row;
+    switch (node->state)
+    {
+/* End devices are held awake by changing to pin sleep for the update. The
+original sleep mode is read first so that it can be restored. */
+        case fwSleepMode:
+            if (nodeInfo[row].deviceType != 2)
+                firmwareSetState(node, fwReset);
+            else if (node->step == 0)
+            {
+                node->step = 1;
+                node->timer = now;
+                if (! firmwareRemoteAT(row, "SM", 0, false))
+                    firmwareSetState(node, fwFailed);
+            }
+            else if (node->sleepModeRcvd)
+            {
+                if (firmwareRemoteAT(row, "SM", 1, true))
+                    firmwareSetState(node, fwReset);
+                else firmwareSetState(node, fwFailed);
+            }
+            else if (now - node->timer > FIRMWARE_AT_TIMEOUT)
+                firmwareSetState(node, fwFailed);
+            break;
+/* Clear DIO11 (bootloader pin) and pulse DIO12 (AVR reset). Then allow the
+bootloader time to start. */
+        case fwReset:
+            if (node->step == 0)
+            {
+                if (firmwareRemoteAT(row, "P1", 4, true) &&
+                    firmwareRemoteAT(row, "P2", 4, true))
+                {
+                    node->step = 1;
+                    node->timer = now;
+                }
+                else firmwareSetState(node, fwRestore);
+            }
+            else if ((node->step == 1) && (now - node->timer > FIRMWARE_RESET_TIME))
+            {
+                if (firmwareRemoteAT(row, "P2", 5, true))
+                {
+                    node->step = 2;
+                    node->timer = now;
+                }
+                else firmwareSetState(node, fwRestore);
+            }
+            else if ((node->step == 2) && (now - node->timer > FIRMWARE_RESET_TIME))
+                firmwareSetState(node, fwCompare);
+            break;
+/* Ask for the CRC of each page covered by the image, a block at a time, with
+the step counting sends of the current query. When comparing, records in pages
+differing from the image are listed for sending. When verifying, all pages must
+now match. */
+        case fwCompare:
+        case fwVerify:
+        {
+            char response[SIZE];
+            int length;
+            bool responseRcvd;
+            pthread_mutex_lock(&firmwareMutex);
+            responseRcvd = node->pageResponseRcvd;
+            length = node->pageResponseLength;
+            memcpy(response, node->pageResponse, length);
+            node->pageResponseRcvd = false;
+            pthread_mutex_unlock(&firmwareMutex);
+            if (responseRcvd)
+            {
+                unsigned int first = 0;
+                unsigned int words = 0;
+                sscanf(response+1, "%2x", &first);
+                sscanf(response+3, "%2x", &words);
+                int pages = (length-5)/4;
+                if ((words == 0) || (pages == 0))
+                {
+                    firmwareSetState(node, fwRestore);
+                    break;
+                }
+                if ((int)first == node->pageQuery)
+                {
+                    node->pageSize = 2*words;
+                    for (int i = 0; (i < pages) && (first+i < FIRMWARE_PAGES); i++)
+                    {
+                        unsigned int crc = 0;
+                        sscanf(response+5+4*i, "%4x", &crc);
+                        node->pageCrc[first+i] = crc;
+                    }
+                    node->pageQuery += pages;
+                    node->step = 0;
+                }
+            }
+            if ((node->pageSize > 0) && (node->pageQuery*node->pageSize >= firmwareImageLength))
+            {
+                int imagePages = (firmwareImageLength+node->pageSize-1)/node->pageSize;
+                if (node->state == fwVerify)
+                {
+                    bool match = true;
+                    for (int page = 0; page < imagePages; page++)
+                        match = match && (firmwarePageCrc(page, node->pageSize) == node->pageCrc[page]);
+                    firmwareSetState(node, match ? fwFinish : fwRestore);
+                    break;
+                }
+/* In a broadcast job the records are listed once the whole group is ready. */
+                node->broadcastWait = jobBroadcast;
+                if (jobBroadcast || firmwareNodeRecords(node))
+                    firmwareSetState(node, fwTransfer);
+                else firmwareSetState(node, fwRestore);
+                break;
+            }
+            if ((*tokens > 0) && ((node->step == 0) ||
+                                  (now - node->timer > FIRMWARE_RESEND_TIME)))
+            {
+                if (node->step++ >= FIRMWARE_RESENDS)
+                {
+                    firmwareSetState(node, fwRestore);
+                    break;
+                }
+                (*tokens)--;
+                node->timer = now;
+                firmwareSendQuery(row, node->pageQuery, FIRMWARE_PAGE_QUERY);
+            }
+            break;
+        }
+/* Take the latest acknowledgement, then send records in the window that have
+not been sent or have timed out. Corrupted records are simply missing, but any
+other error means the record will never be accepted. After a broadcast the
+node is asked for its acknowledgement until it answers, as the broadcast
+records were not acknowledged. */
+        case fwTransfer:
+        {
+            if (node->broadcastWait) break;
+            char response[8];
+            bool responseRcvd;
+            pthread_mutex_lock(&firmwareMutex);
+            responseRcvd = node->responseRcvd;
+            memcpy(response, node->response, 8);
+            node->responseRcvd = false;
+            pthread_mutex_unlock(&firmwareMutex);
+            if (responseRcvd)
+            {
+                if ((response[1] != 'Y') && (response[1] != 'C'))
+                {
+                    firmwareSetState(node, fwRestore);
+                    break;
+                }
+                unsigned int ackMissing = 0;
+                unsigned int map = 0;
+                sscanf(response+2, "%2x", &ackMissing);
+                sscanf(response+4, "%4x", &map);
+                for (int i = node->firstMissing; (i < (int)ackMissing) &&
+                     (i < node->recordCount); i++)
+                    node->received[i] = true;
+                for (int i = 0; i < FIRMWARE_ACK_MAP_BITS; i++)
+                {
+                    int sequence = ackMissing+1+i;
+                    if ((map & (1 << i)) && (sequence < node->recordCount))
+                        node->received[sequence] = true;
+                }
+                while ((node->firstMissing < node->recordCount) &&
+                       node->received[node->firstMissing])
+                    node->firstMissing++;
+                uint8_t percent = (node->recordCount > 0) ?
+                                  node->firstMissing*100/node->recordCount : 100;
+                if (percent != node->percent)
+                {
+                    pthread_mutex_lock(&firmwareMutex);
+                    node->percent = percent;
+                    firmwarePush(node);
+                    pthread_mutex_unlock(&firmwareMutex);
+                }
+            }
+            if (node->repair && responseRcvd) node->repair = false;
+            else if (node->repair)
+            {
+                if ((*tokens > 0) && ((node->step == 0) ||
+                                      (now - node->timer > FIRMWARE_RESEND_TIME)))
+                {
+                    if (node->step++ >= FIRMWARE_RESENDS)
+                    {
+                        firmwareSetState(node, fwRestore);
+                        break;
+                    }
+                    (*tokens)--;
+                    node->timer = now;
+                    firmwareSendStatus(row);
+                }
+                break;
+            }
+            if (node->firstMissing >= node->recordCount)
+            {
+                node->pageQuery = 0;
+                firmwareSetState(node, fwVerify);
+                break;
+            }
+            for (int sequence = node->firstMissing; (sequence < node->recordCount) &&
+                 (sequence < node->firstMissing+node->window) && (*tokens > 0);
+                 sequence++)
+            {
+                if (node->received[sequence]) continue;
+                if ((node->sends[sequence] > 0) &&
+                    (now - node->sentTime[sequence] < FIRMWARE_RESEND_TIME)) continue;
+                if (node->sends[sequence]++ >= FIRMWARE_RESENDS)
+                {
+                    firmwareSetState(node, fwRestore);
+                    break;
+                }
+                (*tokens)--;
+                node->sentTime[sequence] = now;
+                firmwareSendRecord(nodeInfo[row].dataCon, row, sequence,
+                                   node->recordAddress[sequence],
+                                   node->recordCompressed[sequence], node->pageSize);
+            }
+            break;
+        }
+/* Send the final record until the bootloader confirms the image is complete
+and jumps to the application. */
+        case fwFinish:
+        {
+            bool responseRcvd;
+            char status;
+            pthread_mutex_lock(&firmwareMutex);
+            responseRcvd = node->responseRcvd;
+            status = node->response[1];
+            node->responseRcvd = false;
+            pthread_mutex_unlock(&firmwareMutex);
+            if (responseRcvd && (status == 'J'))
+            {
+                node->success = true;
+                firmwareSetState(node, fwRestore);
+            }
+            else if (responseRcvd && (status == 'N'))
+                firmwareSetState(node, fwRestore);
+            else if ((node->finishSends == 0) ||
+                     (now - node->timer > 2*FIRMWARE_RESEND_TIME))
+            {
+                if (node->finishSends++ >= FIRMWARE_RESENDS)
+                    firmwareSetState(node, fwRestore);
+                else
+                {
+                    node->timer = now;
+                    firmwareSendRecord(nodeInfo[row].dataCon, row,
+                                       node->recordCount, -1, false,
+                                       node->pageSize);
+                }
+            }
+            break;
+        }
+/* Set DIO11 back to application and reset the node again. Restore the sleep
+mode of an end device. */
+        case fwRestore:
+            if (node->step == 0)
+            {
+                firmwareRemoteAT(row, "P1", 5, true);
+                firmwareRemoteAT(row, "P2", 4, true);
+                node->step = 1;
+                node->timer = now;
+            }
+            else if (now - node->timer > FIRMWARE_RESET_TIME)
+            {
+                firmwareRemoteAT(row, "P2", 5, true);
+                if (node->sleepModeRcvd)
+                    firmwareRemoteAT(row, "SM", node->sleepMode, true);
+                firmwareSetState(node, node->success ? fwDone : fwFailed);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief List the records to send for the pages that differ
+
+Each page that differs is sent as one compressed record if it fits and is
+smaller than the page, otherwise as raw records of no more than a page.
+
+@parameter  bool *changed: pages to send.
+@parameter  int pages: pages in the image.
+@parameter  int pageSize: Flash page size.
+@parameter  uint16_t *address: address of each record.
+@parameter  bool *compressed: each record holds a compressed page.
+@returns    number of records, or -1 if there are too many.
+*/
+static int firmwareRecordList(const bool *changed, const int pages,
+                              const int pageSize, uint16_t *address,
+                              bool *compressed)
+{
+    int rawSize = pageSize;
+    if (rawSize > FIRMWARE_RECORD_SIZE) rawSize = FIRMWARE_RECORD_SIZE;
+    int count = 0;
+    for (int page = 0; page < pages; page++)
+    {
+        if (! changed[page]) continue;
+        unsigned char buffer[FIRMWARE_COMPRESSED_SIZE];
+        int size = firmwareCompressPage(page, pageSize, buffer);
+        bool compress = (size > 0) && (size < pageSize);
+        for (int offset = 0; offset < pageSize;
+             offset += (compress ? pageSize : rawSize))
+        {
+            if (count >= FIRMWARE_WINDOW_RECORDS-1) return -1;
+            address[count] = page*pageSize+offset;
+            compressed[count] = compress;
+            count++;
+        }
+    }
+    return count;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief List the records to send to a node on its own
+
+@parameter  firmwareSession *node: node being updated.
+@returns    false if there are too many records.
+*/
+static bool firmwareNodeRecords(firmwareSession *node)
+{
+    bool changed[FIRMWARE_PAGES];
+    int imagePages = (firmwareImageLength+node->pageSize-1)/node->pageSize;
+    for (int page = 0; page < imagePages; page++)
+        changed[page] = (firmwarePageCrc(page, node->pageSize) != node->pageCrc[page]);
+    node->recordCount = firmwareRecordList(changed, imagePages, node->pageSize,
+                                           node->recordAddress, node->recordCompressed);
+#ifdef DEBUG
+    if (debug)
+        printf("Firmware update node %d sending %d records for %d pages\n",
+               node->row, node->recordCount, imagePages);
+#endif
+    return (node->recordCount >= 0);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Change the state of a node and tell the clients
+
+@parameter  firmwareSession *node: node being updated.
+@parameter  FirmwareState state: new state.
+*/
+static void firmwareSetState(firmwareSession *node, const FirmwareState state)
+{
+    pthread_mutex_lock(&firmwareMutex);
+    node->state = state;
+    node->step = 0;
+    node->timer = firmwareTime();
+    if (state == fwDone) node->percent = 100;
+    firmwarePush(node);
+    pthread_mutex_unlock(&firmwareMutex);
+#ifdef DEBUG
+    if (debug)
+        printf("Firmware update node %d state %d\n", node->row, state);
+#endif
+    if (state == fwDone)
+        syslog(LOG_INFO, "Firmware updated on node %d\n", node->row);
+    if (state == fwFailed)
+        syslog(LOG_INFO, "Firmware update failed on node %d\n", node->row);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Push the progress of a node to all subscribed clients
+
+The message has the form of a progress reply for a single node. Clients that
+cannot take it immediately miss out. The mutex must be held.
+
+@parameter  firmwareSession *node: node being updated.
+*/
+static void firmwarePush(const firmwareSession *node)
+{
+    char message[6];
+    message[0] = 6;
+    message[1] = 'f';
+    message[2] = 1;
+    message[3] = node->row;
+    message[4] = node->state;
+    message[5] = node->percent;
+    for (int i = 0; i < clientCount; i++)
+        send(clientList[i], message, 6, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Send a remote AT command to a node
+
+@parameter  int row: node table row.
+@parameter  char *command: two character AT command.
+@parameter  unsigned char parameter: single byte parameter.
+@parameter  bool set: send the parameter, otherwise query.
+@returns    true if the command was sent.
+*/
+static bool firmwareRemoteAT(const int row, const char *command,
+                             const unsigned char parameter, const bool set)
+{
+    unsigned char str[3];
+    str[0] = command[0];
+    str[1] = command[1];
+    str[2] = parameter;
+    xbee_err ret = txSend(nodeInfo[row].atCon, row, str, set ? 3 : 2, txCommand);
+#ifdef DEBUG
+    if (debug && (ret != XBEE_ENONE))
+        printf("Firmware update node %d AT %c%c failed %s\n",
+               row, command[0], command[1], xbee_errorToStr(ret));
+#endif
+    return (ret == XBEE_ENONE);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Send a windowed firmware record to a node or group
+
+The record is 'W' for raw data or 'Z' for a compressed page, the sequence
+number, two byte address, the data and a CRC-16 (XModem) over all but the
+command. Sequence numbers count the records actually sent, which need not be all
+of the image. Raw records carry up to FIRMWARE_RECORD_SIZE bytes of the page.
+
+@parameter  xbee_con *con: data connection to a node or the broadcast address.
+@parameter  int row: node table row, or -1 for the broadcast address.
+@parameter  int sequence: sequence number.
+@parameter  int address: address of the data, or -1 for the final record
+            without data.
+@parameter  bool compressed: the record is a whole page compressed.
+@parameter  int pageSize: Flash page size.
+@returns    true if the record was sent.
+*/
+static bool firmwareSendRecord(struct xbee_con *con, const int row,
+                               const int sequence, const int address,
+                               const bool compressed, const int pageSize)
+{
+    unsigned char message[FIRMWARE_COMPRESSED_SIZE+6];
+    int length = 0;
+    message[length++] = compressed ? 'Z' : 'W';
+    message[length++] = sequence;
+    message[length++] = (address < 0) ? 0 : address >> 8;
+    message[length++] = (address < 0) ? 0 : address;
+    if (compressed)
+        length += firmwareCompressPage(address/pageSize, pageSize, message+length);
+    else if (address >= 0)
+    {
+        int size = (pageSize < FIRMWARE_RECORD_SIZE) ? pageSize : FIRMWARE_RECORD_SIZE;
+        memcpy(message+length, firmwareImage+address, size);
+        length += size;
+    }
+    uint16_t crc = 0;
+    for (int i = 1; i < length; i++) crc = firmwareCrc(crc, message[i]);
+    message[length++] = crc >> 8;
+    message[length++] = crc;
+    xbee_err ret = txSend(con, row, message, length, txBulk);
+    return (ret == XBEE_ENONE);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Ask a node bootloader for the CRCs of a block of Flash pages
+
+@parameter  int row: node table row.
+@parameter  int page: first page.
+@parameter  int pages: number of pages.
+@returns    true if the query was sent.
+*/
+static bool firmwareSendQuery(const int row, const int page, const int pages)
+{
+    char query[6];
+    snprintf(query, sizeof(query), "K%02X%02X", page & 0xFF, pages & 0xFF);
+    xbee_err ret = txSend(nodeInfo[row].dataCon, row,
+                          (unsigned char *)query, 5, txBulk);
+    return (ret == XBEE_ENONE);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Ask a node bootloader for its windowed record acknowledgement
+
+@parameter  int row: node table row.
+@returns    true if the query was sent.
+*/
+static bool firmwareSendStatus(const int row)
+{
+    unsigned char query = 'S';
+    xbee_err ret = txSend(nodeInfo[row].dataCon, row, &query, 1, txBulk);
+    return (ret == XBEE_ENONE);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Compress a page of the image
+
+This is the LZSS scheme decompressed by the bootloader. Each control byte gives
+the type of the next eight items, least significant bit first. A one is a
+literal byte. A zero is a match of two bytes, the distance back less one then
+the length less three, found by searching the page so far. Trailing 0xFF are
+dropped as the bootloader fills the page with 0xFF first, but at least one byte
+is kept so that the record is not taken as the final one.
+
+@parameter  int page: page number.
+@parameter  int pageSize: Flash page size, up to 256 bytes.
+@parameter  unsigned char *out: buffer of FIRMWARE_COMPRESSED_SIZE bytes.
+@returns    length of the compressed data, or zero if it does not fit.
+*/
+static int firmwareCompressPage(const int page, const int pageSize,
+                                unsigned char *out)
+{
+    if (pageSize > 256) return 0;
+    const unsigned char *data = firmwareImage + page*pageSize;
+    int size = pageSize;
+    while ((size > 1) && (data[size-1] == 0xFF)) size--;
+    int length = 0;
+    int control = 0;
+    int items = 8;
+    int in = 0;
+    while (in < size)
+    {
+        if (items == 8)
+        {
+            if (length >= FIRMWARE_COMPRESSED_SIZE) return 0;
+            control = length++;
+            out[control] = 0;
+            items = 0;
+        }
+        int bestLength = 0;
+        int bestDistance = 0;
+        for (int distance = 1; distance <= in; distance++)
+        {
+            int match = 0;
+            while ((in+match < size) && (match < 258) &&
+                   (data[in+match] == data[in+match-distance]))
+                match++;
+            if (match > bestLength)
+            {
+                bestLength = match;
+                bestDistance = distance;
+            }
+        }
+        if (bestLength >= 3)
+        {
+            if (length+2 > FIRMWARE_COMPRESSED_SIZE) return 0;
+            out[length++] = bestDistance-1;
+            out[length++] = bestLength-3;
+            in += bestLength;
+        }
+        else
+        {
+            if (length+1 > FIRMWARE_COMPRESSED_SIZE) return 0;
+            out[control] |= (1 << items);
+            out[length++] = data[in++];
+        }
+        items++;
+    }
+    return length;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief CRC-16 (XModem) of a page of the image
+
+Parts of the page beyond the image are 0xFF, as they will be in Flash once the
+page has been erased and written.
+*/
+static uint16_t firmwarePageCrc(const int page, const int pageSize)
+{
+    uint16_t crc = 0;
+    for (int i = page*pageSize; i < (page+1)*pageSize; i++)
+        crc = firmwareCrc(crc, (i < FIRMWARE_IMAGE_SIZE) ? firmwareImage[i] : 0xFF);
+    return crc;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Update a CRC-16 (XModem) with a byte
+
+This matches _crc_xmodem_update() in avr-libc as used by the bootloader.
+*/
+static uint16_t firmwareCrc(uint16_t crc, const unsigned char data)
+{
+    crc ^= ((uint16_t)data << 8);
+    for (int bit = 0; bit < 8; bit++)
+    {
+        if (crc & 0x8000) crc = (crc << 1) ^ 0x1021;
+        else crc <<= 1;
+    }
+    return crc;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Monotonic time in milliseconds
+*/
+static uint64_t firmwareTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
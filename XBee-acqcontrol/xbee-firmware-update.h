@@ -0,0 +1,112 @@
+/*
+Title:    XBee Acquisition Control firmware update engine
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef XBEE_FIRMWARE_UPDATE_H
+#define XBEE_FIRMWARE_UPDATE_H
+
+#include "xbee-acqcontrol.h"
+#include <stdint.h>
+
+// Firmware image and windowed record limits, matching the bootloader
+#define FIRMWARE_IMAGE_SIZE     16384   // Largest image accepted
+#define FIRMWARE_RECORD_SIZE       64   // Data bytes in a windowed record
+#define FIRMWARE_WINDOW             8   // Records outstanding for each node
+#define FIRMWARE_WINDOW_RECORDS   256   // Range of record sequence numbers
+#define FIRMWARE_ACK_MAP_BITS      16   // Records mapped in an acknowledgement
+#define FIRMWARE_PAGES            512   // Flash pages in an image of 32 byte pages
+#define FIRMWARE_PAGE_QUERY        14   // Page CRCs asked for at a time
+#define FIRMWARE_COMPRESSED_SIZE   78   // Largest compressed page in a record
+
+// Update job scheduling. Times are in milliseconds.
+#define FIRMWARE_CONCURRENT         3   // Nodes updated at once by default
+#define FIRMWARE_RECORD_RATE       20   // Records per second over all nodes
+#define FIRMWARE_RESEND_TIME      500   // Wait before a record is sent again
+#define FIRMWARE_RESENDS            4   // Sends of a record before giving up
+#define FIRMWARE_RESET_TIME       500   // Wait for a node reset to complete
+#define FIRMWARE_AT_TIMEOUT      3000   // Wait for a remote AT response
+#define FIRMWARE_TICK              10   // Engine cycle time
+#define FIRMWARE_CLIENTS            8   // Clients receiving progress messages
+#define FIRMWARE_BROADCAST_TIME   500   // Wait between broadcast records
+
+/* Progress of a node through an update. Values are passed to clients. */
+enum FirmwareState
+{
+    fwQueued = 0,
+    fwSleepMode = 1,
+    fwReset = 2,
+    fwCompare = 3,
+    fwTransfer = 4,
+    fwVerify = 5,
+    fwFinish = 6,
+    fwRestore = 7,
+    fwDone = 8,
+    fwFailed = 9
+};
+
+/* Structure for a node being updated. */
+
+typedef struct {
+    int row;                // Node table row
+    FirmwareState state;
+    uint8_t percent;        // Part of the image acknowledged
+    uint8_t step;           // Progress within a state
+    bool success;           // Transfer completed, set before restoring the node
+    uint64_t timer;         // Time of the last action taken in the state
+    char sleepMode;         // Sleep mode to restore on an end device
+    bool sleepModeRcvd;
+    bool responseRcvd;      // A bootloader response is waiting
+    char response[8];       // Latest windowed record response
+    int firstMissing;       // First record not acknowledged
+    int window;             // Records the bootloader can take at once
+    int finishSends;
+    bool pageResponseRcvd;  // A page CRC response is waiting
+    int pageResponseLength;
+    char pageResponse[SIZE];
+    int pageSize;           // Flash page size reported by the bootloader
+    int pageQuery;          // Next page to ask the CRC of
+    uint16_t pageCrc[FIRMWARE_PAGES];
+    bool broadcastWait;     // Waiting for the records to be broadcast
+    bool repair;            // Broadcast done, status of records not yet known
+    int recordCount;        // Records to send, from pages that differ
+    uint16_t recordAddress[FIRMWARE_WINDOW_RECORDS];    // Address for each sequence
+    bool recordCompressed[FIRMWARE_WINDOW_RECORDS];     // Record holds a compressed page
+    bool received[FIRMWARE_WINDOW_RECORDS];
+    uint64_t sentTime[FIRMWARE_WINDOW_RECORDS];
+    uint8_t sends[FIRMWARE_WINDOW_RECORDS];
+} firmwareSession;
+
+//-----------------------------------------------------------------------------
+/* Prototypes */
+
+void firmwareImageClear(void);
+bool firmwareImageLoad(const uint16_t address, const unsigned char *data,
+                       const int length);
+bool firmwareJobStart(const unsigned char *rows, const int count,
+                      const int concurrent, const int rate, const bool broadcast);
+int firmwareJobProgress(char *reply);
+bool firmwareDataResponse(const int row, const unsigned char *data,
+                          const int length);
+void firmwareATResponse(const int row, const unsigned char *atCommand,
+                        const unsigned char *data, const int length);
+void firmwareClientSet(const int fd, const bool subscribe);
+
+#endif
@@ -0,0 +1,262 @@
+/**
+@brief XBee Acquisition Control message fragmentation
+
+Messages longer than a node can take in one frame are split into numbered
+fragments of FRAGMENT_PAYLOAD bytes, the last shorter, each with a header of
+FRAGMENT_MARK then hex digits giving the message number, the fragment index
+and the number of fragments. This is the format used by the node library.
+
+Fragments from each node are reassembled in any order into a buffer for that
+node. A message not completed within FRAGMENT_TIMEOUT is dropped when a
+fragment of another message arrives, as is one that would not fit.
+
+Callbacks from libxbee and client commands run in different threads, so the
+buffers are protected by a mutex.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+
+#include "xbee.h"
+#include "xbee-acqcontrol.h"
+#include "xbee-fragment.h"
+#include "xbee-tx-scheduler.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+extern char debug;
+
+/* Reassembly buffers for each node table row, protected by the mutex */
+static pthread_mutex_t fragmentMutex = PTHREAD_MUTEX_INITIALIZER;
+static fragmentBuffer fragments[MAXNODES];
+static uint8_t fragmentNumber;      // Number of the last message split
+
+/* Local Prototypes */
+static int fragmentCount(const int length);
+static int fragmentBuild(const unsigned char *data, const int length,
+                         const int index, const int count, const uint8_t number,
+                         unsigned char *frame);
+static uint8_t fragmentNextNumber(void);
+static uint8_t fragmentDigit(const unsigned char character);
+static uint64_t fragmentTime(void);
+
+/*--------------------------------------------------------------------------*/
+/** @brief Send a message to a node, in fragments if needed, and wait
+
+A message that fits in one frame is sent whole. Otherwise each fragment is
+waited for in turn, and the first failure ends the message.
+
+@parameter  xbee_con *con: libxbee connection to send on.
+@parameter  int row: node table row, or -1 if not a node.
+@parameter  unsigned char *data: message.
+@parameter  int length: length of the message.
+@parameter  TxPriority priority: class of the frames.
+@returns    libxbee error from the transmit scheduler, or XBEE_ELENGTH if the
+            message is too long.
+*/
+xbee_err fragmentSend(struct xbee_con *con, const int row,
+                      const unsigned char *data, const int length,
+                      const TxPriority priority)
+{
+    if (length <= FRAGMENT_PAYLOAD) return txSend(con, row, data, length, priority);
+    int count = fragmentCount(length);
+    if (count == 0) return XBEE_ELENGTH;
+    uint8_t number = fragmentNextNumber();
+    unsigned char frame[FRAGMENT_HEADER+FRAGMENT_PAYLOAD];
+    xbee_err ret = XBEE_ENONE;
+    for (int index = 0; (index < count) && (ret == XBEE_ENONE); index++)
+    {
+        int frameLength = fragmentBuild(data, length, index, count, number, frame);
+        ret = txSend(con, row, frame, frameLength, priority);
+    }
+    return ret;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Queue a message to a node, in fragments if needed, and carry on
+
+@parameter  xbee_con *con: libxbee connection to send on.
+@parameter  int row: node table row, or -1 if not a node.
+@parameter  unsigned char *data: message.
+@parameter  int length: length of the message.
+@parameter  TxPriority priority: class of the frames.
+@returns    false if the message is too long or a fragment could not be queued.
+*/
+bool fragmentPost(struct xbee_con *con, const int row,
+                  const unsigned char *data, const int length,
+                  const TxPriority priority)
+{
+    if (length <= FRAGMENT_PAYLOAD) return txPost(con, row, data, length, priority);
+    int count = fragmentCount(length);
+    if (count == 0) return false;
+    uint8_t number = fragmentNextNumber();
+    unsigned char frame[FRAGMENT_HEADER+FRAGMENT_PAYLOAD];
+    bool ok = true;
+    for (int index = 0; (index < count) && ok; index++)
+    {
+        int frameLength = fragmentBuild(data, length, index, count, number, frame);
+        ok = txPost(con, row, frame, frameLength, priority);
+    }
+    return ok;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Take a fragment from a node
+
+@parameter  int row: node table row.
+@parameter  unsigned char *data: frame data starting with FRAGMENT_MARK.
+@parameter  int length: length of the frame data.
+@parameter  unsigned char *message: buffer of FRAGMENT_MESSAGE bytes for the
+            message once complete.
+@returns    length of the message once complete, zero if more fragments are
+            awaited, or -1 if the fragment was not taken.
+*/
+int fragmentReceive(const int row, const unsigned char *data, const int length,
+                    unsigned char *message)
+{
+    if ((row < 0) || (row >= MAXNODES)) return -1;
+    if ((length <= FRAGMENT_HEADER) || (data[0] != FRAGMENT_MARK)) return -1;
+    uint8_t number = fragmentDigit(data[1]);
+    int index = fragmentDigit(data[2]);
+    int count = fragmentDigit(data[3]);
+    int size = length - FRAGMENT_HEADER;
+    int offset = index*FRAGMENT_PAYLOAD;
+    int total = 0;
+    pthread_mutex_lock(&fragmentMutex);
+    fragmentBuffer *buffer = &fragments[row];
+    if ((count == 0) || (count > FRAGMENT_MAX) || (index >= count) ||
+        (size > FRAGMENT_PAYLOAD) || ((index < count-1) && (size < FRAGMENT_PAYLOAD)))
+    {
+        buffer->count = 0;
+        pthread_mutex_unlock(&fragmentMutex);
+#ifdef DEBUG
+        if (debug) printf("Fragment from node %d invalid\n", row);
+#endif
+        return -1;
+    }
+    uint64_t now = fragmentTime();
+    if ((buffer->count > 0) && ((number != buffer->message) ||
+        (count != buffer->count) || (now - buffer->started > FRAGMENT_TIMEOUT)))
+    {
+#ifdef DEBUG
+        if (debug) printf("Fragments from node %d message %d dropped\n",
+                          row, buffer->message);
+#endif
+        buffer->count = 0;
+    }
+    if (buffer->count == 0)
+    {
+        buffer->message = number;
+        buffer->count = count;
+        buffer->received = 0;
+        buffer->started = now;
+    }
+    memcpy(buffer->data+offset, data+FRAGMENT_HEADER, size);
+    if (index == count-1) buffer->length = offset + size;
+    buffer->received |= (1 << index);
+    if (buffer->received == (1 << count) - 1)
+    {
+        total = buffer->length;
+        memcpy(message, buffer->data, total);
+        buffer->count = 0;
+    }
+    pthread_mutex_unlock(&fragmentMutex);
+    return total;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Remove the buffer of a node deleted from the node table
+
+The buffers of the rows following are moved down with the table.
+
+@parameter  int row: node table row being deleted.
+*/
+void fragmentNodeRemove(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&fragmentMutex);
+    for (int i = row; i < MAXNODES-1; i++) fragments[i] = fragments[i+1];
+    fragments[MAXNODES-1].count = 0;
+    pthread_mutex_unlock(&fragmentMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Number of fragments for a message
+
+@returns    fragments needed, or zero if there would be too many.
+*/
+static int fragmentCount(const int length)
+{
+    int count = (length + FRAGMENT_PAYLOAD - 1)/FRAGMENT_PAYLOAD;
+    return (count > FRAGMENT_MAX) ? 0 : count;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Build a fragment of a message
+
+@returns    length of the fragment frame.
+*/
+static int fragmentBuild(const unsigned char *data, const int length,
+                         const int index, const int count, const uint8_t number,
+                         unsigned char *frame)
+{
+    int offset = index*FRAGMENT_PAYLOAD;
+    int size = length - offset;
+    if (size > FRAGMENT_PAYLOAD) size = FRAGMENT_PAYLOAD;
+    frame[0] = FRAGMENT_MARK;
+    frame[1] = "0123456789ABCDEF"[number];
+    frame[2] = "0123456789ABCDEF"[index];
+    frame[3] = "0123456789ABCDEF"[count];
+    memcpy(frame+FRAGMENT_HEADER, data+offset, size);
+    return FRAGMENT_HEADER + size;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Number for the next message split, one hex digit
+*/
+static uint8_t fragmentNextNumber(void)
+{
+    pthread_mutex_lock(&fragmentMutex);
+    fragmentNumber = (fragmentNumber + 1) & 0x0F;
+    uint8_t number = fragmentNumber;
+    pthread_mutex_unlock(&fragmentMutex);
+    return number;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Value of an upper case hex digit, or 0xFF if not one
+*/
+static uint8_t fragmentDigit(const unsigned char character)
+{
+    if ((character >= '0') && (character <= '9')) return character - '0';
+    if ((character >= 'A') && (character <= 'F')) return character - 'A' + 10;
+    return 0xFF;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Monotonic time in milliseconds
+*/
+static uint64_t fragmentTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
@@ -0,0 +1,65 @@
+/*
+Title:    XBee Acquisition Control message fragmentation
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+
+#ifndef XBEE_FRAGMENT_H
+#define XBEE_FRAGMENT_H
+
+#include "xbee-acqcontrol.h"
+#include "xbee-tx-scheduler.h"
+#include <stdint.h>
+
+// Fragment format, as in the node library. Each fragment has a header of the
+// mark then hex digits for the message number, fragment index and count.
+#define FRAGMENT_MARK             '+'
+#define FRAGMENT_HEADER             4
+#define FRAGMENT_PAYLOAD           (ACK_PAYLOAD-FRAGMENT_HEADER)
+#define FRAGMENT_MAX               15
+// Reassembly limits. Times are in milliseconds.
+#define FRAGMENT_MESSAGE          (FRAGMENT_MAX*FRAGMENT_PAYLOAD)
+#define FRAGMENT_TIMEOUT         5000   // Wait for all fragments of a message
+
+/* A message being reassembled from a node. */
+
+typedef struct {
+    uint8_t message;        // Message number
+    uint8_t count;          // Fragments in the message, zero if none
+    uint16_t received;      // Bit for each fragment received
+    int length;             // Length once the last fragment is received
+    uint64_t started;       // Time the first fragment came
+    unsigned char data[FRAGMENT_MESSAGE];
+} fragmentBuffer;
+
+//-----------------------------------------------------------------------------
+/* Prototypes */
+
+xbee_err fragmentSend(struct xbee_con *con, const int row,
+                      const unsigned char *data, const int length,
+                      const TxPriority priority);
+bool fragmentPost(struct xbee_con *con, const int row,
+                  const unsigned char *data, const int length,
+                  const TxPriority priority);
+int fragmentReceive(const int row, const unsigned char *data, const int length,
+                    unsigned char *message);
+void fragmentNodeRemove(const int row);
+
+#endif
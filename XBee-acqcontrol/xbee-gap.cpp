@@ -0,0 +1,215 @@
+/**
+@brief XBee Acquisition Control report gap detection
+
+The time each node is next expected to report is followed from the interval set
+by the wake controller, or otherwise that seen between its reports when it is
+the same twice running. A report that comes after one or more intervals with
+nothing heard shows a gap, and a cycle that the node abandons leaves one, as
+its count is then not stored. The caller records both in the data file.
+
+The count for the missed intervals is not lost as the node carries it into its
+next report, but the time at which it came is. A node that keeps the counts of
+its past intervals is asked for them with an option in the ACK to the report
+that showed the gap, and sends them once that cycle is complete, so that the
+missed intervals can be filled in.
+
+Callbacks from libxbee run in different threads, so the state is protected by a
+mutex.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee.h"
+#include "xbee-acqcontrol.h"
+#include "xbee-wake-control.h"
+#include "xbee-gap.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+extern char debug;
+
+/* Report timing, protected by the mutex */
+static pthread_mutex_t gapMutex = PTHREAD_MUTEX_INITIALIZER;
+static gapNode gapInfo[MAXNODES];
+
+/* Local Prototypes */
+static void gapCycleEnd(const int row);
+
+/*--------------------------------------------------------------------------*/
+/** @brief Check a data report against the time it was expected
+
+Only the first report of a cycle is checked, as the retries that follow it
+within GAP_CYCLE_TIME belong to the same interval. If intervals were missed the
+node is asked for its history in the next ACK.
+
+@parameter  int row: node table row.
+@parameter  time_t now: time the report arrived.
+@returns    number of intervals missed before this report.
+*/
+int gapReport(const int row, const time_t now)
+{
+    if ((row < 0) || (row >= MAXNODES)) return 0;
+    pthread_mutex_lock(&gapMutex);
+    gapNode *node = &gapInfo[row];
+    if (node->cycleStart > 0)
+    {
+        if (now - node->cycleStart <= GAP_CYCLE_TIME)
+        {
+            pthread_mutex_unlock(&gapMutex);
+            return 0;
+        }
+/* The end of the last cycle was not heard. If its reports are still held to be
+stored it went through, otherwise it was lost. */
+        if (nodeInfo[row].rxCount > 0) gapCycleEnd(row);
+    }
+    node->cycleStart = now;
+    uint16_t period = wakeControlInterval(row);
+    if (period == 0) period = node->period;
+    int missed = 0;
+    if ((period > 0) && (node->lastReport > 0))
+    {
+        uint32_t ticks = (now - node->lastReport + WAKE_TICK/2)/WAKE_TICK;
+        uint32_t intervals = (ticks + period/2)/period;
+        if (intervals > 1) missed = intervals - 1;
+    }
+/* Ask for the interval just reported as well as those missed, as its count
+covers them all. */
+    if (missed > 0)
+    {
+        node->backfillReport = now;
+        node->backfillPeriod = period;
+        uint8_t history = (missed < GAP_HISTORY) ? missed + 1 : GAP_HISTORY;
+#ifdef DEBUG
+        if (debug) printf("Gap node %d missed %d intervals of %d ticks\n",
+                          row, missed, period);
+#endif
+        nodeInfo[row].configHistory = history;
+        nodeInfo[row].configFlags |= CONFIG_HISTORY;
+        nodeInfo[row].configSent &= ~CONFIG_HISTORY;
+    }
+    pthread_mutex_unlock(&gapMutex);
+    return missed;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Note that the node has confirmed the end of a cycle
+
+The reports of the cycle have been stored, so the next is expected one interval
+after its first report.
+
+@parameter  int row: node table row.
+*/
+void gapComplete(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&gapMutex);
+    gapCycleEnd(row);
+    pthread_mutex_unlock(&gapMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Note that the node has abandoned a cycle
+
+Nothing of the cycle was stored, so the interval is counted as missed when the
+next report comes.
+
+@parameter  int row: node table row.
+*/
+void gapAbandon(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&gapMutex);
+    gapInfo[row].cycleStart = 0;
+    pthread_mutex_unlock(&gapMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Estimated end of an interval in the history sent by a node
+
+@parameter  int row: node table row.
+@parameter  int index: interval in the history, zero for the one reported.
+@returns    time the interval ended, or zero if no history was asked for.
+*/
+time_t gapIntervalEnd(const int row, const int index)
+{
+    if ((row < 0) || (row >= MAXNODES)) return 0;
+    pthread_mutex_lock(&gapMutex);
+    gapNode *node = &gapInfo[row];
+    time_t end = 0;
+    if ((node->backfillReport > 0) && (index >= 0))
+        end = node->backfillReport - (time_t)index*node->backfillPeriod*WAKE_TICK;
+    pthread_mutex_unlock(&gapMutex);
+    return end;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Return the interval at which a node is expected to report
+
+@parameter  int row: node table row.
+@returns    interval in ticks set by the wake controller, otherwise that seen
+            twice running, or zero if not known.
+*/
+uint16_t gapPeriod(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return 0;
+    uint16_t period = wakeControlInterval(row);
+    if (period > 0) return period;
+    pthread_mutex_lock(&gapMutex);
+    period = gapInfo[row].period;
+    pthread_mutex_unlock(&gapMutex);
+    return period;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Remove the state of a node deleted from the node table
+
+The state of the rows following is moved down with the table.
+
+@parameter  int row: node table row being deleted.
+*/
+void gapNodeRemove(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&gapMutex);
+    for (int i = row; i < MAXNODES-1; i++) gapInfo[i] = gapInfo[i+1];
+    memset(&gapInfo[MAXNODES-1], 0, sizeof(gapNode));
+    pthread_mutex_unlock(&gapMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Close the cycle under way and learn the interval from it
+
+The mutex must be held.
+
+@parameter  int row: node table row.
+*/
+static void gapCycleEnd(const int row)
+{
+    gapNode *node = &gapInfo[row];
+    if (node->cycleStart == 0) return;
+    if (node->lastReport > 0)
+    {
+        uint16_t sample = (node->cycleStart - node->lastReport + WAKE_TICK/2)/WAKE_TICK;
+        if ((sample > 0) && (sample == node->sample)) node->period = sample;
+        node->sample = sample;
+    }
+    node->lastReport = node->cycleStart;
+    node->cycleStart = 0;
+}
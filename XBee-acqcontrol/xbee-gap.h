@@ -0,0 +1,61 @@
+/*
+Title:    XBee Acquisition Control report gap detection
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef XBEE_GAP_H
+#define XBEE_GAP_H
+
+#include "xbee-acqcontrol.h"
+#include <stdint.h>
+#include <time.h>
+
+// Most past intervals a node keeps and can send back (HISTORY_SIZE in the node)
+#define GAP_HISTORY                 8
+// Seconds after the first report of a cycle beyond which a report starts a new
+// cycle, in case the end of the last was never heard
+#define GAP_CYCLE_TIME             60
+// History message from the node: 'H', the number of intervals in two hex
+// characters, then the count of each in four hex characters, newest first
+#define GAP_HISTORY_HEADER          3
+#define GAP_HISTORY_COUNT           4
+
+/* Report timing of a node. */
+
+typedef struct {
+    time_t lastReport;      // First report of the last cycle completed
+    time_t cycleStart;      // First report of the cycle under way, or zero
+    uint16_t sample;        // Ticks between the last two completed cycles
+    uint16_t period;        // Interval seen twice running, or zero
+    time_t backfillReport;  // Report after which history was asked for
+    uint16_t backfillPeriod;// Interval when history was asked for
+} gapNode;
+
+//-----------------------------------------------------------------------------
+/* Prototypes */
+
+int gapReport(const int row, const time_t now);
+void gapComplete(const int row);
+void gapAbandon(const int row);
+time_t gapIntervalEnd(const int row, const int index);
+uint16_t gapPeriod(const int row);
+void gapNodeRemove(const int row);
+
+#endif
@@ -0,0 +1,312 @@
+/**
+@brief XBee Acquisition Control node link and protocol health
+
+The outcome of every protocol cycle of each node is kept: the reports of each
+kind, first attempts and retries for a timeout, NAK, receive error or failed
+delivery, along with the delivery status codes, the cycles completed and
+abandoned, and the time from the ACK being sent to the node confirming it.
+Filtered ratios of cycles completed and of those completed at the first attempt
+show the nodes with a bad link, which waste airtime and battery on retries.
+The signal strength is kept where it is known.
+
+A client may read the health of all nodes at once, and may ask to be sent the
+health of a node as a 'k' message whenever a cycle of that node ends.
+
+Callbacks from libxbee and client commands run in different threads, so the
+state is protected by a mutex.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee.h"
+#include "xbee-acqcontrol.h"
+#include "xbee-metrics.h"
+#include "xbee-health.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+extern char debug;
+
+/* Node health, protected by the mutex */
+static pthread_mutex_t healthMutex = PTHREAD_MUTEX_INITIALIZER;
+static healthNode healthInfo[MAXNODES];
+static int clientList[HEALTH_CLIENTS];
+static int clientCount;
+
+/* Local Prototypes */
+static void healthCycleEnd(const int row, const bool completed);
+static uint32_t healthFilter(const uint32_t average, const uint32_t sample,
+                             const bool first);
+static int healthFill(const int row, char *record);
+static void healthPush(const int row);
+
+/*--------------------------------------------------------------------------*/
+/** @brief Count a data report
+
+@parameter  int row: node table row.
+@parameter  char command: report command.
+@parameter  uint8_t parameter: status field of the report, the retry count or
+            for a failed delivery the delivery status code.
+@parameter  bool valid: the report decoded, so the parameter can be used.
+*/
+void healthReport(const int row, const char command, const uint8_t parameter,
+                  const bool valid)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    int kind;
+    if (command == 'C') kind = healthFirst;
+    else if (command == 'T') kind = healthTimeout;
+    else if (command == 'N') kind = healthNak;
+    else if (command == 'E') kind = healthError;
+    else if (command == 'S') kind = healthDelivery;
+    else return;
+    pthread_mutex_lock(&healthMutex);
+    healthNode *node = &healthInfo[row];
+    node->reports[kind]++;
+/* A 'C' with a nonzero retry count is a retry after the ACK was not taken. */
+    if ((kind != healthFirst) || (valid && (parameter > 0)))
+        node->cycleRetried = true;
+    if ((kind == healthDelivery) && valid)
+    {
+        node->lastCode = parameter % HEALTH_CODES;
+        node->codes[node->lastCode]++;
+    }
+    pthread_mutex_unlock(&healthMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Note the time an ACK was sent to a node
+
+@parameter  int row: node table row.
+*/
+void healthAckSent(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&healthMutex);
+    healthInfo[row].ackSent = metricsTime();
+    pthread_mutex_unlock(&healthMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Note that a node has confirmed the end of a cycle
+
+@parameter  int row: node table row.
+*/
+void healthComplete(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&healthMutex);
+    healthNode *node = &healthInfo[row];
+    if (node->ackSent > 0)
+    {
+        uint32_t roundTrip = (metricsTime() - node->ackSent)/1000;
+        node->roundTrip = healthFilter(node->roundTrip, roundTrip,
+                                       node->completed == 0);
+        node->ackSent = 0;
+    }
+    healthCycleEnd(row, true);
+    pthread_mutex_unlock(&healthMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Note that a node has abandoned a cycle
+
+@parameter  int row: node table row.
+*/
+void healthAbandon(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&healthMutex);
+    healthInfo[row].ackSent = 0;
+    healthCycleEnd(row, false);
+    pthread_mutex_unlock(&healthMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Note the signal strength of the last frame from a node
+
+@parameter  int row: node table row.
+@parameter  uint8_t rssi: signal strength in -dBm.
+*/
+void healthRssi(const int row, const uint8_t rssi)
+{
+    if ((row < 0) || (row >= MAXNODES) || (rssi == 0)) return;
+    pthread_mutex_lock(&healthMutex);
+    healthInfo[row].rssi = rssi;
+    pthread_mutex_unlock(&healthMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Return the health of a node as sent to clients
+
+The record has HEALTH_RECORD bytes: the row, two bytes each of the 'C', 'T',
+'N', 'E' and 'S' reports, the cycles completed and those abandoned, a byte each
+of the percentage of cycles completed and of those completed at the first
+attempt, two bytes of the ACK round trip in ms, then a byte each of the signal
+strength in -dBm (zero if not known), the last delivery failure code and the
+most frequent one. Counts are the low 16 bits.
+
+@parameter  int row: node table row.
+@parameter  char *record: buffer of at least HEALTH_RECORD bytes.
+@returns    number of bytes in the record, or zero if the row is invalid.
+*/
+int healthRecord(const int row, char *record)
+{
+    if ((row < 0) || (row >= MAXNODES)) return 0;
+    pthread_mutex_lock(&healthMutex);
+    int length = healthFill(row, record);
+    pthread_mutex_unlock(&healthMutex);
+    return length;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Register or remove a client receiving health messages
+
+Clients that disconnect must be removed.
+
+@parameter  int fd: client socket.
+@parameter  bool subscribe: add the client, otherwise remove it.
+*/
+void healthClientSet(const int fd, const bool subscribe)
+{
+    pthread_mutex_lock(&healthMutex);
+    int i;
+    for (i = 0; i < clientCount; i++) if (clientList[i] == fd) break;
+    if (subscribe && (i == clientCount) && (clientCount < HEALTH_CLIENTS))
+        clientList[clientCount++] = fd;
+    else if (! subscribe && (i < clientCount))
+        clientList[i] = clientList[--clientCount];
+    pthread_mutex_unlock(&healthMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Remove the state of a node deleted from the node table
+
+The state of the rows following is moved down with the table.
+
+@parameter  int row: node table row being deleted.
+*/
+void healthNodeRemove(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&healthMutex);
+    for (int i = row; i < MAXNODES-1; i++) healthInfo[i] = healthInfo[i+1];
+    memset(&healthInfo[MAXNODES-1], 0, sizeof(healthNode));
+    pthread_mutex_unlock(&healthMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Count the end of a cycle in the ratios and push the health
+
+The mutex must be held.
+
+@parameter  int row: node table row.
+@parameter  bool completed: the node confirmed the cycle, otherwise abandoned it.
+*/
+static void healthCycleEnd(const int row, const bool completed)
+{
+    healthNode *node = &healthInfo[row];
+    bool first = (node->completed + node->abandoned == 0);
+    uint32_t full = 100 << HEALTH_SHIFT;
+    node->success = healthFilter(node->success, completed ? full : 0, first);
+    node->firstTry = healthFilter(node->firstTry,
+                        (completed && ! node->cycleRetried) ? full : 0, first);
+    if (completed) node->completed++;
+    else node->abandoned++;
+    node->cycleRetried = false;
+#ifdef DEBUG
+    if (debug) printf("Health node %d %s success %d%% first try %d%%\n", row,
+                      completed ? "completed" : "abandoned",
+                      node->success >> HEALTH_SHIFT, node->firstTry >> HEALTH_SHIFT);
+#endif
+    healthPush(row);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Exponential filter
+
+@parameter  uint32_t average: filtered value so far.
+@parameter  uint32_t sample: new sample.
+@parameter  bool first: the sample is the first, so is taken as it is.
+@returns    new filtered value.
+*/
+static uint32_t healthFilter(const uint32_t average, const uint32_t sample,
+                             const bool first)
+{
+    if (first) return sample;
+    return average + (((int32_t)sample - (int32_t)average) >> HEALTH_FILTER);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Fill in the health record of a node
+
+The mutex must be held.
+
+@parameter  int row: node table row.
+@parameter  char *record: buffer of at least HEALTH_RECORD bytes.
+@returns    number of bytes in the record.
+*/
+static int healthFill(const int row, char *record)
+{
+    healthNode *node = &healthInfo[row];
+    int length = 0;
+    record[length++] = row;
+    uint32_t count[HEALTH_REPORTS+2];
+    for (int i = 0; i < HEALTH_REPORTS; i++) count[i] = node->reports[i];
+    count[HEALTH_REPORTS] = node->completed;
+    count[HEALTH_REPORTS+1] = node->abandoned;
+    for (int i = 0; i < HEALTH_REPORTS+2; i++)
+    {
+        record[length++] = (char) (count[i] >> 8);
+        record[length++] = (char) (count[i]);
+    }
+    record[length++] = node->success >> HEALTH_SHIFT;
+    record[length++] = node->firstTry >> HEALTH_SHIFT;
+    uint16_t roundTrip = (node->roundTrip > 0xFFFF) ? 0xFFFF : node->roundTrip;
+    record[length++] = (char) (roundTrip >> 8);
+    record[length++] = (char) (roundTrip);
+    record[length++] = node->rssi;
+    record[length++] = node->lastCode;
+    int frequent = 0;
+    for (int i = 1; i < HEALTH_CODES; i++)
+        if (node->codes[i] > node->codes[frequent]) frequent = i;
+    record[length++] = frequent;
+    return length;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Push the health of a node to all subscribed clients
+
+The message is [length,'k',record], the record starting with the row as in
+the reply to the 'K' command. Clients that cannot take it immediately miss out.
+The mutex must be held.
+
+@parameter  int row: node table row.
+*/
+static void healthPush(const int row)
+{
+    char message[2+HEALTH_RECORD];
+    message[1] = 'k';
+    int length = 2 + healthFill(row, message+2);
+    message[0] = length;
+    for (int i = 0; i < clientCount; i++)
+        send(clientList[i], message, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
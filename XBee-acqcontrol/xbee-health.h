@@ -0,0 +1,77 @@
+/*
+Title:    XBee Acquisition Control node link and protocol health
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef XBEE_HEALTH_H
+#define XBEE_HEALTH_H
+
+#include "xbee-acqcontrol.h"
+#include <stdint.h>
+
+// Smoothing of the ratios and round trip time as a shift (1/16 new sample)
+#define HEALTH_FILTER               4
+// Fixed point fraction bits of the ratios
+#define HEALTH_SHIFT                8
+#define HEALTH_CODES               64   // Delivery status codes, 6 bits in a report
+#define HEALTH_RECORD              22   // Bytes of a node in a reply or push
+#define HEALTH_CLIENTS              8   // Clients receiving health messages
+
+/* Report commands counted, in the order of the counts */
+enum HealthReport
+{
+    healthFirst = 0,        // 'C' first attempt
+    healthTimeout = 1,      // 'T' retry after no ACK
+    healthNak = 2,          // 'N' retry after a NAK
+    healthError = 3,        // 'E' retry after a receive error
+    healthDelivery = 4      // 'S' retry after a failed delivery
+};
+#define HEALTH_REPORTS              5
+
+/* Health of a node. */
+
+typedef struct {
+    uint32_t reports[HEALTH_REPORTS];   // Reports by command
+    uint32_t completed;     // Cycles confirmed by the node
+    uint32_t abandoned;     // Cycles abandoned by the node
+    uint32_t success;       // Filtered ratio of cycles completed, fixed point
+    uint32_t firstTry;      // Filtered ratio completed without a retry
+    bool cycleRetried;      // A retry has been seen in the cycle under way
+    uint64_t ackSent;       // Time the last ACK was sent, in us, or zero
+    uint32_t roundTrip;     // Filtered ACK to confirmation time in ms
+    uint8_t rssi;           // Last signal strength in -dBm, or zero
+    uint8_t lastCode;       // Last delivery failure code
+    uint16_t codes[HEALTH_CODES];   // Delivery failures by code
+} healthNode;
+
+//-----------------------------------------------------------------------------
+/* Prototypes */
+
+void healthReport(const int row, const char command, const uint8_t parameter,
+                  const bool valid);
+void healthAckSent(const int row);
+void healthComplete(const int row);
+void healthAbandon(const int row);
+void healthRssi(const int row, const uint8_t rssi);
+int healthRecord(const int row, char *record);
+void healthClientSet(const int fd, const bool subscribe);
+void healthNodeRemove(const int row);
+
+#endif
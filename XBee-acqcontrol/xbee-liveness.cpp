@@ -0,0 +1,338 @@
+/**
+@brief XBee Acquisition Control node liveness tracking
+
+Each node has a deadline by which it should next be heard, set from its wake
+interval each time a packet arrives from it. A node that misses its deadline is
+marked stale, and becomes alive again when it is next heard. Each change is
+pushed to the clients that have asked for them as a 'y' message with the row
+and the new state.
+
+The deadlines are held in a hierarchical timer wheel advanced by a task in the
+main loop. Level 0 has a slot for each of the next LIVENESS_SLOTS ticks, and each
+slot of a higher level covers a whole turn of the level below. When a level
+turns over, the next slot of the level above is emptied into the levels below.
+Setting, moving and expiring a deadline each cost a fixed amount of work, so a
+tick costs the same however many nodes are tracked.
+
+Packets arrive in libxbee callback threads while the wheel is advanced from the
+main loop, so the state is protected by a mutex.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee.h"
+#include "xbee-acqcontrol.h"
+#include "xbee-wake-control.h"
+#include "xbee-gap.h"
+#include "xbee-liveness.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/socket.h>
+
+extern char debug;
+
+/* Wheel and node state, protected by the mutex */
+static pthread_mutex_t livenessMutex = PTHREAD_MUTEX_INITIALIZER;
+static livenessNode livenessInfo[MAXNODES];
+static int wheel[LIVENESS_LEVELS][LIVENESS_SLOTS];  // First row in each slot
+static uint32_t wheelTime;          // Next tick to be processed
+static time_t wheelStart;           // Time of tick zero
+static bool wheelRunning;
+static int clientList[LIVENESS_CLIENTS];
+static int clientCount;
+
+/* Local Prototypes */
+static void livenessArm(const int row, const time_t now);
+static void wheelInsert(const int row);
+static void wheelUnlink(const int row);
+static void wheelCascade(const int level, const int slot);
+static void livenessPush(const int row);
+
+/*--------------------------------------------------------------------------*/
+/** @brief Start the wheel and give each node in the table a deadline
+
+The interval of each node is not yet known, so each is given LIVENESS_WAIT to
+be heard.
+
+@parameter  time_t now: current time.
+*/
+void livenessStart(const time_t now)
+{
+    pthread_mutex_lock(&livenessMutex);
+    memset(wheel, 0xFF, sizeof(wheel));
+    wheelTime = 0;
+    wheelStart = now;
+    wheelRunning = true;
+    for (int row = 0; row < MAXNODES; row++)
+    {
+        livenessInfo[row].state = LIVENESS_UNKNOWN;
+        livenessInfo[row].lastHeard = 0;
+        livenessInfo[row].level = -1;
+        if (row < numberNodes) livenessArm(row, now);
+    }
+    pthread_mutex_unlock(&livenessMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Note that a packet has been heard from a node
+
+Its deadline is moved on and a stale node is made alive again.
+
+@parameter  int row: node table row.
+@parameter  time_t now: time the packet arrived.
+*/
+void livenessHeard(const int row, const time_t now)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&livenessMutex);
+    if (wheelRunning)
+    {
+        livenessNode *node = &livenessInfo[row];
+        node->lastHeard = now;
+        livenessArm(row, now);
+        if (node->state != LIVENESS_ALIVE)
+        {
+            node->state = LIVENESS_ALIVE;
+            livenessPush(row);
+        }
+    }
+    pthread_mutex_unlock(&livenessMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Advance the wheel to the current time
+
+Every tick up to the current time is processed, so a late call catches up.
+Nodes whose deadlines fall due are marked stale.
+
+@parameter  time_t now: current time.
+*/
+void livenessTick(const time_t now)
+{
+    pthread_mutex_lock(&livenessMutex);
+    if (! wheelRunning || (now < wheelStart))
+    {
+        pthread_mutex_unlock(&livenessMutex);
+        return;
+    }
+    uint32_t target = (now - wheelStart)/LIVENESS_TICK;
+    while (wheelTime <= target)
+    {
+        int index = wheelTime & LIVENESS_MASK;
+/* When a level turns over, bring down the next slot of the level above, and
+of the level above that if it has also turned over. */
+        if (index == 0)
+        {
+            for (int level = 1; level < LIVENESS_LEVELS; level++)
+            {
+                int slot = (wheelTime >> (LIVENESS_BITS*level)) & LIVENESS_MASK;
+                wheelCascade(level, slot);
+                if (slot != 0) break;
+            }
+        }
+        while (wheel[0][index] >= 0)
+        {
+            int row = wheel[0][index];
+            wheelUnlink(row);
+            livenessInfo[row].state = LIVENESS_STALE;
+            syslog(LOG_INFO, "Node %s stale\n", nodeInfo[row].nodeIdent);
+#ifdef DEBUG
+            if (debug) printf("Liveness node %d stale\n", row);
+#endif
+            livenessPush(row);
+        }
+        wheelTime++;
+    }
+    pthread_mutex_unlock(&livenessMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Return the liveness of a node
+
+@parameter  int row: node table row.
+@parameter  time_t *lastHeard: time the node was last heard, zero if never.
+@returns    liveness state.
+*/
+char livenessState(const int row, time_t *lastHeard)
+{
+    *lastHeard = 0;
+    if ((row < 0) || (row >= MAXNODES)) return LIVENESS_UNKNOWN;
+    pthread_mutex_lock(&livenessMutex);
+    char state = livenessInfo[row].state;
+    if (state == 0) state = LIVENESS_UNKNOWN;
+    *lastHeard = livenessInfo[row].lastHeard;
+    pthread_mutex_unlock(&livenessMutex);
+    return state;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Register or remove a client receiving liveness messages
+
+Clients that disconnect must be removed.
+
+@parameter  int fd: client socket.
+@parameter  bool subscribe: add the client, otherwise remove it.
+*/
+void livenessClientSet(const int fd, const bool subscribe)
+{
+    pthread_mutex_lock(&livenessMutex);
+    int i;
+    for (i = 0; i < clientCount; i++) if (clientList[i] == fd) break;
+    if (subscribe && (i == clientCount) && (clientCount < LIVENESS_CLIENTS))
+        clientList[clientCount++] = fd;
+    else if (! subscribe && (i < clientCount))
+        clientList[i] = clientList[--clientCount];
+    pthread_mutex_unlock(&livenessMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Remove the state of a node deleted from the node table
+
+The rows following are taken out of the wheel, moved down with the table, then
+put back with the same deadlines.
+
+@parameter  int row: node table row being deleted.
+*/
+void livenessNodeRemove(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&livenessMutex);
+    bool armed[MAXNODES];
+    for (int i = row; i < MAXNODES; i++)
+    {
+        armed[i] = wheelRunning && (livenessInfo[i].level >= 0);
+        if (armed[i]) wheelUnlink(i);
+    }
+    for (int i = row; i < MAXNODES-1; i++)
+    {
+        livenessInfo[i] = livenessInfo[i+1];
+        armed[i] = armed[i+1];
+        if (armed[i]) wheelInsert(i);
+    }
+    memset(&livenessInfo[MAXNODES-1], 0, sizeof(livenessNode));
+    livenessInfo[MAXNODES-1].level = -1;
+    pthread_mutex_unlock(&livenessMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Set the deadline of a node from its wake interval
+
+The mutex must be held.
+
+@parameter  int row: node table row.
+@parameter  time_t now: current time.
+*/
+static void livenessArm(const int row, const time_t now)
+{
+    uint32_t wait = LIVENESS_WAIT;
+    uint16_t period = gapPeriod(row);
+    if (period > 0) wait = (uint32_t)period*WAKE_TICK*LIVENESS_INTERVALS + LIVENESS_GRACE;
+    uint32_t tick = (now > wheelStart) ? (now - wheelStart)/LIVENESS_TICK : 0;
+    if (livenessInfo[row].level >= 0) wheelUnlink(row);
+    livenessInfo[row].expiry = tick + (wait + LIVENESS_TICK - 1)/LIVENESS_TICK;
+    wheelInsert(row);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Put a node into the wheel slot for its deadline
+
+The level is chosen from the time left, and the slot within it from the
+deadline itself. A deadline already passed goes in the next slot to be
+processed, and one beyond the span of the wheel is brought in to its end. The
+mutex must be held.
+
+@parameter  int row: node table row.
+*/
+static void wheelInsert(const int row)
+{
+    livenessNode *node = &livenessInfo[row];
+    if (node->expiry < wheelTime) node->expiry = wheelTime;
+    if (node->expiry - wheelTime >= LIVENESS_SPAN)
+        node->expiry = wheelTime + LIVENESS_SPAN - 1;
+    uint32_t delta = node->expiry - wheelTime;
+    int level = 0;
+    while ((level < LIVENESS_LEVELS-1) &&
+           (delta >= (1UL << (LIVENESS_BITS*(level+1))))) level++;
+    int slot = (node->expiry >> (LIVENESS_BITS*level)) & LIVENESS_MASK;
+    node->level = level;
+    node->slot = slot;
+    node->prev = -1;
+    node->next = wheel[level][slot];
+    if (node->next >= 0) livenessInfo[node->next].prev = row;
+    wheel[level][slot] = row;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Take a node out of its wheel slot
+
+The mutex must be held.
+
+@parameter  int row: node table row.
+*/
+static void wheelUnlink(const int row)
+{
+    livenessNode *node = &livenessInfo[row];
+    if (node->level < 0) return;
+    if (node->prev >= 0) livenessInfo[node->prev].next = node->next;
+    else wheel[node->level][node->slot] = node->next;
+    if (node->next >= 0) livenessInfo[node->next].prev = node->prev;
+    node->level = -1;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Move the nodes in a slot down to the levels below
+
+The mutex must be held.
+
+@parameter  int level: wheel level.
+@parameter  int slot: slot within the level.
+*/
+static void wheelCascade(const int level, const int slot)
+{
+    int row = wheel[level][slot];
+    wheel[level][slot] = -1;
+    while (row >= 0)
+    {
+        int next = livenessInfo[row].next;
+        livenessInfo[row].level = -1;
+        wheelInsert(row);
+        row = next;
+    }
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Push the liveness of a node to all subscribed clients
+
+The message is [length,'y',row,state]. Clients that cannot take it immediately
+miss out. The mutex must be held.
+
+@parameter  int row: node table row.
+*/
+static void livenessPush(const int row)
+{
+    char message[4];
+    message[0] = 4;
+    message[1] = 'y';
+    message[2] = row;
+    message[3] = livenessInfo[row].state;
+    for (int i = 0; i < clientCount; i++)
+        send(clientList[i], message, 4, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
@@ -0,0 +1,73 @@
+/*
+Title:    XBee Acquisition Control node liveness tracking
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef XBEE_LIVENESS_H
+#define XBEE_LIVENESS_H
+
+#include "xbee-acqcontrol.h"
+#include <stdint.h>
+#include <time.h>
+
+// Timer wheel. Each level has LIVENESS_SLOTS slots, each slot of a level
+// covering all the slots of the level below, so that the wheel spans
+// LIVENESS_SLOTS^LIVENESS_LEVELS ticks (about 3 days).
+#define LIVENESS_TICK               1   // Seconds per tick of the wheel
+#define LIVENESS_BITS               6
+#define LIVENESS_SLOTS             (1 << LIVENESS_BITS)
+#define LIVENESS_MASK              (LIVENESS_SLOTS-1)
+#define LIVENESS_LEVELS             3
+#define LIVENESS_SPAN              (1UL << (LIVENESS_BITS*LIVENESS_LEVELS))
+// A node is stale once it has missed this many wake intervals plus the grace
+// time in seconds, or after the wait given when its interval is not known
+#define LIVENESS_INTERVALS          2
+#define LIVENESS_GRACE             30
+#define LIVENESS_WAIT            7200
+#define LIVENESS_CLIENTS            8   // Clients receiving liveness messages
+
+// Liveness states, as sent to clients
+#define LIVENESS_UNKNOWN          'U'   // Not heard since startup
+#define LIVENESS_ALIVE            'A'   // Heard within its deadline
+#define LIVENESS_STALE            'S'   // Deadline passed with nothing heard
+
+/* Liveness of a node and its place in the timer wheel. */
+
+typedef struct {
+    char state;
+    time_t lastHeard;       // Time of the last packet, or zero
+    uint32_t expiry;        // Wheel tick at which the node goes stale
+    int level;              // Wheel level holding the node, or -1 if none
+    int slot;
+    int next;               // Rows before and after in the slot, or -1
+    int prev;
+} livenessNode;
+
+//-----------------------------------------------------------------------------
+/* Prototypes */
+
+void livenessStart(const time_t now);
+void livenessHeard(const int row, const time_t now);
+void livenessTick(const time_t now);
+char livenessState(const int row, time_t *lastHeard);
+void livenessClientSet(const int fd, const bool subscribe);
+void livenessNodeRemove(const int row);
+
+#endif
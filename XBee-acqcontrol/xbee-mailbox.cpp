@@ -0,0 +1,331 @@
+/**
+@brief XBee Acquisition Control downstream mailbox
+
+Commands for a sleeping end device are held here until the node next reports.
+A client posts a string for the node MCU or a remote AT command for the node
+XBee, and its mailbox is flagged in the acknowledgement to the node's next data
+report. The node then stays awake after completing its cycle, and the messages
+are delivered one at a time, each once the response to the previous one has
+arrived. No wake window has to be opened beforehand.
+
+The response to each message is pushed to the client that posted it as an 'm'
+message holding the row, the message type, a status and the response. A message
+that has been delivered but not answered in time is pushed with a timeout
+status. The node may still act on it if it was held by the parent until the
+node next woke.
+
+Callbacks from libxbee and client commands run in different threads, so the
+mailboxes are protected by a mutex.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee.h"
+#include "xbee-acqcontrol.h"
+#include "xbee-mailbox.h"
+#include "xbee-tx-scheduler.h"
+#include "xbee-fragment.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+extern char debug;
+
+/* Mailboxes for each node table row, protected by the mutex */
+static pthread_mutex_t mailboxMutex = PTHREAD_MUTEX_INITIALIZER;
+static mailboxEntry mailbox[MAXNODES][MAILBOX_SIZE];
+static int mailboxCount[MAXNODES];
+
+/* Local Prototypes */
+static bool mailboxSend(const int row);
+static void mailboxExpire(void);
+static void mailboxPush(const int row, const int index, const char status,
+                        const unsigned char *data, const int length);
+static void mailboxRemove(const int row, const int index);
+static uint64_t mailboxTime(void);
+
+/*--------------------------------------------------------------------------*/
+/** @brief Post a message for a node
+
+@parameter  int row: node table row.
+@parameter  char type: MAILBOX_STRING or MAILBOX_REMOTE_AT.
+@parameter  unsigned char *data: message. A remote AT command starts with the
+            two command characters.
+@parameter  int length: length of the message.
+@parameter  int fd: client socket to receive the result.
+@returns    false if the message is invalid or the mailbox is full.
+*/
+bool mailboxPost(const int row, const char type, const unsigned char *data,
+                 const int length, const int fd)
+{
+    if ((row < 0) || (row >= numberNodes)) return false;
+    if ((type != MAILBOX_STRING) && (type != MAILBOX_REMOTE_AT)) return false;
+    if ((length < 1) || (length > MAILBOX_LENGTH)) return false;
+    if ((type == MAILBOX_REMOTE_AT) && (length < 2)) return false;
+    bool ok = false;
+    pthread_mutex_lock(&mailboxMutex);
+    mailboxExpire();
+    if (mailboxCount[row] < MAILBOX_SIZE)
+    {
+        mailboxEntry *entry = &mailbox[row][mailboxCount[row]++];
+        entry->type = type;
+        entry->delivered = false;
+        entry->fd = fd;
+        entry->sentTime = 0;
+        entry->length = length;
+        memcpy(entry->data, data, length);
+        ok = true;
+    }
+    pthread_mutex_unlock(&mailboxMutex);
+#ifdef DEBUG
+    if (debug) printf("Mailbox node %d post %c %s\n", row, type, ok ? "queued" : "full");
+#endif
+    return ok;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Check if a node has messages waiting to be delivered
+
+@parameter  int row: node table row.
+@returns    true if any message has not yet been delivered.
+*/
+bool mailboxPending(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return false;
+    bool pending = false;
+    pthread_mutex_lock(&mailboxMutex);
+    mailboxExpire();
+    for (int i = 0; i < mailboxCount[row]; i++)
+        if (! mailbox[row][i].delivered) pending = true;
+    pthread_mutex_unlock(&mailboxMutex);
+    return pending;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Deliver the next message to a node that is awake
+
+This is called once the node has completed its data report. Nothing is sent
+while a delivered message is still waiting for its response.
+
+@parameter  int row: node table row.
+*/
+void mailboxDeliver(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&mailboxMutex);
+    mailboxExpire();
+    while (! mailboxSend(row));
+    pthread_mutex_unlock(&mailboxMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Pass a response from a node to the mailbox
+
+The response is matched to the oldest delivered message of the same type. A
+remote AT response must also have the same command. The next message is then
+delivered while the node is still awake.
+
+@parameter  int row: node table row.
+@parameter  char type: MAILBOX_STRING or MAILBOX_REMOTE_AT.
+@parameter  unsigned char *data: response. A remote AT response starts with the
+            two command characters.
+@parameter  int length: length of the response.
+@returns    true if the response was for a mailbox message.
+*/
+bool mailboxResponse(const int row, const char type, const unsigned char *data,
+                     const int length)
+{
+    if ((row < 0) || (row >= MAXNODES)) return false;
+    bool matched = false;
+    pthread_mutex_lock(&mailboxMutex);
+    mailboxExpire();
+    for (int i = 0; i < mailboxCount[row]; i++)
+    {
+        mailboxEntry *entry = &mailbox[row][i];
+        if ((! entry->delivered) || (entry->type != type)) continue;
+        if ((type == MAILBOX_REMOTE_AT) && ((length < 2) ||
+            (entry->data[0] != data[0]) || (entry->data[1] != data[1]))) continue;
+        mailboxPush(row, i, MAILBOX_RESPONSE, data, length);
+        mailboxRemove(row, i);
+        matched = true;
+        break;
+    }
+    if (matched) while (! mailboxSend(row));
+    pthread_mutex_unlock(&mailboxMutex);
+    return matched;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Remove the mailbox of a node deleted from the node table
+
+The mailboxes of the rows following are moved down with the table. Clients
+are told that the messages for the deleted node have failed.
+
+@parameter  int row: node table row being deleted.
+*/
+void mailboxNodeRemove(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&mailboxMutex);
+    while (mailboxCount[row] > 0)
+    {
+        mailboxPush(row, 0, MAILBOX_FAILED, NULL, 0);
+        mailboxRemove(row, 0);
+    }
+    for (int i = row; i < MAXNODES-1; i++)
+    {
+        memcpy(mailbox[i], mailbox[i+1], sizeof(mailbox[i]));
+        mailboxCount[i] = mailboxCount[i+1];
+    }
+    mailboxCount[MAXNODES-1] = 0;
+    pthread_mutex_unlock(&mailboxMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Forget a client that has disconnected
+
+Its messages are still delivered but the results are not pushed.
+
+@parameter  int fd: client socket.
+*/
+void mailboxClientRemove(const int fd)
+{
+    pthread_mutex_lock(&mailboxMutex);
+    for (int row = 0; row < MAXNODES; row++)
+        for (int i = 0; i < mailboxCount[row]; i++)
+            if (mailbox[row][i].fd == fd) mailbox[row][i].fd = -1;
+    pthread_mutex_unlock(&mailboxMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Send the next undelivered message of a node
+
+Only one message is delivered at a time, so it is always the first in the
+mailbox. The message is queued with the transmit scheduler rather than waited
+for, as the mutex is held; one that is not sent is timed out with no response. A
+message that cannot be queued is failed and removed. The mutex must be held.
+
+@parameter  int row: node table row.
+@returns    false if a message failed, so that the next can be tried.
+*/
+static bool mailboxSend(const int row)
+{
+    if ((mailboxCount[row] == 0) || mailbox[row][0].delivered) return true;
+    mailboxEntry *entry = &mailbox[row][0];
+    struct xbee_con *con = nodeInfo[row].dataCon;
+    if (entry->type == MAILBOX_REMOTE_AT) con = nodeInfo[row].atCon;
+    bool queued;
+    if (entry->type == MAILBOX_REMOTE_AT)
+        queued = txPost(con, row, entry->data, entry->length, txCommand);
+    else queued = fragmentPost(con, row, entry->data, entry->length, txCommand);
+#ifdef DEBUG
+    if (debug)
+        printf("Mailbox node %d deliver %c %s\n", row, entry->type,
+               queued ? "queued" : "failed");
+#endif
+    if (! queued)
+    {
+        mailboxPush(row, 0, MAILBOX_FAILED, NULL, 0);
+        mailboxRemove(row, 0);
+        return false;
+    }
+    entry->delivered = true;
+    entry->sentTime = mailboxTime();
+    return true;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Time out delivered messages that have had no response
+
+The mutex must be held.
+*/
+static void mailboxExpire(void)
+{
+    uint64_t now = mailboxTime();
+    for (int row = 0; row < MAXNODES; row++)
+    {
+        for (int i = 0; i < mailboxCount[row];)
+        {
+            mailboxEntry *entry = &mailbox[row][i];
+            if (entry->delivered && (now - entry->sentTime > MAILBOX_TIMEOUT))
+            {
+                mailboxPush(row, i, MAILBOX_TIMED_OUT, NULL, 0);
+                mailboxRemove(row, i);
+            }
+            else i++;
+        }
+    }
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Push the result of a message to the client that posted it
+
+The message has the form [length,'m',row,type,status,response]. A client that
+cannot take it immediately misses out. The mutex must be held.
+
+@parameter  int row: node table row.
+@parameter  int index: message in the mailbox.
+@parameter  char status: MAILBOX_RESPONSE, MAILBOX_FAILED or MAILBOX_TIMED_OUT.
+@parameter  unsigned char *data: response, if any.
+@parameter  int length: length of the response.
+*/
+static void mailboxPush(const int row, const int index, const char status,
+                        const unsigned char *data, const int length)
+{
+    mailboxEntry *entry = &mailbox[row][index];
+    if (entry->fd < 0) return;
+    char message[MAILBOX_LENGTH+5];
+    int messageLength = 5;
+    message[1] = 'm';
+    message[2] = row;
+    message[3] = entry->type;
+    message[4] = status;
+    for (int i = 0; (i < length) && (messageLength < MAILBOX_LENGTH+5); i++)
+        message[messageLength++] = data[i];
+    message[0] = messageLength;
+    send(entry->fd, message, messageLength, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Remove a message from a mailbox
+
+The mutex must be held.
+
+@parameter  int row: node table row.
+@parameter  int index: message in the mailbox.
+*/
+static void mailboxRemove(const int row, const int index)
+{
+    mailboxCount[row]--;
+    for (int i = index; i < mailboxCount[row]; i++)
+        mailbox[row][i] = mailbox[row][i+1];
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Monotonic time in milliseconds
+*/
+static uint64_t mailboxTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
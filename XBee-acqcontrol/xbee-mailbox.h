@@ -0,0 +1,66 @@
+/*
+Title:    XBee Acquisition Control downstream mailbox
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef XBEE_MAILBOX_H
+#define XBEE_MAILBOX_H
+
+#include "xbee-acqcontrol.h"
+#include <stdint.h>
+
+// Mailbox limits. Times are in milliseconds.
+#define MAILBOX_SIZE                4   // Messages held for each node
+#define MAILBOX_LENGTH             80   // Longest message
+#define MAILBOX_TIMEOUT         10000   // Wait for a response once delivered
+
+// Message types, as given by the client
+#define MAILBOX_STRING            'S'   // String to the node MCU
+#define MAILBOX_REMOTE_AT         'R'   // Remote AT command to the node XBee
+
+// Status pushed to the client with the result
+#define MAILBOX_RESPONSE          'Y'   // Response follows
+#define MAILBOX_FAILED            'N'   // Delivery failed
+#define MAILBOX_TIMED_OUT         'T'   // No response once delivered
+
+/* A message waiting for its node to wake. */
+
+typedef struct {
+    char type;              // MAILBOX_STRING or MAILBOX_REMOTE_AT
+    bool delivered;         // Sent, waiting for the response
+    int fd;                 // Client to receive the result
+    uint64_t sentTime;
+    int length;
+    unsigned char data[MAILBOX_LENGTH];
+} mailboxEntry;
+
+//-----------------------------------------------------------------------------
+/* Prototypes */
+
+bool mailboxPost(const int row, const char type, const unsigned char *data,
+                 const int length, const int fd);
+bool mailboxPending(const int row);
+void mailboxDeliver(const int row);
+bool mailboxResponse(const int row, const char type, const unsigned char *data,
+                     const int length);
+void mailboxNodeRemove(const int row);
+void mailboxClientRemove(const int fd);
+
+#endif
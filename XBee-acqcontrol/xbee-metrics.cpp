@@ -0,0 +1,315 @@
+/**
+@brief XBee Acquisition Control process metrics
+
+Counters, gauges and latency histograms are kept for the receive path, the
+transmit queues, the data file and the command interface, so that a stall under
+load can be traced to where it happens. They are updated with atomic operations
+from whichever thread sees the event, so no lock is taken on the packet path.
+
+Latency histograms are log-linear as in HDR histograms: each power of two of
+microseconds is split into a few buckets, which gives the same relative
+resolution over the whole range at a fixed cost per sample.
+
+The metrics are rendered in the Prometheus text format, served by HTTP on a
+local port from the main loop and returned through the 'O' client command.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee-metrics.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+/* Metrics, updated atomically */
+static uint64_t frames[256];
+static uint64_t decodeErrors[METRICS_ERRORS];
+static uint64_t counter[METRIC_COUNTERS];
+static int64_t gauge[METRIC_GAUGES];
+static metricsHistogram histogram[METRIC_HISTOGRAMS];
+
+static const char *errorName[METRICS_ERRORS] =
+    {"none", "length", "hex", "checksum"};
+static const char *counterName[METRIC_COUNTERS] =
+    {"acks_sent_total", "naks_sent_total", "ack_queue_full_total",
+     "client_commands_total", "file_flushes_total"};
+static const char *gaugeClass[METRIC_GAUGES] = {"ack", "command", "bulk"};
+static const char *histogramName[METRIC_HISTOGRAMS] =
+    {"ack_latency_seconds", "rx_callback_seconds", "file_flush_seconds",
+     "client_command_seconds"};
+
+/* Local Prototypes */
+static int metricsBucket(const uint64_t value);
+static uint64_t metricsBucketTop(const int bucket);
+static int metricsPrint(char *buffer, const int length, const int size,
+                        const char *format, ...);
+
+/*--------------------------------------------------------------------------*/
+/** @brief Monotonic time in microseconds
+*/
+uint64_t metricsTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Count a frame received from a node
+
+@parameter  unsigned char type: command character of the frame.
+*/
+void metricsFrame(const unsigned char type)
+{
+    __atomic_add_fetch(&frames[type], 1, __ATOMIC_RELAXED);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Count a data report that failed to decode
+
+@parameter  int error: DataError found.
+*/
+void metricsDecodeError(const int error)
+{
+    if ((error < 0) || (error >= METRICS_ERRORS)) return;
+    __atomic_add_fetch(&decodeErrors[error], 1, __ATOMIC_RELAXED);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Count an event
+
+@parameter  MetricCounter which: event counted.
+*/
+void metricsCount(const MetricCounter which)
+{
+    __atomic_add_fetch(&counter[which], 1, __ATOMIC_RELAXED);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Set a gauge
+
+@parameter  MetricGauge which: gauge set.
+@parameter  int64_t value: current value.
+*/
+void metricsGauge(const MetricGauge which, const int64_t value)
+{
+    __atomic_store_n(&gauge[which], value, __ATOMIC_RELAXED);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Add the time since a start to a latency histogram
+
+@parameter  MetricHistogram which: histogram added to.
+@parameter  uint64_t start: time the operation started, from metricsTime().
+*/
+void metricsLatency(const MetricHistogram which, const uint64_t start)
+{
+    uint64_t now = metricsTime();
+    uint64_t value = (now > start) ? now - start : 0;
+    metricsHistogram *h = &histogram[which];
+    int bucket = metricsBucket(value);
+    if (bucket < 0) __atomic_add_fetch(&h->overflow, 1, __ATOMIC_RELAXED);
+    else __atomic_add_fetch(&h->bucket[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Render the metrics in the Prometheus text format
+
+Only the frame types seen are given. Histogram buckets are cumulative and only
+those that add to the count are given, along with the +Inf bucket.
+
+@parameter  char *buffer: text rendered, terminated.
+@parameter  int size: size of the buffer.
+@returns    length of the text, cut short if the buffer is too small.
+*/
+int metricsRender(char *buffer, const int size)
+{
+    int n = 0;
+    n = metricsPrint(buffer, n, size, "# TYPE " METRICS_PREFIX "frames_received_total counter\n");
+    for (int type = 0; type < 256; type++)
+    {
+        unsigned long long value = __atomic_load_n(&frames[type], __ATOMIC_RELAXED);
+        if (value == 0) continue;
+        if ((type > ' ') && (type < 0x7F) && (type != '"') && (type != '\\'))
+            n = metricsPrint(buffer, n, size,
+                    METRICS_PREFIX "frames_received_total{type=\"%c\"} %llu\n", type, value);
+        else
+            n = metricsPrint(buffer, n, size,
+                    METRICS_PREFIX "frames_received_total{type=\"0x%02X\"} %llu\n", type, value);
+    }
+    n = metricsPrint(buffer, n, size, "# TYPE " METRICS_PREFIX "decode_errors_total counter\n");
+    for (int error = 1; error < METRICS_ERRORS; error++)
+    {
+        unsigned long long value = __atomic_load_n(&decodeErrors[error], __ATOMIC_RELAXED);
+        n = metricsPrint(buffer, n, size,
+                METRICS_PREFIX "decode_errors_total{error=\"%s\"} %llu\n", errorName[error], value);
+    }
+    for (int i = 0; i < METRIC_COUNTERS; i++)
+    {
+        unsigned long long value = __atomic_load_n(&counter[i], __ATOMIC_RELAXED);
+        n = metricsPrint(buffer, n, size, "# TYPE " METRICS_PREFIX "%s counter\n", counterName[i]);
+        n = metricsPrint(buffer, n, size, METRICS_PREFIX "%s %llu\n", counterName[i], value);
+    }
+    n = metricsPrint(buffer, n, size, "# TYPE " METRICS_PREFIX "tx_queue_depth gauge\n");
+    for (int i = 0; i < METRIC_GAUGES; i++)
+    {
+        long long value = __atomic_load_n(&gauge[i], __ATOMIC_RELAXED);
+        n = metricsPrint(buffer, n, size,
+                METRICS_PREFIX "tx_queue_depth{class=\"%s\"} %lld\n", gaugeClass[i], value);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAMS; i++)
+    {
+        metricsHistogram *h = &histogram[i];
+        const char *name = histogramName[i];
+        n = metricsPrint(buffer, n, size, "# TYPE " METRICS_PREFIX "%s histogram\n", name);
+        unsigned long long cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+        {
+            uint64_t value = __atomic_load_n(&h->bucket[b], __ATOMIC_RELAXED);
+            if (value == 0) continue;
+            cumulative += value;
+            n = metricsPrint(buffer, n, size, METRICS_PREFIX "%s_bucket{le=\"%g\"} %llu\n",
+                             name, metricsBucketTop(b)/1e6, cumulative);
+        }
+        cumulative += __atomic_load_n(&h->overflow, __ATOMIC_RELAXED);
+        double sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED)/1e6;
+        n = metricsPrint(buffer, n, size, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n",
+                         name, cumulative);
+        n = metricsPrint(buffer, n, size, METRICS_PREFIX "%s_sum %g\n", name, sum);
+        n = metricsPrint(buffer, n, size, METRICS_PREFIX "%s_count %llu\n", name, cumulative);
+    }
+    if (n >= size) n = size-1;
+    return n;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Open the local port serving the metrics
+
+@returns    listening socket, or -1 if it could not be opened.
+*/
+int metricsStart(void)
+{
+    struct addrinfo hints, *ai, *p;
+    int yes = 1;
+    int listener = -1;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+/* Only served locally */
+    if (getaddrinfo("localhost", METRICS_PORT, &hints, &ai) != 0) return -1;
+    for (p = ai; p != NULL; p = p->ai_next)
+    {
+        listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (listener < 0) continue;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+        if ((bind(listener, p->ai_addr, p->ai_addrlen) == 0) &&
+            (listen(listener, 4) == 0)) break;
+        close(listener);
+        listener = -1;
+    }
+    freeaddrinfo(ai);
+    if (listener < 0) syslog(LOG_INFO, "Metrics port could not be opened\n");
+    return listener;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Answer a request on the metrics port
+
+Whatever the request, the metrics are sent back as an HTTP response and the
+connection closed.
+
+@parameter  int listener: metrics listening socket, ready to accept.
+*/
+void metricsServe(const int listener)
+{
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) return;
+    char request[512];
+    recv(fd, request, sizeof(request), MSG_DONTWAIT);
+    char *body = (char *)malloc(METRICS_BUFFER);
+    if (body != NULL)
+    {
+        int length = metricsRender(body, METRICS_BUFFER);
+        char header[128];
+        int headerLength = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %d\r\n\r\n", length);
+        send(fd, header, headerLength, MSG_NOSIGNAL);
+        send(fd, body, length, MSG_NOSIGNAL);
+        free(body);
+    }
+    close(fd);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Histogram bucket holding a value
+
+@parameter  uint64_t value: value in microseconds.
+@returns    bucket index, or -1 if the value is beyond the last bucket.
+*/
+static int metricsBucket(const uint64_t value)
+{
+    if (value < (1 << METRICS_SUB_BITS)) return value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent >= METRICS_MAX_BITS) return -1;
+    int sub = (value >> (exponent - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS)-1);
+    return ((exponent - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + sub;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Largest value held in a histogram bucket
+
+@parameter  int bucket: bucket index.
+@returns    value in microseconds.
+*/
+static uint64_t metricsBucketTop(const int bucket)
+{
+    if (bucket < (1 << METRICS_SUB_BITS)) return bucket;
+    int exponent = (bucket >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+    int sub = bucket & ((1 << METRICS_SUB_BITS)-1);
+    return ((uint64_t)((1 << METRICS_SUB_BITS) + sub + 1) << (exponent - METRICS_SUB_BITS)) - 1;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Add formatted text to the metrics being rendered
+
+@parameter  char *buffer: text rendered so far.
+@parameter  int length: length of the text so far.
+@parameter  int size: size of the buffer.
+@returns    new length of the text, at least size if the buffer is full.
+*/
+static int metricsPrint(char *buffer, const int length, const int size,
+                        const char *format, ...)
+{
+    if (length >= size) return length;
+    va_list args;
+    va_start(args, format);
+    int added = vsnprintf(buffer+length, size-length, format, args);
+    va_end(args);
+    return length + added;
+}
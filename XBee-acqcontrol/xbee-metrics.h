@@ -0,0 +1,92 @@
+/*
+Title:    XBee Acquisition Control process metrics
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef XBEE_METRICS_H
+#define XBEE_METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_PORT          "58533"   // Local port serving the metrics
+#define METRICS_BUFFER          32768   // Longest metrics text
+#define METRICS_PREFIX    "xbee_acqcontrol_"
+#define METRICS_PART              250   // Text in each reply to a client
+// Latency histograms are in microseconds. Each power of two is split into
+// 2^METRICS_SUB_BITS buckets, so a value is resolved to within 25%, up to
+// 2^METRICS_MAX_BITS (about 2 minutes). Larger values are only in +Inf.
+#define METRICS_SUB_BITS            2
+#define METRICS_MAX_BITS           27
+#define METRICS_BUCKETS    ((METRICS_MAX_BITS-METRICS_SUB_BITS+1) << METRICS_SUB_BITS)
+#define METRICS_ERRORS              4   // DataError values
+
+/* Event counters */
+enum MetricCounter
+{
+    metricAckSent = 0,
+    metricNakSent = 1,
+    metricAckQueueFull = 2,
+    metricClientCommands = 3,
+    metricFileFlushes = 4
+};
+#define METRIC_COUNTERS             5
+
+/* Gauges */
+enum MetricGauge
+{
+    metricTxQueueAck = 0,   // Frames waiting in each class, as TxPriority
+    metricTxQueueCommand = 1,
+    metricTxQueueBulk = 2
+};
+#define METRIC_GAUGES               3
+
+/* Latency histograms */
+enum MetricHistogram
+{
+    metricAckLatency = 0,   // Frame received to its ACK or NAK sent
+    metricRxCallback = 1,   // Time spent handling a received frame
+    metricFileFlush = 2,    // Flushing the data file to disk
+    metricClientCommand = 3 // Handling a client command
+};
+#define METRIC_HISTOGRAMS           4
+
+/* A latency histogram */
+
+typedef struct {
+    uint64_t bucket[METRICS_BUCKETS];
+    uint64_t overflow;      // Values beyond the last bucket
+    uint64_t count;
+    uint64_t sum;           // Microseconds
+} metricsHistogram;
+
+//-----------------------------------------------------------------------------
+/* Prototypes */
+
+uint64_t metricsTime(void);
+void metricsFrame(const unsigned char type);
+void metricsDecodeError(const int error);
+void metricsCount(const MetricCounter which);
+void metricsGauge(const MetricGauge which, const int64_t value);
+void metricsLatency(const MetricHistogram which, const uint64_t start);
+int metricsRender(char *buffer, const int size);
+int metricsStart(void);
+void metricsServe(const int listener);
+
+#endif
@@ -0,0 +1,203 @@
+/**
+@brief XBee Acquisition Control signal strength sampling
+
+The signal strength of a received frame is only given in the frame itself by
+some XBee types. Otherwise the coordinator must be asked with the DB local AT
+command, which returns the strength of the last frame it received, so the query
+has to follow the frame of interest closely.
+
+A query is sent after a data report has been acknowledged, on the command class
+of the transmit scheduler behind the ACK. Queries are rate limited, to one per
+node in RSSI_NODE_PERIOD and one overall in RSSI_GAP, and only one is in flight
+at a time. As libxbee does not give the frame ID of a frame sent, a DB response
+is matched to the query in flight. If a frame from another node arrives before
+the response the strength may be of that frame, so the sample is discarded.
+
+DB queries from clients are noted, and while one is waiting a DB response is
+passed on to the client as well as being taken for any query in flight, so the
+sampler never takes a response that a client asked for.
+
+The sample is kept for the health of the node and written to the data file with
+the time of the report it measured.
+
+Callbacks from libxbee run in different threads, so the state is protected by a
+mutex.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee.h"
+#include "xbee-acqcontrol.h"
+#include "xbee-tx-scheduler.h"
+#include "xbee-metrics.h"
+#include "xbee-rssi.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+extern char debug;
+
+/* Sampling state, protected by the mutex */
+static pthread_mutex_t rssiMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t rssiSampled[MAXNODES];  // Time of the last query to each node
+static int pendingRow = -1;         // Node of the query in flight, or -1
+static uint64_t pendingSent;        // Time the query was posted
+static time_t pendingMeasured;      // Time of the report being measured
+static bool pendingSpoiled;         // Another frame came in after the query
+static uint64_t lastQuery;          // Time of the last query to any node
+static int clientPending;           // DB queries from clients not answered
+static uint64_t clientSent;         // Time of the last DB query from a client
+
+/*--------------------------------------------------------------------------*/
+/** @brief Note a frame received from a node
+
+A frame from another node spoils the query in flight.
+
+@parameter  int row: node table row.
+*/
+void rssiFrame(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&rssiMutex);
+    if ((pendingRow >= 0) && (pendingRow != row)) pendingSpoiled = true;
+    pthread_mutex_unlock(&rssiMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Query the signal strength of the frame just received from a node
+
+Called after a data report has been acknowledged. Nothing is sent if the node
+was sampled recently, another query was sent recently or is still in flight.
+A query that has had no response in RSSI_TIMEOUT is given up.
+
+@parameter  struct xbee_con *con: local AT connection.
+@parameter  int row: node table row.
+@parameter  time_t measured: time of the report.
+@returns    true if a query was posted.
+*/
+bool rssiSample(struct xbee_con *con, const int row, const time_t measured)
+{
+    if ((con == NULL) || (row < 0) || (row >= MAXNODES)) return false;
+    uint64_t now = metricsTime()/1000;
+    pthread_mutex_lock(&rssiMutex);
+    if ((pendingRow >= 0) && (now - pendingSent > RSSI_TIMEOUT))
+    {
+#ifdef DEBUG
+        if (debug > 1) printf("RSSI query to row %d timed out\n", pendingRow);
+#endif
+        pendingRow = -1;
+    }
+    bool post = (pendingRow < 0) &&
+                ((lastQuery == 0) || (now - lastQuery >= RSSI_GAP)) &&
+                ((rssiSampled[row] == 0) ||
+                 (now - rssiSampled[row] >= RSSI_NODE_PERIOD));
+    if (post)
+    {
+        post = txPost(con, -1, (const unsigned char *)"DB", 2, txCommand);
+/* A query that could not be queued waits for the next report of the node. */
+        if (post)
+        {
+            pendingRow = row;
+            pendingSent = now;
+            pendingMeasured = measured;
+            pendingSpoiled = false;
+            lastQuery = now;
+            rssiSampled[row] = now;
+        }
+    }
+    pthread_mutex_unlock(&rssiMutex);
+    return post;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Note a DB query sent by a client
+
+Its response is then passed on to the client.
+*/
+void rssiClientQuery(void)
+{
+    pthread_mutex_lock(&rssiMutex);
+    clientPending++;
+    clientSent = metricsTime()/1000;
+    pthread_mutex_unlock(&rssiMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Take a DB response for the query in flight
+
+A response is only kept from the client if no DB query from a client is
+waiting. One that has had no response in RSSI_TIMEOUT is forgotten.
+
+@parameter  unsigned char *atCommand: two character AT command.
+@parameter  unsigned char status: AT command status, zero if OK.
+@parameter  unsigned char *data: response data.
+@parameter  int length: length of the response data.
+@parameter  int *row: node table row sampled, or -1 if there is no usable sample.
+@parameter  uint8_t *value: signal strength in -dBm.
+@parameter  time_t *measured: time of the report measured.
+@returns    true if the response is for the sampler only and is not to be passed
+            on to clients.
+*/
+bool rssiResponse(const unsigned char *atCommand, const unsigned char status,
+                  const unsigned char *data, const int length,
+                  int *row, uint8_t *value, time_t *measured)
+{
+    *row = -1;
+    if ((atCommand[0] != 'D') || (atCommand[1] != 'B')) return false;
+    uint64_t now = metricsTime()/1000;
+    pthread_mutex_lock(&rssiMutex);
+    bool client = (clientPending > 0) && (now - clientSent <= RSSI_TIMEOUT);
+    clientPending = client ? clientPending-1 : 0;
+    bool sampler = (pendingRow >= 0) && (now - pendingSent <= RSSI_TIMEOUT);
+    if (sampler && (status == 0) && (length > 0) && (data[length-1] > 0) &&
+        ! pendingSpoiled)
+    {
+        *row = pendingRow;
+        *value = data[length-1];
+        *measured = pendingMeasured;
+    }
+#ifdef DEBUG
+    if ((debug > 1) && sampler) printf("RSSI row %d %s -%d dBm%s\n", pendingRow,
+                       (*row < 0) ? "discarded" : "sampled",
+                       (length > 0) ? data[length-1] : 0,
+                       client ? " also for client" : "");
+#endif
+    pendingRow = -1;
+    pthread_mutex_unlock(&rssiMutex);
+    return sampler && ! client;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Remove the state of a node deleted from the node table
+
+The state of the rows following is moved down with the table, along with the
+query in flight.
+
+@parameter  int row: node table row being deleted.
+*/
+void rssiNodeRemove(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&rssiMutex);
+    for (int i = row; i < MAXNODES-1; i++) rssiSampled[i] = rssiSampled[i+1];
+    rssiSampled[MAXNODES-1] = 0;
+    if (pendingRow == row) pendingSpoiled = true;
+    else if (pendingRow > row) pendingRow--;
+    pthread_mutex_unlock(&rssiMutex);
+}
@@ -0,0 +1,47 @@
+/*
+Title:    XBee Acquisition Control signal strength sampling
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef XBEE_RSSI_H
+#define XBEE_RSSI_H
+
+#include "xbee.h"
+#include "xbee-acqcontrol.h"
+#include <stdint.h>
+#include <time.h>
+
+// Rate limits. Times are in milliseconds.
+#define RSSI_NODE_PERIOD       300000   // Between samples of one node
+#define RSSI_GAP                 1000   // Between any two queries
+#define RSSI_TIMEOUT             2000   // Wait for the response to a query
+
+//-----------------------------------------------------------------------------
+/* Prototypes */
+
+void rssiFrame(const int row);
+bool rssiSample(struct xbee_con *con, const int row, const time_t measured);
+void rssiClientQuery(void);
+bool rssiResponse(const unsigned char *atCommand, const unsigned char status,
+                  const unsigned char *data, const int length,
+                  int *row, uint8_t *value, time_t *measured);
+void rssiNodeRemove(const int row);
+
+#endif
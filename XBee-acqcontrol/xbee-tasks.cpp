@@ -0,0 +1,219 @@
+/**
+@brief XBee Acquisition Control periodic task scheduler
+
+Background work such as advancing the liveness wheel and flushing the data file
+runs as tasks in the main loop, alongside the command interface, rather than in
+threads of its own or in libxbee callbacks. A task runs once after a delay or
+repeatedly at a period.
+
+A single timerfd is armed for the earliest task due and is watched by the
+select() of the main loop. When it fires, every task due within TASK_COALESCE
+is run, so that tasks due close together share one wakeup. A periodic task is
+kept to its own schedule; if the loop falls so far behind that a run was missed
+each period lost is counted as late and the task goes on from the current time.
+
+The time spent in each task is accounted so that slow tasks, which hold up the
+command interface, can be found.
+
+Tasks may be added from callback threads, so the table is protected by a mutex.
+It is not held while a task runs, so a task may add or cancel tasks.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee-tasks.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/timerfd.h>
+
+extern char debug;
+
+/* Task table, protected by the mutex */
+static pthread_mutex_t taskMutex = PTHREAD_MUTEX_INITIALIZER;
+static taskEntry task[TASK_MAX];
+static int timerFd = -1;
+
+/* Local Prototypes */
+static void taskArm(void);
+static uint64_t taskTime(void);
+
+/*--------------------------------------------------------------------------*/
+/** @brief Create the timer that drives the tasks
+
+The timer is to be added to the descriptors watched by the main loop, and
+taskRun() called when it is ready.
+
+@returns    timer file descriptor, or -1 if it could not be created.
+*/
+int taskStart(void)
+{
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd < 0) syslog(LOG_INFO, "Task timer could not be created\n");
+    return timerFd;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Add a task
+
+@parameter  char *name: name for the accounting, cut to TASK_NAME-1 characters.
+@parameter  taskFunction function: work to be done.
+@parameter  void *arg: argument passed to the function.
+@parameter  uint32_t delay: time in ms until the first run.
+@parameter  uint32_t period: time in ms between runs, or zero to run once.
+@returns    task identifier, or -1 if the table is full.
+*/
+int taskAdd(const char *name, taskFunction function, void *arg,
+            const uint32_t delay, const uint32_t period)
+{
+    if (function == NULL) return -1;
+    pthread_mutex_lock(&taskMutex);
+    int id;
+    for (id = 0; id < TASK_MAX; id++) if (! task[id].active) break;
+    if (id < TASK_MAX)
+    {
+        memset(&task[id], 0, sizeof(taskEntry));
+        task[id].active = true;
+        strncpy(task[id].name, name, TASK_NAME-1);
+        task[id].function = function;
+        task[id].arg = arg;
+        task[id].due = taskTime() + delay;
+        task[id].period = period;
+        taskArm();
+    }
+    else id = -1;
+    pthread_mutex_unlock(&taskMutex);
+    return id;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Cancel a task
+
+@parameter  int id: task identifier.
+@returns    false if there is no such task.
+*/
+bool taskCancel(const int id)
+{
+    if ((id < 0) || (id >= TASK_MAX)) return false;
+    pthread_mutex_lock(&taskMutex);
+    bool ok = task[id].active;
+    task[id].active = false;
+    taskArm();
+    pthread_mutex_unlock(&taskMutex);
+    return ok;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Run the tasks that are due
+
+Called from the main loop when the timer is ready. Each task due is run once
+with the mutex released, its time accounted, then its next run set. A one-shot
+task is removed before it runs.
+*/
+void taskRun(void)
+{
+    uint64_t expirations;
+    if (read(timerFd, &expirations, sizeof(expirations)) < 0) expirations = 0;
+    pthread_mutex_lock(&taskMutex);
+    uint64_t now = taskTime();
+    for (int id = 0; id < TASK_MAX; id++)
+    {
+        if (! task[id].active || (task[id].due > now + TASK_COALESCE)) continue;
+        taskFunction function = task[id].function;
+        void *arg = task[id].arg;
+        if (task[id].period == 0) task[id].active = false;
+        pthread_mutex_unlock(&taskMutex);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        function(arg);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        pthread_mutex_lock(&taskMutex);
+        uint32_t elapsed = (end.tv_sec - start.tv_sec)*1000000 +
+                           (end.tv_nsec - start.tv_nsec)/1000;
+        task[id].runs++;
+        task[id].runtime += elapsed;
+        if (elapsed > task[id].longest) task[id].longest = elapsed;
+#ifdef DEBUG
+        if (debug > 1) printf("Task %s ran in %u us\n", task[id].name, elapsed);
+#endif
+/* Keep a periodic task to its schedule unless a whole period has been lost, in
+which case every period lost is counted, from the next run due up to now. */
+        if (task[id].active && (task[id].period > 0))
+        {
+            task[id].due += task[id].period;
+            if (task[id].due + task[id].period <= now)
+            {
+                task[id].late += (now - task[id].due)/task[id].period + 1;
+                task[id].due = now + task[id].period;
+            }
+        }
+    }
+    taskArm();
+    pthread_mutex_unlock(&taskMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Return a copy of a task and its accounting
+
+@parameter  int id: task identifier.
+@parameter  taskEntry *entry: copy of the task.
+@returns    false if there is no such task.
+*/
+bool taskInfo(const int id, taskEntry *entry)
+{
+    if ((id < 0) || (id >= TASK_MAX)) return false;
+    pthread_mutex_lock(&taskMutex);
+    *entry = task[id];
+    pthread_mutex_unlock(&taskMutex);
+    return entry->active;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Set the timer for the earliest task due, or stop it if none
+
+The mutex must be held.
+*/
+static void taskArm(void)
+{
+    if (timerFd < 0) return;
+    uint64_t due = 0;
+    for (int id = 0; id < TASK_MAX; id++)
+        if (task[id].active && ((due == 0) || (task[id].due < due)))
+            due = task[id].due;
+/* A time already passed is set a little ahead, as zero would stop the timer. */
+    if ((due > 0) && (due <= taskTime())) due = taskTime() + 1;
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = due/1000;
+    timer.it_value.tv_nsec = (due % 1000)*1000000;
+    timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Monotonic time in milliseconds
+*/
+static uint64_t taskTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
@@ -0,0 +1,63 @@
+/*
+Title:    XBee Acquisition Control periodic task scheduler
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef XBEE_TASKS_H
+#define XBEE_TASKS_H
+
+#include <stdint.h>
+
+#define TASK_MAX                   16   // Tasks held at once
+#define TASK_NAME                  12   // Longest task name with terminator
+// Times are in milliseconds.
+#define TASK_COALESCE              50   // Tasks due this soon run with one due now
+#define TASK_FLUSH_PERIOD       60000   // Flush the data file to disk
+
+/* Work done by a task, given the argument it was added with. */
+
+typedef void (*taskFunction)(void *arg);
+
+/* A task and its runtime accounting */
+
+typedef struct {
+    bool active;
+    char name[TASK_NAME];
+    taskFunction function;
+    void *arg;
+    uint64_t due;           // Monotonic time of the next run
+    uint32_t period;        // Time between runs, or zero to run once
+    uint32_t runs;          // Times run
+    uint32_t late;          // Periods skipped as the loop fell behind
+    uint64_t runtime;       // Total time spent running, in microseconds
+    uint32_t longest;       // Longest single run, in microseconds
+} taskEntry;
+
+//-----------------------------------------------------------------------------
+/* Prototypes */
+
+int taskStart(void);
+int taskAdd(const char *name, taskFunction function, void *arg,
+            const uint32_t delay, const uint32_t period);
+bool taskCancel(const int id);
+void taskRun(void);
+bool taskInfo(const int id, taskEntry *entry);
+
+#endif
@@ -0,0 +1,289 @@
+/**
+@brief XBee Acquisition Control transmit scheduler
+
+All frames to the nodes and the local XBee pass through here, so that a burst of
+configuration or firmware traffic cannot hold up the ACK that a node is waiting
+for. Frames are queued in strict priority classes: protocol ACKs, then AT
+commands and strings to the node MCU, then bulk data such as firmware records.
+Within a class frames go in the order queued.
+
+A send may block in libxbee for seconds, for example a remote AT command to a
+sleeping node, so ACKs are sent by a thread of their own and never wait behind
+a lower class frame already in flight. A second thread sends the other classes,
+and does not start a frame while an ACK is waiting.
+
+Frames are spaced by TX_GLOBAL_GAP, and frames other than ACKs to the same node
+by TX_NODE_GAP. A frame to a node held back by this does not hold up frames to
+other nodes. Each frame has a deadline from its class, and a frame still waiting
+after its deadline is dropped as the node will no longer be listening for it.
+
+Senders may queue a frame and carry on, or wait for the result of the send.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee.h"
+#include "xbee-acqcontrol.h"
+#include "xbee-tx-scheduler.h"
+#include "xbee-metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+
+extern char debug;
+
+/* Queues, protected by the mutex */
+static pthread_mutex_t txMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t txWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t txDone = PTHREAD_COND_INITIALIZER;
+static txFrame txQueue[TX_PRIORITIES][TX_QUEUE_SIZE];
+static int txCount[TX_PRIORITIES];
+static uint64_t txLastSend;
+static uint64_t txNodeLastSend[MAXNODES];
+static const int txDeadline[TX_PRIORITIES] =
+    {TX_ACK_DEADLINE, TX_COMMAND_DEADLINE, TX_BULK_DEADLINE};
+
+/* Local Prototypes */
+static void *txScheduler(void *arg);
+static bool txQueueFrame(struct xbee_con *con, const int row,
+                         const unsigned char *data, const int length,
+                         const TxPriority priority, txWaiter *waiter,
+                         const uint64_t received);
+static void txRemove(const int priority, const int index, const xbee_err result);
+static uint64_t txTime(void);
+
+/*--------------------------------------------------------------------------*/
+/** @brief Start the transmit scheduler threads
+
+One thread sends the ACK class and the other the remaining classes.
+
+@returns    true if the threads were started.
+*/
+bool txSchedulerStart(void)
+{
+    bool ok = true;
+    for (intptr_t first = txAck; ok && (first <= txCommand); first++)
+    {
+        pthread_t thread;
+        ok = (pthread_create(&thread, NULL, txScheduler, (void *)first) == 0);
+        if (ok) pthread_detach(thread);
+    }
+    if (! ok) syslog(LOG_INFO, "Transmit scheduler could not be started\n");
+    return ok;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Queue a frame and carry on
+
+@parameter  xbee_con *con: libxbee connection to send on.
+@parameter  int row: node table row for pacing, or -1 if not a node.
+@parameter  unsigned char *data: frame data.
+@parameter  int length: length of the data.
+@parameter  TxPriority priority: class of the frame.
+@parameter  uint64_t received: time from metricsTime() that the frame being
+            answered arrived, for the ACK latency, or zero.
+@returns    false if the frame could not be queued.
+*/
+bool txPost(struct xbee_con *con, const int row, const unsigned char *data,
+            const int length, const TxPriority priority, const uint64_t received)
+{
+    pthread_mutex_lock(&txMutex);
+    bool ok = txQueueFrame(con, row, data, length, priority, NULL, received);
+    pthread_mutex_unlock(&txMutex);
+    return ok;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Queue a frame and wait until it has been sent or dropped
+
+@parameter  xbee_con *con: libxbee connection to send on.
+@parameter  int row: node table row for pacing, or -1 if not a node.
+@parameter  unsigned char *data: frame data.
+@parameter  int length: length of the data.
+@parameter  TxPriority priority: class of the frame.
+@returns    libxbee error from the send, XBEE_ETIMEOUT if the deadline passed
+            or XBEE_ENOMEM if the queue was full.
+*/
+xbee_err txSend(struct xbee_con *con, const int row, const unsigned char *data,
+                const int length, const TxPriority priority)
+{
+    txWaiter waiter;
+    waiter.done = false;
+    waiter.result = XBEE_ENOMEM;
+    pthread_mutex_lock(&txMutex);
+    if (txQueueFrame(con, row, data, length, priority, &waiter, 0))
+        while (! waiter.done) pthread_cond_wait(&txDone, &txMutex);
+    pthread_mutex_unlock(&txMutex);
+    return waiter.result;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Transmit scheduler thread
+
+Frames past their deadline are dropped, then the first frame of the highest
+class that is not held back by pacing is sent. The mutex is released while the
+frame is with libxbee so that more frames can be queued.
+
+@parameter  void *arg: the highest class sent by the thread. The ACK thread
+            sends only that class, the other all classes below it.
+*/
+static void *txScheduler(void *arg)
+{
+    const int first = (intptr_t)arg;
+    const int last = (first == txAck) ? txAck : TX_PRIORITIES-1;
+    pthread_mutex_lock(&txMutex);
+    for (;;)
+    {
+        uint64_t now = txTime();
+        bool waiting = false;
+        for (int priority = first; priority <= last; priority++)
+        {
+            for (int i = 0; i < txCount[priority];)
+            {
+                if (now > txQueue[priority][i].deadline)
+                {
+#ifdef DEBUG
+                    if (debug) printf("Transmit class %d row %d dropped at deadline\n",
+                                      priority, txQueue[priority][i].row);
+#endif
+                    txRemove(priority, i, XBEE_ETIMEOUT);
+                }
+                else i++;
+            }
+            if (txCount[priority] > 0) waiting = true;
+        }
+        if (! waiting)
+        {
+            pthread_cond_wait(&txWork, &txMutex);
+            continue;
+        }
+/* Find the next frame to send, unless the last was too recent or an ACK is
+waiting to go ahead */
+        int priority = first;
+        int index = -1;
+        if ((now - txLastSend >= TX_GLOBAL_GAP) &&
+            ((first == txAck) || (txCount[txAck] == 0)))
+        {
+            for (int p = first; (p <= last) && (index < 0); p++)
+            {
+                for (int i = 0; i < txCount[p]; i++)
+                {
+                    int row = txQueue[p][i].row;
+                    if ((p != txAck) && (row >= 0) && (row < MAXNODES) &&
+                        (now - txNodeLastSend[row] < TX_NODE_GAP)) continue;
+                    priority = p;
+                    index = i;
+                    break;
+                }
+            }
+        }
+        if (index < 0)
+        {
+            pthread_mutex_unlock(&txMutex);
+            usleep(TX_TICK*1000);
+            pthread_mutex_lock(&txMutex);
+            continue;
+        }
+        txFrame frame = txQueue[priority][index];
+        memmove(&txQueue[priority][index], &txQueue[priority][index+1],
+                (txCount[priority]-index-1)*sizeof(txFrame));
+        txCount[priority]--;
+        metricsGauge((MetricGauge)priority, txCount[priority]);
+        pthread_mutex_unlock(&txMutex);
+        xbee_err result = xbee_connTx(frame.con, NULL, frame.data, frame.length);
+        if (frame.received > 0) metricsLatency(metricAckLatency, frame.received);
+        pthread_mutex_lock(&txMutex);
+        txLastSend = txTime();
+        if ((frame.row >= 0) && (frame.row < MAXNODES))
+            txNodeLastSend[frame.row] = txLastSend;
+        if (frame.waiter != NULL)
+        {
+            frame.waiter->result = result;
+            frame.waiter->done = true;
+            pthread_cond_broadcast(&txDone);
+        }
+    }
+    return NULL;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Add a frame to the queue of its class
+
+The mutex must be held.
+
+@returns    false if the frame is invalid or the queue is full.
+*/
+static bool txQueueFrame(struct xbee_con *con, const int row,
+                         const unsigned char *data, const int length,
+                         const TxPriority priority, txWaiter *waiter,
+                         const uint64_t received)
+{
+    if ((con == NULL) || (length < 0) || (length > TX_LENGTH)) return false;
+    if (txCount[priority] >= TX_QUEUE_SIZE)
+    {
+#ifdef DEBUG
+        if (debug) printf("Transmit class %d queue full\n", priority);
+#endif
+        return false;
+    }
+    txFrame *frame = &txQueue[priority][txCount[priority]++];
+    frame->con = con;
+    frame->row = row;
+    frame->deadline = txTime() + txDeadline[priority];
+    frame->waiter = waiter;
+    frame->received = received;
+    frame->length = length;
+    memcpy(frame->data, data, length);
+    metricsGauge((MetricGauge)priority, txCount[priority]);
+    pthread_cond_broadcast(&txWork);
+    return true;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Remove a frame without sending it
+
+Any sender waiting on it is given the result. The mutex must be held.
+*/
+static void txRemove(const int priority, const int index, const xbee_err result)
+{
+    txWaiter *waiter = txQueue[priority][index].waiter;
+    if (waiter != NULL)
+    {
+        waiter->result = result;
+        waiter->done = true;
+        pthread_cond_broadcast(&txDone);
+    }
+    txCount[priority]--;
+    memmove(&txQueue[priority][index], &txQueue[priority][index+1],
+            (txCount[priority]-index)*sizeof(txFrame));
+    metricsGauge((MetricGauge)priority, txCount[priority]);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Monotonic time in milliseconds
+*/
+static uint64_t txTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
@@ -0,0 +1,79 @@
+/*
+Title:    XBee Acquisition Control transmit scheduler
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef XBEE_TX_SCHEDULER_H
+#define XBEE_TX_SCHEDULER_H
+
+#include "xbee-acqcontrol.h"
+#include <stdint.h>
+
+// Queue limits
+#define TX_QUEUE_SIZE              32   // Frames waiting in each class
+#define TX_LENGTH                 100   // Longest frame data
+// Pacing and deadlines. Times are in milliseconds.
+#define TX_GLOBAL_GAP               5   // Between any two frames
+#define TX_NODE_GAP                20   // Between frames to one node, except ACKs
+#define TX_ACK_DEADLINE          1500   // Node waits 2000ms for its ACK
+#define TX_COMMAND_DEADLINE      5000
+#define TX_BULK_DEADLINE        10000
+#define TX_TICK                     1   // Wait while frames are held by pacing
+
+/* Priority classes, highest first. A frame is only sent when no frame of a
+higher class is ready. */
+enum TxPriority
+{
+    txAck = 0,              // Protocol ACK and NAK to a data report
+    txCommand = 1,          // AT commands and strings to a node MCU
+    txBulk = 2              // Firmware records and other bulk data
+};
+#define TX_PRIORITIES               3
+
+/* Result of a frame for a sender waiting on it */
+
+typedef struct {
+    bool done;
+    xbee_err result;
+} txWaiter;
+
+/* A frame waiting to be sent */
+
+typedef struct {
+    struct xbee_con *con;
+    int row;                // Node table row for pacing, or -1
+    uint64_t deadline;      // Dropped if not sent by this time
+    txWaiter *waiter;       // Sender waiting for the result, if any
+    uint64_t received;      // Time in us the frame answered arrived, or zero
+    int length;
+    unsigned char data[TX_LENGTH];
+} txFrame;
+
+//-----------------------------------------------------------------------------
+/* Prototypes */
+
+bool txSchedulerStart(void);
+bool txPost(struct xbee_con *con, const int row, const unsigned char *data,
+            const int length, const TxPriority priority,
+            const uint64_t received = 0);
+xbee_err txSend(struct xbee_con *con, const int row, const unsigned char *data,
+                const int length, const TxPriority priority);
+
+#endif
@@ -0,0 +1,262 @@
+/**
+@brief XBee Acquisition Control adaptive wake interval controller
+
+The wake interval of each node under control is set from its recent activity.
+A meter that is counting reports often enough that each report carries about
+WAKE_TARGET_COUNT counts, and an idle meter stretches out to its longest
+interval. The interval is doubled when the battery reading is low and when many
+reports across the network need retries, which is taken as a sign of a
+congested channel. The intervals of all controlled nodes are also stretched
+together if their reports would exceed WAKE_BUDGET per minute.
+
+A new interval is only sent when it differs enough from the last one, and goes
+to the node as an option in the ACK to its report.
+
+Nodes started together, as after a power failure, would all report in the same
+few seconds. Each node is given a slot within its interval, spread evenly by its
+row in the node table, and is moved to it by loading its WDT counter through an
+option in the ACK. The interval is that set by the controller, or otherwise that
+seen between the last reports when it is the same twice running. As the WDT
+timing drifts, a node is moved again when it strays from its slot.
+
+Callbacks from libxbee and client commands run in different threads, so the
+controller state is protected by a mutex.
+*/
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#include "xbee.h"
+#include "xbee-acqcontrol.h"
+#include "xbee-wake-control.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+extern char debug;
+
+/* Controller state, protected by the mutex */
+static pthread_mutex_t wakeControlMutex = PTHREAD_MUTEX_INITIALIZER;
+static wakeControlNode wakeNode[MAXNODES];
+static int congestion;          // Filtered percentage of retried reports, fixed point
+
+/* Local Prototypes */
+static void wakeControlSend(const int row, const uint16_t interval);
+static uint32_t wakeControlLoad(const int row, const uint32_t interval);
+
+/*--------------------------------------------------------------------------*/
+/** @brief Put a node under control or release it
+
+A node put under control is sent the shortest interval with its next ACK, so
+that the interval it runs at is known.
+
+@parameter  int row: node table row.
+@parameter  bool enabled: control the wake interval of the node.
+@parameter  uint16_t minimum: shortest interval in ticks, zero for the default.
+@parameter  uint16_t maximum: longest interval in ticks, zero for the default.
+@returns    false if the row or bounds are invalid.
+*/
+bool wakeControlSet(const int row, const bool enabled, const uint16_t minimum,
+                    const uint16_t maximum)
+{
+    if ((row < 0) || (row >= numberNodes)) return false;
+    uint16_t low = (minimum > 0) ? minimum : WAKE_MINIMUM;
+    uint16_t high = (maximum > 0) ? maximum : WAKE_MAXIMUM;
+    if (low > high) return false;
+    pthread_mutex_lock(&wakeControlMutex);
+    wakeControlNode *node = &wakeNode[row];
+    node->minimum = low;
+    node->maximum = high;
+    if (enabled && ! node->enabled)
+    {
+        node->rate = 0;
+        node->rateValid = false;
+        wakeControlSend(row, low);
+    }
+    node->enabled = enabled;
+    pthread_mutex_unlock(&wakeControlMutex);
+    return true;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Return the interval last set for a node
+
+@parameter  int row: node table row.
+@returns    interval in ticks, or zero if the node is not under control.
+*/
+uint16_t wakeControlInterval(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return 0;
+    pthread_mutex_lock(&wakeControlMutex);
+    uint16_t interval = wakeNode[row].enabled ? wakeNode[row].interval : 0;
+    pthread_mutex_unlock(&wakeControlMutex);
+    return interval;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Adjust the interval of a node from a data report
+
+Every report is counted towards the congestion estimate. For a node under
+control the count rate is filtered from first attempts and a new interval worked
+out, which is sent if it differs enough from the last.
+
+@parameter  int row: node table row.
+@parameter  char command: report command, 'C' for a first attempt.
+@parameter  unsigned long int dataField: count, battery voltage and parameter.
+*/
+void wakeControlReport(const int row, const char command,
+                       const unsigned long int dataField)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    uint32_t count = dataField & 0xFFFF;
+    uint16_t battery = (dataField >> 16) & 0x3FF;
+    bool retry = (command != 'C') || ((dataField >> 26) > 0);
+    pthread_mutex_lock(&wakeControlMutex);
+    congestion += (((retry ? 100 : 0) << WAKE_RATE_SHIFT) - congestion) >> WAKE_FILTER;
+    wakeControlNode *node = &wakeNode[row];
+    if (! node->enabled)
+    {
+        pthread_mutex_unlock(&wakeControlMutex);
+        return;
+    }
+/* Counts per tick over the interval that has just ended. A retry carries the
+same count again so is not sampled. */
+    if (! retry)
+    {
+        uint32_t sample = (count << WAKE_RATE_SHIFT) / node->interval;
+        if (! node->rateValid) node->rate = sample;
+        else node->rate += ((int32_t)sample - (int32_t)node->rate) >> WAKE_FILTER;
+        node->rateValid = true;
+    }
+    uint32_t interval = node->maximum;
+    if (node->rate > 0)
+        interval = ((uint32_t)WAKE_TARGET_COUNT << WAKE_RATE_SHIFT) / node->rate;
+    if ((battery > 0) && (battery < WAKE_BATTERY_LOW)) interval *= 2;
+    if (congestion > (WAKE_CONGESTION_HIGH << WAKE_RATE_SHIFT)) interval *= 2;
+    if (interval < node->minimum) interval = node->minimum;
+    uint32_t load = wakeControlLoad(row, interval);
+    if (load > WAKE_BUDGET*100) interval = interval*load/(WAKE_BUDGET*100);
+    if (interval < node->minimum) interval = node->minimum;
+    if (interval > node->maximum) interval = node->maximum;
+    uint32_t change = (interval > node->interval) ? interval - node->interval
+                                                  : node->interval - interval;
+    if (change*100 > (uint32_t)node->interval*WAKE_HYSTERESIS)
+        wakeControlSend(row, interval);
+    pthread_mutex_unlock(&wakeControlMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Move a node to its transmit slot
+
+The node has just reported at the end of its interval, so its WDT counter has
+just been cleared. Loading the counter with a value shortens the next interval
+by that many ticks, after which the node reports in its slot. This is worked out
+for every ACK so that a retry carries a current value.
+
+@parameter  int row: node table row.
+@parameter  char command: report command, 'C' for a first attempt.
+@parameter  time_t now: time the report arrived.
+*/
+void wakeControlPhase(const int row, const char command, const time_t now)
+{
+    if ((row < 0) || (row >= numberNodes)) return;
+    pthread_mutex_lock(&wakeControlMutex);
+    wakeControlNode *node = &wakeNode[row];
+/* Find the interval from the spacing of first attempts */
+    if (command == 'C')
+    {
+        if (node->lastReport > 0)
+        {
+            uint32_t gap = (now - node->lastReport + WAKE_TICK/2)/WAKE_TICK;
+            node->period = ((gap > 0) && (gap == node->gap)) ? gap : 0;
+            node->gap = gap;
+        }
+        node->lastReport = now;
+    }
+    uint32_t period = node->enabled ? node->interval : node->period;
+    nodeInfo[row].configFlags &= ~CONFIG_PHASE;
+    if (period > 1)
+    {
+        uint32_t phase = (now/WAKE_TICK) % period;
+        uint32_t slot = (row*period)/numberNodes;
+        uint32_t load = (phase + period - slot) % period;
+        uint32_t away = (load < period - load) ? load : period - load;
+        if (away > WAKE_PHASE_TOLERANCE)
+        {
+            nodeInfo[row].configPhase = load;
+            nodeInfo[row].configFlags |= CONFIG_PHASE;
+        }
+    }
+    pthread_mutex_unlock(&wakeControlMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Remove the state of a node deleted from the node table
+
+The state of the rows following is moved down with the table.
+
+@parameter  int row: node table row being deleted.
+*/
+void wakeControlNodeRemove(const int row)
+{
+    if ((row < 0) || (row >= MAXNODES)) return;
+    pthread_mutex_lock(&wakeControlMutex);
+    for (int i = row; i < MAXNODES-1; i++) wakeNode[i] = wakeNode[i+1];
+    memset(&wakeNode[MAXNODES-1], 0, sizeof(wakeControlNode));
+    pthread_mutex_unlock(&wakeControlMutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Set a new interval to go in the next ACK to a node
+
+The mutex must be held.
+
+@parameter  int row: node table row.
+@parameter  uint16_t interval: interval in ticks.
+*/
+static void wakeControlSend(const int row, const uint16_t interval)
+{
+#ifdef DEBUG
+    if (debug) printf("Wake control node %d interval %d ticks\n", row, interval);
+#endif
+    wakeNode[row].interval = interval;
+    nodeInfo[row].configWake = interval;
+    nodeInfo[row].configFlags |= CONFIG_WAKE;
+    nodeInfo[row].configSent &= ~CONFIG_WAKE;
+}
+
+/*--------------------------------------------------------------------------*/
+/** @brief Reports per minute from all controlled nodes
+
+The mutex must be held.
+
+@parameter  int row: node having its interval worked out.
+@parameter  uint32_t interval: interval proposed for that node.
+@returns    reports per minute times 100.
+*/
+static uint32_t wakeControlLoad(const int row, const uint32_t interval)
+{
+    uint32_t load = 0;
+    for (int i = 0; i < numberNodes; i++)
+    {
+        if (! wakeNode[i].enabled) continue;
+        uint32_t ticks = (i == row) ? interval : wakeNode[i].interval;
+        if (ticks > 0) load += 6000/(ticks*WAKE_TICK);
+    }
+    return load;
+}
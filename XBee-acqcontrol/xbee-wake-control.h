@@ -0,0 +1,76 @@
+/*
+Title:    XBee Acquisition Control adaptive wake interval controller
+*/
+
+/****************************************************************************
+ *   Copyright (C) 2013 by Ken Sarkies ksarkies@internode.on.net            *
+ *                                                                          *
+ *   This file is part of XBee-Acquisition                                  *
+ *                                                                          *
+ * Licensed under the Apache License, Version 2.0 (the "License");          *
+ * you may not use this file except in compliance with the License.         *
+ * You may obtain a copy of the License at                                  *
+ *                                                                          *
+ *     http://www.apache.org/licenses/LICENSE-2.0                           *
+ *                                                                          *
+ * Unless required by applicable law or agreed to in writing, software      *
+ * distributed under the License is distributed on an "AS IS" BASIS,        *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. *
+ * See the License for the specific language governing permissions and      *
+ * limitations under the License.                                           *
+ ***************************************************************************/
+
+#ifndef XBEE_WAKE_CONTROL_H
+#define XBEE_WAKE_CONTROL_H
+
+#include "xbee-acqcontrol.h"
+#include <stdint.h>
+#include <time.h>
+
+// Wake intervals are in node WDT ticks of WAKE_TICK seconds.
+#define WAKE_TICK                   8
+#define WAKE_MINIMUM                1   // Default shortest interval
+#define WAKE_MAXIMUM              450   // Default longest interval (1 hour)
+// Counts wanted in each report from an active meter
+#define WAKE_TARGET_COUNT          16
+// Raw battery reading below which the interval is doubled (3.4V)
+#define WAKE_BATTERY_LOW          708
+// Reports per minute over all controlled nodes before intervals are stretched
+#define WAKE_BUDGET                60
+// Part of reports needing a retry, in percent, before intervals are stretched
+#define WAKE_CONGESTION_HIGH       25
+// Smoothing of the count rate and congestion as a shift (1/8 new sample)
+#define WAKE_FILTER                 3
+// Fixed point fraction bits of the count rate
+#define WAKE_RATE_SHIFT             8
+// Part of the current interval, in percent, a new one must differ by to be sent
+#define WAKE_HYSTERESIS            25
+// Ticks a report may be away from its slot before the node is moved
+#define WAKE_PHASE_TOLERANCE        1
+
+/* Controller state for a node. */
+
+typedef struct {
+    bool enabled;
+    uint16_t minimum;       // Bounds on the interval set
+    uint16_t maximum;
+    uint16_t interval;      // Interval last set
+    uint32_t rate;          // Filtered counts per tick, fixed point
+    bool rateValid;
+    time_t lastReport;      // Time of the last first attempt report
+    uint16_t gap;           // Ticks between the last two reports
+    uint16_t period;        // Interval seen twice running, or zero
+} wakeControlNode;
+
+//-----------------------------------------------------------------------------
+/* Prototypes */
+
+bool wakeControlSet(const int row, const bool enabled, const uint16_t minimum,
+                    const uint16_t maximum);
+uint16_t wakeControlInterval(const int row);
+void wakeControlReport(const int row, const char command,
+                       const unsigned long int dataField);
+void wakeControlPhase(const int row, const char command, const time_t now);
+void wakeControlNodeRemove(const int row);
+
+#endif
@@ -61,6 +61,8 @@ Tested:   ATTiny4313 with 1MHz internal clock. ATTiny841 with 8MHz clock.
 #include <avr/sfr_defs.h>
 #include <avr/wdt.h>
 #include <avr/sleep.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
 
 #include "../libs/defines.h"
 #include "../libs/serial.h"
@@ -77,25 +79,71 @@ uint8_t rxOptions;
 static uint32_t counter;            /* Event Counter */
 static uint16_t wdtCounter;         /* Data Transmission Timer */
 static bool transmitMessage;        /* Permission to send a message */
+static volatile bool intervalEnd;   /* A wake interval has elapsed */
+static volatile uint16_t intervalCount; /* Counts in the current wake interval */
+static bool exceptionMode;          /* Report only on exception or heartbeat */
+static uint16_t deltaThreshold;     /* Unreported count forcing a report */
+static uint16_t rateThreshold;      /* Counts in an interval forcing a report */
+static uint8_t leakIntervals;       /* Intervals of continuous flow for a leak */
+static uint8_t heartbeatIntervals;  /* Intervals between heartbeat reports */
+static uint8_t flowIntervals;       /* Consecutive intervals with counts */
+static uint8_t quietIntervals;      /* Intervals since the last report */
+static bool deltaReported;          /* Delta threshold report already made */
+static volatile uint16_t pulseClock;/* Time in fine ticks for pulse timing */
+static uint16_t lastPulseTime;      /* pulseClock at the last count */
+static volatile bool pulseSeen;     /* A count occurred since last checked */
+static bool fineEnable;             /* Allow fine pulse timing */
+static volatile bool fineTiming;    /* WDT is running at the fine tick */
+static uint8_t fineTicks;           /* Fine ticks within a normal WDT tick */
+static volatile uint8_t histogram[HISTOGRAM_BINS];  /* Inter-pulse intervals */
+static uint8_t reportHistogram[HISTOGRAM_BINS];     /* Histogram being sent */
 static bool stayAwake;              /* Keep XBee awake until further notice */
 static uint16_t wakeInterval;       /* number of ticks between wakeups */
 static uint8_t wdtTick;             /* timer tick setting (see manual) */
+static bool associated;             /* XBee has joined the network */
+static volatile uint8_t wdtTicks;   /* Free running WDT tick count */
+static uint16_t batteryVoltage;     /* Last battery voltage reading */
+static uint8_t batteryDivisor;      /* Cycles between battery readings */
+static uint8_t batteryCycle;        /* Cycles since the last battery reading */
+static uint16_t batteryThreshold;   /* Reading below which to always sample */
+static uint32_t journalCount;       /* Count in the latest journal record */
+static uint16_t journalSequence;    /* Sequence number of the latest record */
+static uint8_t journalSlot;         /* EEPROM slot of the latest record */
+static uint32_t timeBase;           /* Time in seconds given by the base station */
+static uint16_t lfsr;               /* Pseudo-random state for retry jitter */
+static volatile uint32_t timeTicks; /* Fine ticks since the time was given */
+static transportWindow reportWindow;/* Reports in flight to the base station */
+static fragmentBuffer commandFragments; /* Command being reassembled */
+static uint16_t history[HISTORY_SIZE];  /* Counts in past wake intervals */
+static uint8_t historyNext;         /* Slot for the next interval in history */
+static uint8_t historyRequest;      /* Intervals of history asked for */
 
 /****************************************************************************/
 /* Local Prototypes */
 
 static packet_error interpretMessage(uint16_t timeoutDelay, bool wait, rxFrameType* inMessage);
-static void interpretCommand(rxFrameType* inMessage);
+static void interpretCommand(const uint8_t* data, const uint8_t length);
+static bool interpretAck(rxFrameType* inMessage);
+static uint16_t randomJitter(void);
 static packet_error getIncomingMessage(uint16_t timeoutDelay, bool wait, rxFrameType* inMessage);
 static void hardwareInit(void);
 static void wdtInit(const uint8_t waketime, bool wdeSet);
 static void sendDataCommand(const uint8_t command, const uint8_t parameter, const uint32_t datum);
+static bool sendReport(const uint8_t command, const uint32_t datum);
+static void fineTimingControl(void);
 static void sendMessage(const char* data);
+static void sendHistory(const uint8_t intervals);
 static void resetXBee(void);
 static void sleepXBee(void);
 static void wakeXBee(void);
+static void waitAssociation(const uint8_t ticks);
+static void idleSleep(void);
+static bool reportRequired(void);
 static void powerDown(void);
 static void powerUp(void);
+static uint32_t journalRestore(void);
+static void journalCheckpoint(const uint32_t count);
+static uint8_t journalCheck(const uint16_t sequence, const uint32_t count);
 static uint16_t stringToHex(const uint8_t length, const uint8_t* string);
 static void hexToString(const uint32_t value, char* string, const uint8_t length);
 
@@ -148,10 +196,32 @@ retries have passed without a positive response, an X response is returned.
 int main(void)
 {
 
-/* Initialise process counter */
-    counter = 0;
+/* Initialise process counter from any unacknowledged count left in EEPROM. */
+    counter = journalRestore();
+/* Start the report sequence numbers away from those used before a reset, so
+that the base station does not take a new report as one it has seen. */
+    transportInit(&reportWindow, (uint8_t)journalSequence);
+    fragmentInit(&commandFragments);
     wakeInterval = ACTION_COUNT;
     wdtTick = WDT_TIME;
+    batteryVoltage = 0;
+    batteryDivisor = BATTERY_DIVISOR;
+    batteryCycle = 0;
+    batteryThreshold = BATTERY_THRESHOLD;
+    exceptionMode = EXCEPTION_MODE;
+    deltaThreshold = DELTA_THRESHOLD;
+    rateThreshold = RATE_THRESHOLD;
+    leakIntervals = LEAK_INTERVALS;
+    heartbeatIntervals = HEARTBEAT_INTERVALS;
+    flowIntervals = 0;
+    quietIntervals = 0;
+    fineEnable = FINE_TIMING;
+    pulseClock = 0;
+    lastPulseTime = 0;
+    for (uint8_t i=0; i < HISTOGRAM_BINS; i++) histogram[i] = 0;
+    for (uint8_t i=0; i < HISTORY_SIZE; i++) history[i] = 0;
+    historyNext = 0;
+    historyRequest = 0;
 
 /* Initialise hardware. */
 /* This has a GOTO label to allow internal soft reset without losing count. */
@@ -168,21 +238,17 @@ event. */
     coordinatorAddress16[0] = 0xFE;
     coordinatorAddress16[1] = 0xFF;
 
+    associated = false;
     resetXBee();
     wakeXBee();
-/* Idle and blink the test pin for 12 seconds to give XBee time to associate. */
-    uint8_t i = 0;
-    for (i=0; i<60; i++)
-    {
+/* Idle with the test pin on until the XBee signals that it has associated. */
 #ifdef TEST_PORT_DIR
-        sbi(TEST_PORT,TEST_PIN);
+    sbi(TEST_PORT,TEST_PIN);
 #endif
-        _delay_ms(100);
+    waitAssociation(ASSOCIATION_TICKS);
 #ifdef TEST_PORT_DIR
-        cbi(TEST_PORT,TEST_PIN);
+    cbi(TEST_PORT,TEST_PIN);
 #endif
-        _delay_ms(100);
-    }
 /* Blink debug port to indicated ready */
 #ifdef DEBUG_PORT_DIR
     sbi(DEBUG_PORT,DEBUG_PIN);          /* Blink debug LED */
@@ -202,6 +268,11 @@ event. */
     wdtCounter = 0;
     stayAwake = XBEE_STAY_AWAKE;
     transmitMessage = false;
+    intervalEnd = false;
+    intervalCount = 0;
+    pulseSeen = false;
+    fineTiming = false;
+    deltaReported = false;
 
 /* Turn off until some counts start to arrive */
     if (!stayAwake) sleepXBee();
@@ -213,6 +284,11 @@ reset-after-interrupt was enabled. This will prevent a reset from occurring
 unless the MCU has lost its way. */
         sbi(WDTCSR,WDIE);
         sei();
+/* Checkpoint the unacknowledged count to EEPROM once enough counts have
+accumulated, to limit EEPROM writes. */
+        if ((counter - journalCount) >= JOURNAL_THRESHOLD)
+            journalCheckpoint(counter);
+        fineTimingControl();
 /* On waking, note the count, wait a bit, and check if it has advanced. If
 not, return to sleep. Otherwise keep awake until the counts have settled.
 This will avoid rapid wake/sleep cycles when counts are changing. */
@@ -223,6 +299,26 @@ This will avoid rapid wake/sleep cycles when counts are changing. */
             lastCount = counter;    /* Counter is global, changed in the ISR. */
             if (sleepDelay > 10) sleepDelay = 0;
 
+/* Decide if a report is to be made. Normally this is at the end of each wake
+interval. In report-by-exception mode a report is made only when required, or
+immediately when the unreported count passes the delta threshold. */
+            if (intervalEnd)
+            {
+                intervalEnd = false;
+                if ((! exceptionMode) || reportRequired()) transmitMessage = true;
+/* Keep the count of each interval so that the base station can ask for any
+that it missed. */
+                history[historyNext] = intervalCount;
+                if (++historyNext >= HISTORY_SIZE) historyNext = 0;
+                intervalCount = 0;
+            }
+            if (exceptionMode && (deltaThreshold > 0) && (! deltaReported) &&
+                (lastCount >= deltaThreshold))
+            {
+                deltaReported = true;
+                transmitMessage = true;
+            }
+
 /* Check for and deal with any extra messages that have arrived while the node
 was awake or between transmissions. */
             if (! transmitMessage)
@@ -232,7 +328,7 @@ was awake or between transmissions. */
             }
 /* Any interrupt will wake the AVR. If it is a WDT timer overflow event,
 8 seconds will be too short to do anything useful, so go back to sleep again
-until enough such events have occurred. The WDT ISR will set transmitMessage
+until enough such events have occurred. The WDT ISR will set intervalEnd
 when the conditions are satisfied. */
             else
             {
@@ -241,6 +337,14 @@ when the conditions are satisfied. */
                 sbi(TEST_PORT,TEST_PIN);            /* Set test pin on */
 #endif
                 wdtCounter = 0;     /* Reset the WDT counter for next time */
+/* Take the interval histogram for this report and start a new one. */
+                cli();
+                for (uint8_t i=0; i < HISTOGRAM_BINS; i++)
+                {
+                    reportHistogram[i] = histogram[i];
+                    histogram[i] = 0;
+                }
+                sei();
 /* Now ready to initiate a data transmission. */
 /* Power up only essential peripherals for transmission of results. */
                 powerUp();
@@ -250,37 +354,32 @@ when the conditions are satisfied. */
 until the transmission has been completed or abandoned. */
                 uint8_t retryCount = 0;
                 bool retryEnable = true;            /* Allows a retry to occur */
-                bool associated = false;
-                bool batteryCheckOK = false;        /* Got back valid response to IS command */
+/* The battery is read only every batteryDivisor cycles, or on every cycle
+once the reading has fallen below the threshold. Otherwise the last reading is
+sent again. */
+                bool batteryCheckOK = ((batteryCycle > 0) &&
+                                       (batteryVoltage >= batteryThreshold));
+                if (++batteryCycle >= batteryDivisor) batteryCycle = 0;
                 bool ack = false;                   /* received ACK from coordinator */
                 bool nak = false;                   /* received NAK from coordinator */
-                bool delivery = false;              /* Signalled as not delivered */
+                bool mail = false;                  /* coordinator has messages waiting */
+                uint8_t delivery = DELIVERY_UNKNOWN;    /* Last Tx Status code */
                 uint16_t timeoutDelay = 0;
-                uint32_t batteryVoltage = 0;
                 bool cycleComplete = false;
                 rxFrameType inMessage;              /* Received data frame */
                 txStage stage = associationCheck;
                 packet_error packetError = unknown_error;
                 while (! cycleComplete)
                 {
-/* Wait if not associated. After forty tries (12 seconds), sleep for a while. */
+/* Wait if not associated. The association state is remembered between cycles
+and is only lost through a modem status frame or a failed delivery, so normally
+this passes straight through. If association doesn't occur, carry on anyway and
+let the transmit stage sort it out. */
                     if (stage == associationCheck)
                     {
-                        if (associated || (retryCount > 40))
-                        {
-                            retryCount = 0;
-                            stage = batteryCheck;
-                        }
-                        else
-                        {
-                            timeoutDelay = 300;
-                            if (retryEnable)
-                            {
-                                sendATFrame(2,"AI");
-                                retryCount++;
-                            }
-                        }
-                        retryEnable = true;
+                        if (! associated) waitAssociation(ASSOCIATION_TICKS);
+                        retryCount = 0;
+                        stage = batteryCheck;
                     }
 /* Read the battery voltage from the XBee. If not successful, just give up and go on. */
                     if (stage == batteryCheck)
@@ -322,6 +421,9 @@ until the transmission has been completed or abandoned. */
 /* Subtract the transmitted count from the current counter value. */
                             counter -= lastCount;
                             lastCount = 0;
+                            journalCheckpoint(counter);
+                            quietIntervals = 0;
+                            deltaReported = false;
                             retryCount = 0;
                             cycleComplete = true;
                         }
@@ -329,6 +431,15 @@ until the transmission has been completed or abandoned. */
                         else if (retryCount > 3)
                         {
                             sendMessage("X");
+                            journalCheckpoint(counter);
+/* Put back the unreported histogram to go with the unreported count. */
+                            cli();
+                            for (uint8_t i=0; i < HISTOGRAM_BINS; i++)
+                            {
+                                uint16_t sum = histogram[i] + reportHistogram[i];
+                                histogram[i] = (sum > 0xFF) ? 0xFF : sum;
+                            }
+                            sei();
                             _delay_ms(100);     /* Give time for message to go */
                             goto RES;           /* Soft reset the Node */
                         }
@@ -338,6 +449,18 @@ until the transmission has been completed or abandoned. */
                             timeoutDelay = 2000;
                             if (retryEnable)
                             {
+/* A failed delivery may mean that association was lost, so check it now. */
+                                if (! associated) waitAssociation(ASSOCIATION_TICKS);
+/* Hold a retry back for a random time so that nodes that collided do not
+collide again. */
+                                if (retryCount > 0)
+                                    for (uint16_t i = randomJitter(); i > 0; i--)
+                                    {
+                                        _delay_ms(1);
+                                        sbi(WDTCSR,WDIE);
+                                    }
+/* A retry goes again with the sequence number of the report in flight. */
+                                transportRewind(&reportWindow);
                                 uint32_t parameter = retryCount;
                                 uint8_t txCommand = 'C';
                                 if (packetError == timeout) txCommand = 'T';
@@ -348,16 +471,19 @@ until the transmission has been completed or abandoned. */
                                     txCommand = 'E';
                                 }
                                 if (nak) txCommand = 'N';
-/* Last attempt was a failed delivery */
-                                if (delivery > 0)
+/* Last attempt was a failed delivery, sent with its status code */
+                                if ((delivery > 0) && (delivery != DELIVERY_UNKNOWN))
                                 {
                                     parameter = delivery;
                                     txCommand = 'S';
                                 }
-/* Data word has count 16 bits, voltage 10 bits, status 6 bits */
-                                sendDataCommand(txCommand, 0,
-                                    lastCount+((batteryVoltage & 0x3FF)<<16)+
-                                    ((parameter & 0x3F)<<26));
+/* Data word has count 16 bits, voltage 10 bits, status 6 bits. A report that
+could not be queued is still held with its count, and goes again as a retry
+after a short wait rather than the full response time. */
+                                if (! sendReport(txCommand,
+                                    lastCount+(((uint32_t)batteryVoltage & 0x3FF)<<16)+
+                                    ((parameter & 0x3F)<<26)))
+                                    timeoutDelay = FRAME_DELAY;
                                 retryCount++;
                             }
                             retryEnable = true;
@@ -378,13 +504,10 @@ until the transmission has been completed or abandoned. */
                                 packetError = frame_error;
                             else
                             {
-/* Association Indication */
+/* Association Indication, already dealt with in interpretMessage. */
                                 if ((inMessage.message.atResponse.atCommand1 == 'A') && \
                                     (inMessage.message.atResponse.atCommand2 == 'I'))
-                                {
-                                    if (stage != associationCheck) retryEnable = false;
-                                    associated = (inMessage.message.atResponse.data[0] == 0);
-                                }
+                                    retryEnable = false;
 /* Battery Voltage Measurement */
                                 if ((inMessage.message.atResponse.atCommand1 == 'I') && \
                                     (inMessage.message.atResponse.atCommand2 == 'S'))
@@ -397,15 +520,26 @@ until the transmission has been completed or abandoned. */
                                 }
                             }
                             break;
-/* Status of previous transmission attempt. */
+/* Status of previous transmission attempt. Only the status of a report in flight
+is taken, as that of the final response to an earlier cycle or of a mailbox
+response may arrive late. The frame ID tells them apart. */
                         case TX_STATUS:
-                            delivery = inMessage.message.txStatus.deliveryStatus;
+                            if (transportStatus(&reportWindow,
+                                    inMessage.message.txStatus.frameID) >= 0)
+                            {
+                                delivery = inMessage.message.txStatus.deliveryStatus;
+                                if (delivery > 0) associated = false;
+                            }
                             retryEnable = false;
                             break;
 /* Receive Packet. This can be of a variety of types. */
                         case RX_PACKET:
                             {
                                 uint8_t rxCommand = inMessage.message.rxPacket.data[0];
+/* Broadcasts, such as firmware records for nodes being updated, are not meant
+for this protocol and are ignored. */
+                                if (inMessage.message.rxPacket.options & RX_BROADCAST)
+                                    break;
                                 if (stage == transmit)
                                 {
 /* Check if the first character in the data field is an ACK or NAK.
@@ -413,8 +547,15 @@ These messages are ONLY valid in the transmit stage and could confuse the
 protocol in other stages. */
 /* Base station picked up an error in the previous response and sent a NAK. */
                                     if (rxCommand == 'N') nak = true;
-/* Got an ACK: aaaah that feels good. */
-                                    else if (rxCommand == 'A') ack = true;
+/* Got an ACK: aaaah that feels good. Any options that follow are applied. An
+ACK to an earlier report that has arrived late leaves this one in flight, so
+the wait goes on. */
+                                    else if (rxCommand == 'A')
+                                    {
+                                        mail = interpretAck(&inMessage);
+                                        ack = (transportPending(&reportWindow) == 0);
+                                        if (! ack) retryEnable = false;
+                                    }
 /* Otherwise report an error in the command field. */
                                     else packetError = command_error;
                                 }
@@ -425,6 +566,21 @@ protocol in other stages. */
                     }
                 }
 /* Cycle Complete */
+/* Send the interval history if the base station found reports missing. */
+                if (historyRequest > 0)
+                {
+                    sendHistory(historyRequest);
+                    historyRequest = 0;
+                }
+/* Stay awake for any messages from the mailbox. These are delivered one at a
+time as each is answered, and are acted on in interpretMessage(). Once none has
+come for a while the node goes back to sleep. */
+                if (mail)
+                {
+                    uint8_t mailCount = 0;
+                    while ((mailCount++ < MAIL_MESSAGES) &&
+                        (interpretMessage(MAIL_WAIT, true, &inMessage) != timeout));
+                }
             }
 /* Delay here to prevent sleep mode from occurring until counts have settled.
 Count period is typically less than 10ms. */
@@ -457,6 +613,11 @@ Count period is typically less than 10ms. */
 Checks for a message received and interprets it to deal with certain cases
 needing action independently of the transmit cycle, or ignoring.
 
+The association state is tracked here from modem status frames and from any
+AI command response.
+
+Globals: associated.
+
 @param[in] rxFrameType* inMessage: The received frame with the message.
 @returns packet_error packetError: Error code.
 */
@@ -468,10 +629,24 @@ packet_error interpretMessage(uint16_t timeoutDelay, bool wait, rxFrameType* inM
     {
         switch (inMessage->frameType)
         {
-/* Irrelevant message types that can be ignored. */
+/* The XBee notifies changes to its network state. Otherwise irrelevant. */
         case MODEM_STATUS:
+            if (inMessage->message.modemStatus.status == JOINED_NETWORK)
+                associated = true;
+            else if ((inMessage->message.modemStatus.status == HARDWARE_RESET) ||
+                     (inMessage->message.modemStatus.status == WATCHDOG_RESET) ||
+                     (inMessage->message.modemStatus.status == DISASSOCIATED))
+                associated = false;
             packetError = modem_status;
             break;
+/* Association Indication. The response is passed on for further use. */
+        case AT_COMMAND_RESPONSE:
+            if ((inMessage->message.atResponse.atCommand1 == 'A') &&
+                (inMessage->message.atResponse.atCommand2 == 'I') &&
+                (inMessage->message.atResponse.status == 0))
+                associated = (inMessage->message.atResponse.data[0] == 0);
+            break;
+/* Irrelevant message types that can be ignored. */
         case NODE_IDENT:
             packetError = node_ident;
             break;
@@ -487,7 +662,23 @@ action. */
                 uint8_t rxCommand = inMessage->message.rxPacket.data[0];
                 if (rxCommand == 'D')
                 {
-                    interpretCommand(inMessage);
+                    interpretCommand(inMessage->message.rxPacket.data,
+                                     inMessage->length-12);
+                    packetError = no_error;
+                }
+/* A command too long for one frame comes in fragments, and is acted on once
+all have arrived. */
+                else if (rxCommand == FRAGMENT_MARK)
+                {
+                    cli();
+                    uint16_t now = timeTicks;
+                    sei();
+                    int16_t length = fragmentReceive(&commandFragments,
+                                        inMessage->length-12,
+                                        inMessage->message.rxPacket.data,
+                                        now, FRAGMENT_TIMEOUT);
+                    if ((length > 0) && (commandFragments.data[0] == 'D'))
+                        interpretCommand(commandFragments.data, length);
                     packetError = no_error;
                 }
             }
@@ -508,16 +699,28 @@ the third is a parameter. This is followed by further parameters.
 
 Type 'P' parameter change/report
 - 'W' wake time followed by the time in hexadecimal.
+- 'B' number of cycles between battery readings, in hexadecimal.
+- 'V' battery reading below which it is read every cycle, in hexadecimal.
+- 'E' report-by-exception mode, 1 on, 0 off.
+- 'D' unreported count that forces a report in exception mode.
+- 'R' count in one wake interval that forces a report in exception mode.
+- 'L' wake intervals of continuous flow that are reported as a leak.
+- 'H' wake intervals between heartbeat reports in exception mode.
+- 'F' fine timing of pulse intervals, 1 on, 0 off.
+All values are in hexadecimal. A threshold of zero disables that check.
 Type 'X' action
 - 'W' stay awake.
 - 'S' sleep.
 
-Globals: all changeable parameters: stayAwake, wakeInterval.
+Globals: all changeable parameters: stayAwake, wakeInterval, batteryDivisor,
+batteryThreshold, exceptionMode, deltaThreshold, rateThreshold, leakIntervals,
+heartbeatIntervals, fineEnable.
 
-@param[in] rxFrameType* inMessage: The received frame with the message.
+@param[in] uint8_t* data: The command message, starting with 'D'.
+@param[in] uint8_t length: Length of the message.
 */
 
-void interpretCommand(rxFrameType* inMessage)
+void interpretCommand(const uint8_t* data, const uint8_t length)
 {
     char response[13];
 /* Blink debug port to indicated ready */
@@ -526,22 +729,76 @@ void interpretCommand(rxFrameType* inMessage)
     _delay_ms(100);
     cbi(DEBUG_PORT,DEBUG_PIN);
 #endif
-    uint8_t nodeCommand = inMessage->message.rxPacket.data[1];
-    uint8_t parameter = inMessage->message.rxPacket.data[2];
-/* Interpret a 'Parameter Read/Change' command. */
+    uint8_t nodeCommand = data[1];
+    uint8_t parameter = data[2];
+/* Interpret a 'Parameter Read/Change' command. A value is only changed if one
+was given, otherwise the current value is just sent back. */
     if (nodeCommand == 'P')
     {
+        bool change = (length > 3);
+        uint16_t value = stringToHex(length-3, data+3);
 /* Wakeup time interval. Send back value and/or change.  */
         if (parameter == 'W')
         {
-            uint16_t newWakeInterval = stringToHex(inMessage->length-15,
-                                            inMessage->message.rxPacket.data+3);
-            if (newWakeInterval > 0)
+            if (value > 0)
             {
-                wakeInterval = newWakeInterval;
+                wakeInterval = value;
             }
             sendDataCommand(nodeCommand, parameter, wakeInterval);
         }
+/* Battery reading interval in cycles. Zero or one reads every cycle. */
+        else if (parameter == 'B')
+        {
+            if (change)
+            {
+                batteryDivisor = value;
+                batteryCycle = 0;
+            }
+            sendDataCommand(nodeCommand, parameter, batteryDivisor);
+        }
+/* Battery low threshold as a raw reading. Zero disables. */
+        else if (parameter == 'V')
+        {
+            if (change) batteryThreshold = value;
+            sendDataCommand(nodeCommand, parameter, batteryThreshold);
+        }
+/* Report-by-exception mode and its thresholds. */
+        else if (parameter == 'E')
+        {
+            if (change)
+            {
+                exceptionMode = (value > 0);
+                flowIntervals = 0;
+                quietIntervals = 0;
+            }
+            sendDataCommand(nodeCommand, parameter, exceptionMode);
+        }
+        else if (parameter == 'D')
+        {
+            if (change) deltaThreshold = value;
+            sendDataCommand(nodeCommand, parameter, deltaThreshold);
+        }
+        else if (parameter == 'R')
+        {
+            if (change) rateThreshold = value;
+            sendDataCommand(nodeCommand, parameter, rateThreshold);
+        }
+        else if (parameter == 'L')
+        {
+            if (change) leakIntervals = value;
+            sendDataCommand(nodeCommand, parameter, leakIntervals);
+        }
+        else if (parameter == 'H')
+        {
+            if (change) heartbeatIntervals = value;
+            sendDataCommand(nodeCommand, parameter, heartbeatIntervals);
+        }
+/* Fine pulse timing. When off, intervals are timed in normal WDT ticks. */
+        else if (parameter == 'F')
+        {
+            if (change) fineEnable = (value > 0);
+            sendDataCommand(nodeCommand, parameter, fineEnable);
+        }
     }
 /* Keep XBee awake until further notice for possible reconfiguration. */
     else if (nodeCommand == 'X')
@@ -562,6 +819,226 @@ void interpretCommand(rxFrameType* inMessage)
     }
 }
 
+/****************************************************************************/
+/** @brief Interpret the Options Carried in an ACK.
+
+The ACK command and the echoed report command may be followed by options, each
+a tag character, a hex digit giving the number of characters in the value, then
+the value in hex. Unknown tags are skipped.
+
+- 'M' messages are waiting in the base station mailbox.
+- 'W' wake time in WDT ticks.
+- 'A' keep the XBee awake, 1 on, 0 off.
+- 'B' number of cycles between battery readings.
+- 'T' time in seconds.
+- 'O' WDT counter value, which moves the next report into the node's slot.
+- 'Q' sequence number of the last report received in order, acknowledging it
+  and all before it. An ACK without it acknowledges all reports in flight.
+- 'H' number of past intervals whose counts are to be sent once the cycle is
+  complete.
+
+Globals: wakeInterval, stayAwake, batteryDivisor, batteryCycle, timeBase,
+timeTicks, wdtCounter, reportWindow, historyRequest.
+
+@param[in] rxFrameType* inMessage: The received frame with the ACK.
+@returns bool: true if messages are waiting in the mailbox.
+*/
+
+bool interpretAck(rxFrameType* inMessage)
+{
+    bool mail = false;
+    bool sequenced = false;
+    uint8_t *data = inMessage->message.rxPacket.data;
+    uint8_t length = inMessage->length - 12;
+    uint8_t i = 2;
+    while (i+2 <= length)
+    {
+        uint8_t tag = data[i];
+        uint8_t size = stringToHex(1, data+i+1);
+        i += 2;
+        if (i+size > length) break;
+        uint16_t value = stringToHex(size, data+i);
+        if (tag == 'M') mail = true;
+        else if ((tag == 'W') && (value > 0)) wakeInterval = value;
+        else if (tag == 'A') stayAwake = (value > 0);
+        else if (tag == 'B')
+        {
+            batteryDivisor = value;
+            batteryCycle = 0;
+        }
+        else if ((tag == 'T') && (size > 4))
+        {
+            cli();
+            timeBase = ((uint32_t)stringToHex(size-4, data+i) << 16) +
+                       stringToHex(4, data+i+size-4);
+            timeTicks = 0;
+            sei();
+        }
+        else if ((tag == 'O') && (value < wakeInterval))
+        {
+            cli();
+            wdtCounter = value;
+            sei();
+        }
+        else if (tag == 'Q')
+        {
+            transportAck(&reportWindow, value);
+            sequenced = true;
+        }
+        else if (tag == 'H')
+            historyRequest = (value > HISTORY_SIZE) ? HISTORY_SIZE : value;
+        i += size;
+    }
+    if (! sequenced) transportAck(&reportWindow, reportWindow.next-1);
+    return mail;
+}
+
+/****************************************************************************/
+/** @brief Random Delay for a Retry.
+
+A 16 bit Galois LFSR gives a delay of up to RETRY_JITTER ms. It is seeded from
+the count, battery reading and journal sequence, which differ between nodes
+even when they were all started together.
+
+Globals: lfsr, counter, batteryVoltage, journalSequence.
+
+@returns uint16_t: delay in ms.
+*/
+
+uint16_t randomJitter(void)
+{
+    if (lfsr == 0)
+    {
+        lfsr = (uint16_t)counter ^ batteryVoltage ^ (journalSequence << 4);
+        if (lfsr == 0) lfsr = 0xACE1;
+    }
+    lfsr = (lfsr >> 1) ^ (-(lfsr & 1) & 0xB400);
+    return lfsr & RETRY_JITTER;
+}
+
+/****************************************************************************/
+/** @brief Switch between Fine and Normal Pulse Timing
+
+Pulse intervals are timed by the WDT. When counts start to arrive the WDT is
+switched to a short fine tick so that intervals can be resolved. Once no count
+has arrived for FINE_TIMING_SPAN fine ticks, the normal tick is restored. The
+WDT ISR keeps the normal tick count going while on the fine tick. The part of a
+normal tick already elapsed at each switch is lost from the wake interval.
+
+Globals: pulseSeen, fineEnable, fineTiming, fineTicks, pulseClock,
+lastPulseTime, wdtTick.
+*/
+
+void fineTimingControl(void)
+{
+    cli();
+    bool seen = pulseSeen;
+    pulseSeen = false;
+    uint16_t sincePulse = pulseClock - lastPulseTime;
+    sei();
+    if (seen && fineEnable && (! fineTiming) && (wdtTick > FINE_WDT_TIME))
+    {
+        cli();
+        fineTiming = true;
+        fineTicks = 0;
+        wdtInit(FINE_WDT_TIME, true);
+    }
+    else if (fineTiming && (! seen) &&
+             ((sincePulse >= FINE_TIMING_SPAN) || (! fineEnable)))
+    {
+        cli();
+        fineTiming = false;
+        wdtInit(wdtTick, true);
+    }
+}
+
+/****************************************************************************/
+/** @brief Decide if a Report is Required in Report-by-Exception Mode
+
+Called at the end of each wake interval. A report is required if the flow rate
+(counts in the interval) reaches its threshold, if counts have occurred in
+every one of the last leakIntervals intervals (a possible leak), or if no
+report has been made for heartbeatIntervals intervals. A threshold or interval
+count of zero disables that test.
+
+Globals: intervalCount, flowIntervals, quietIntervals and the thresholds.
+
+@returns bool: true if a report should be made.
+*/
+
+bool reportRequired(void)
+{
+    uint16_t count = intervalCount;
+    bool required = false;
+    if ((rateThreshold > 0) && (count >= rateThreshold)) required = true;
+    if (count > 0) flowIntervals++;
+    else flowIntervals = 0;
+    if ((leakIntervals > 0) && (flowIntervals >= leakIntervals))
+    {
+        flowIntervals = 0;
+        required = true;
+    }
+    if ((heartbeatIntervals > 0) && (++quietIntervals >= heartbeatIntervals))
+        required = true;
+    return required;
+}
+
+/****************************************************************************/
+/** @brief Wait for the XBee to Associate
+
+The XBee is queried once with an AI command, then the MCU idles until the AI
+response or a modem status frame shows that the XBee has joined the network.
+These are picked up by interpretMessage() which sets the association state.
+The idle sleep is broken by each received character and by the WDT, so the
+wait is limited to a number of WDT ticks.
+
+Globals: associated, wdtTicks.
+
+@param[in] uint8_t ticks: maximum number of WDT ticks to wait.
+*/
+
+void waitAssociation(const uint8_t ticks)
+{
+    rxFrameType inMessage;
+    sendATFrame(2,"AI");
+    wdtTicks = 0;
+    while ((! associated) && (wdtTicks < ticks))
+    {
+        if (interpretMessage(FRAME_DELAY, false, &inMessage) == no_character)
+            idleSleep();
+/* Prevent the WDT from resetting the MCU (see main loop). */
+        sbi(WDTCSR,WDIE);
+    }
+}
+
+/****************************************************************************/
+/** @brief Idle the MCU until the next Interrupt
+
+The UART receive, WDT and counter interrupts will all wake the MCU from idle
+mode. Interrupts are held off while the receive buffer is checked so that a
+character arriving just before the sleep instruction is not missed.
+
+Without receive interrupts the UART cannot wake the MCU, so just delay.
+*/
+
+void idleSleep(void)
+{
+#ifdef USE_RECEIVE_INTERRUPTS
+    cli();
+    if (! uartCharAvailable())
+    {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
+#else
+    _delay_ms(1);
+#endif
+}
+
 /****************************************************************************/
 /** @brief Pull in a Received Data Message from the XBee.
 
@@ -609,6 +1086,9 @@ the base station response. Otherwise continue waiting. */
         else
         {
             _delay_ms(1);       /* one ms delay to provide precise timing */
+/* The wait may span many fine WDT ticks, so keep the WDT from resetting the MCU
+(see main loop). */
+            sbi(WDTCSR,WDIE);
             if (timeResponse++ > timeoutDelay)
             {
                 packetError = timeout;
@@ -644,18 +1124,88 @@ void sendDataCommand(const uint8_t command, const uint8_t parameter, const uint3
     sendMessage(buffer);
 }
 
+/****************************************************************************/
+/** @brief Send a Report with the Interval Histogram
+
+The data word is sent as for sendDataCommand() with the command character, and
+is followed by the inter-pulse interval histogram: a checksum in two hex
+characters then each bin count in two hex characters. The checksum is the 8-bit
+negated sum of the bins as for the data word.
+
+The report is sent as the next frame of the report transport window, which
+puts its sequence number after the command character. Only one report is sent
+in each cycle, and the window is rewound before each attempt.
+
+Globals: reportHistogram, reportWindow.
+
+@param[in] int8_t command: ASCII command character to prepend to message.
+@param[in] int32_t datum: integer value to be sent.
+@returns bool: true if the report was sent, false if it could not be queued.
+*/
+
+bool sendReport(const uint8_t command, const uint32_t datum)
+{
+    char buffer[12+2+2*HISTOGRAM_BINS];
+    buffer[0] = command;
+    hexToString(datum, buffer, 10);
+    char checksum = 0;
+    uint8_t i;
+    for (i = 0; i < HISTOGRAM_BINS; i++)
+    {
+        checksum -= reportHistogram[i];
+        buffer[13+2*i] = "0123456789ABCDEF"[reportHistogram[i] >> 4];
+        buffer[14+2*i] = "0123456789ABCDEF"[reportHistogram[i] & 0x0F];
+    }
+    buffer[11] = "0123456789ABCDEF"[(checksum >> 4) & 0x0F];
+    buffer[12] = "0123456789ABCDEF"[checksum & 0x0F];
+    buffer[13+2*HISTOGRAM_BINS] = 0;
+    return transportSend(&reportWindow, coordinatorAddress64, coordinatorAddress16,
+                         strlen(buffer), (uint8_t*)buffer);
+}
+
 /****************************************************************************/
 /** @brief Send a string message
 
-Send a string message.
+Send a string message. One too long for a frame is sent in fragments.
 
 @param[in]  uint8_t* data: pointer to a string of data (ending in 0).
 */
 
 void sendMessage(const char* data)
 {
-    sendTxRequestFrame(coordinatorAddress64, coordinatorAddress16,0,
-                       strlen(data),(uint8_t*)data);
+    sendFragments(coordinatorAddress64, coordinatorAddress16,
+                  strlen(data),(uint8_t*)data);
+}
+
+/****************************************************************************/
+/** @brief Send the Counts of Past Wake Intervals
+
+The message is 'H', the number of intervals in two hex characters, then the
+count of each interval in four hex characters, the most recent first. The most
+recent is the interval just reported.
+
+Globals: history, historyNext.
+
+@param[in] uint8_t intervals: number of intervals to send.
+*/
+
+void sendHistory(const uint8_t intervals)
+{
+    char buffer[3+4*HISTORY_SIZE+1];
+    uint8_t n = (intervals > HISTORY_SIZE) ? HISTORY_SIZE : intervals;
+    buffer[0] = 'H';
+    buffer[1] = "0123456789ABCDEF"[n >> 4];
+    buffer[2] = "0123456789ABCDEF"[n & 0x0F];
+    uint8_t slot = historyNext;
+    for (uint8_t i = 0; i < n; i++)
+    {
+        if (slot == 0) slot = HISTORY_SIZE;
+        uint16_t value = history[--slot];
+        for (uint8_t j = 0; j < 4; j++)
+            buffer[6+4*i-j] = "0123456789ABCDEF"[(value >> 4*j) & 0x0F];
+    }
+    buffer[3+4*n] = 0;
+    sendMessage(buffer);
 }
 
 /****************************************************************************/
@@ -914,7 +1464,22 @@ ISR(COUNT_ISR)
     {
         _delay_us(100);
         countSignal = inbit(COUNT_PORT,COUNT_PIN);
-        if (countSignal > 0) counter++;
+        if (countSignal > 0)
+        {
+            counter++;
+            intervalCount++;
+/* Place the time since the last count into a logarithmic histogram bin. */
+            uint16_t interval = pulseClock - lastPulseTime;
+            lastPulseTime = pulseClock;
+            uint8_t bin = 0;
+            while ((interval > 0) && (bin < HISTOGRAM_BINS-1))
+            {
+                interval >>= 1;
+                bin++;
+            }
+            if (histogram[bin] < 0xFF) histogram[bin]++;
+            pulseSeen = true;
+        }
     }
 }
 
@@ -922,6 +1487,9 @@ ISR(COUNT_ISR)
 /** @brief Interrupt on Watchdog Timer.
 
 Increment the counter to signal state of WDT.
+
+The pulse clock is advanced in fine ticks. When the WDT is running at the fine
+tick, only every so many fine ticks make up a normal tick.
 */
 
 #if (MCU_TYPE==4313)
@@ -930,14 +1498,113 @@ ISR(WDT_OVERFLOW_vect)
 ISR(WDT_vect)
 #endif
 {
+    uint8_t ratio = 1;
+    if (wdtTick > FINE_WDT_TIME) ratio <<= (wdtTick - FINE_WDT_TIME);
+    if (fineTiming)
+    {
+        pulseClock++;
+        timeTicks++;
+        if (++fineTicks < ratio) return;
+        fineTicks = 0;
+    }
+    else
+    {
+        pulseClock += ratio;
+        timeTicks += ratio;
+    }
+    wdtTicks++;
     wdtCounter++;
     if (wdtCounter >= wakeInterval)
     {
-        transmitMessage = true;
+        intervalEnd = true;
         wdtCounter = 0;
     }
 }
 
+/****************************************************************************/
+/** @brief Restore the Count from the EEPROM Journal
+
+The EEPROM is divided into slots each holding a record of a sequence number,
+the unacknowledged count and a check byte. Records are written to successive
+slots to spread the wear. The valid record with the latest sequence number is
+taken as the current count. An erased or partly written record fails the check.
+
+Globals: journalCount, journalSequence, journalSlot.
+
+@returns uint32_t: the count last checkpointed, or zero if none.
+*/
+
+uint32_t journalRestore(void)
+{
+    bool found = false;
+    journalSlot = 0;
+    journalSequence = 0;
+    journalCount = 0;
+    uint8_t slot;
+    for (slot = 0; slot < JOURNAL_SLOTS; slot++)
+    {
+        uint8_t* address = (uint8_t*)(slot*JOURNAL_SLOT);
+        uint16_t sequence = eeprom_read_word((uint16_t*)address);
+        uint32_t count = eeprom_read_dword((uint32_t*)(address+2));
+        if ((eeprom_read_byte(address+6) == journalCheck(sequence, count)) &&
+            ((! found) || ((int16_t)(sequence - journalSequence) > 0)))
+        {
+            found = true;
+            journalSlot = slot;
+            journalSequence = sequence;
+            journalCount = count;
+        }
+    }
+    return journalCount;
+}
+
+/****************************************************************************/
+/** @brief Checkpoint the Count to the EEPROM Journal
+
+A new record is written to the next slot only if the count has changed. The
+check byte is invalidated before the record is written and is set last, so that
+a power failure part way through leaves the previous record as the latest.
+
+Globals: journalCount, journalSequence, journalSlot.
+
+@param[in] uint32_t count: the unacknowledged count.
+*/
+
+void journalCheckpoint(const uint32_t count)
+{
+    if (count == journalCount) return;
+    if (++journalSlot >= JOURNAL_SLOTS) journalSlot = 0;
+    journalSequence++;
+    journalCount = count;
+    uint8_t* address = (uint8_t*)(journalSlot*JOURNAL_SLOT);
+    eeprom_update_byte(address+6, 0xFF);
+    eeprom_update_word((uint16_t*)address, journalSequence);
+    eeprom_update_dword((uint32_t*)(address+2), journalCount);
+    eeprom_update_byte(address+6, journalCheck(journalSequence, journalCount));
+}
+
+/****************************************************************************/
+/** @brief Compute the Check Byte for a Journal Record
+
+This is a CRC-8 over the sequence number and count. The erased value 0xFF is
+never produced so that an erased check byte is always invalid.
+
+@param[in] uint16_t sequence: record sequence number.
+@param[in] uint32_t count: record count.
+@returns uint8_t: check byte.
+*/
+
+uint8_t journalCheck(const uint16_t sequence, const uint32_t count)
+{
+    uint8_t crc = 0;
+    crc = _crc_ibutton_update(crc, sequence & 0xFF);
+    crc = _crc_ibutton_update(crc, sequence >> 8);
+    uint8_t i;
+    for (i = 0; i < 4; i++) crc = _crc_ibutton_update(crc, (count >> (i*8)) & 0xFF);
+    if (crc == 0xFF) crc = 0;
+    return crc;
+}
+
 /****************************************************************************/
 /** @brief Convert Hex ASCII String to Integer.
 
@@ -34,6 +34,62 @@ version     1.0
 //#define ACTION_COUNT    (ACTION_MINUTES*60)/8
 #define ACTION_COUNT            1       /* WDT ticks to wakeup */
 
+/* Number of transmission cycles between battery voltage readings */
+#define BATTERY_DIVISOR         16
+
+/* Raw battery reading below which the battery is read every cycle. 0 disables */
+#define BATTERY_THRESHOLD       0
+
+/* Report-by-exception defaults. Thresholds of zero disable the check. The
+heartbeat is in wake intervals. */
+#define EXCEPTION_MODE          false
+#define DELTA_THRESHOLD         0
+#define RATE_THRESHOLD          0
+#define LEAK_INTERVALS          0
+#define HEARTBEAT_INTERVALS     15
+
+/* Inter-pulse interval histogram. Bin 0 holds intervals under one fine tick,
+bin n holds intervals of 2^(n-1) to 2^n-1 fine ticks and the last bin holds all
+longer intervals. The fine tick is a WDT setting, 0x04 being 0.25 seconds. */
+#define HISTOGRAM_BINS          8
+#define FINE_TIMING             true
+#define FINE_WDT_TIME           0x04
+/* Fine ticks without counts before returning to the normal WDT tick */
+#define FINE_TIMING_SPAN        (1 << (HISTOGRAM_BINS-2))
+
+/* EEPROM journal of the unacknowledged count. Records are written in rotation
+to slots of JOURNAL_SLOT bytes across the whole EEPROM to level the wear. */
+#define JOURNAL_SLOT            8
+#define JOURNAL_SLOTS           ((E2END+1)/JOURNAL_SLOT)
+
+/* Counts to accumulate before a journal checkpoint is written */
+#define JOURNAL_THRESHOLD       16
+
+/* Maximum number of WDT ticks to wait for the XBee to associate */
+#define ASSOCIATION_TICKS       2
+
+/* Time in ms allowed for the remainder of a frame to arrive once started */
+#define FRAME_DELAY             50
+
+/* Largest random delay in ms before a retry, one less than a power of two */
+#define RETRY_JITTER            1023
+
+/* Time in ms to stay awake for each message from the base station mailbox, and
+the most frames to take before sleeping regardless. */
+#define MAIL_WAIT               1000
+#define MAIL_MESSAGES           8
+
+/* Time in fine ticks allowed for all fragments of a command to arrive */
+#define FRAGMENT_TIMEOUT        20
+
+/* Number of past wake intervals whose counts are kept for the base station to
+fill in reports that it missed. */
+#define HISTORY_SIZE            8
+
+/* Delivery status held until the first Tx Status of a report arrives. Zero is
+a successful delivery and the XBee uses no code this high. */
+#define DELIVERY_UNKNOWN        0xFF
+
 /* Time in ms XBee waits before sleeping */
 #define PIN_WAKE_PERIOD         1
 
@@ -177,6 +177,24 @@ unsigned int getchDirect(void)
     return UART_DATA_REG;
 }
 
+/*-----------------------------------------------------------------------------*/
+/* Check if a received character is waiting
+
+This does not remove the character. It allows the caller to decide if it is
+safe to sleep until the next interrupt.
+
+@returns: bool. True if a character can be read.
+*/
+
+bool uartCharAvailable(void)
+{
+#ifdef USE_RECEIVE_BUFFER
+    return buffer_input_available(receiveBuffer);
+#else
+    return ((UART_STATUS_REG & _BV(RECEIVE_COMPLETE_BIT)) > 0);
+#endif
+}
+
 #ifdef USE_RECEIVE_INTERRUPTS
 /*-----------------------------------------------------------------------------*/
 /* Serial Receiver ISR
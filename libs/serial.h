@@ -21,6 +21,8 @@
 #ifndef SERIAL_H
 #define SERIAL_H
 
+#include <stdbool.h>
+
 /* UART Error Definitions. */
 #define NO_DATA                 0x01
 #define BUFFER_OVERFLOW         0x02
@@ -38,6 +40,7 @@ unsigned char getchb(void);
 unsigned int getch(void);
 void sendchDirect(unsigned char c);
 unsigned int getchDirect(void);
+bool uartCharAvailable(void);
 
 #endif
 
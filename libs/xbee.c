@@ -33,6 +33,14 @@ The transmit buffer may not be needed and can be disabled to save space.
 
 /* Global Variables */
 
+static uint8_t lastFrameID;         /* Frame ID of the last frame sent */
+static uint8_t lastMessage;         /* Number of the last fragmented message */
+
+/* Local Prototypes */
+
+static uint8_t nextFrameID(void);
+static uint8_t hexDigit(const uint8_t character);
+
 /****************************************************************************/
 /** @brief Build and transmit a Tx Request frame
 
@@ -43,16 +51,17 @@ A data message for the XBee API is formed and transmitted.
 @param[in]:   uint8_t radius. Broadcast radius or 0 for maximum network value.
 @param[in]:   uint8_t dataLength. Length of data array.
 @param[in]:   uint8_t data[]. Define array size to be greater than length.
+@returns uint8_t: frame ID, to match the TX Status frame returned.
 */
-void sendTxRequestFrame(const uint8_t sourceAddress64[],
-                        const uint8_t sourceAddress16[],
-                        const uint8_t radius, const uint8_t dataLength,
-                        const uint8_t data[])
+uint8_t sendTxRequestFrame(const uint8_t sourceAddress64[],
+                           const uint8_t sourceAddress16[],
+                           const uint8_t radius, const uint8_t dataLength,
+                           const uint8_t data[])
 {
     uint8_t i;
     txFrameType txMessage;
     txMessage.frameType = TX_REQUEST;
-    txMessage.message.txRequest.frameID = 0x02;
+    txMessage.message.txRequest.frameID = nextFrameID();
     txMessage.length = dataLength+14;
     for (i=0; i < 8; i++)
     {
@@ -69,6 +78,7 @@ void sendTxRequestFrame(const uint8_t sourceAddress64[],
         txMessage.message.txRequest.data[i] = data[i];
     }
     sendBaseFrame(txMessage);
+    return txMessage.message.txRequest.frameID;
 }
 
 /****************************************************************************/
@@ -81,12 +91,13 @@ At this stage only a single parameter at most is accepted.
 
 @param[in]:   uint8_t dataLength: the number of elements in the data array.
 @param[in]:   uint8_t data[]: the AT command followed by parameters.
+@returns uint8_t: frame ID, to match the AT Command Response returned.
 */
-void sendATFrame(const uint8_t dataLength, const char data[])
+uint8_t sendATFrame(const uint8_t dataLength, const char data[])
 {
     txFrameType atFrame;
     atFrame.frameType = AT_COMMAND;
-    atFrame.message.atCommand.frameID = 0x03;
+    atFrame.message.atCommand.frameID = nextFrameID();
     atFrame.length = 4;
     atFrame.message.atCommand.atCommand1 = data[0];
     atFrame.message.atCommand.atCommand2 = data[1];
@@ -96,6 +107,7 @@ void sendATFrame(const uint8_t dataLength, const char data[])
         atFrame.length++;
     }
     sendBaseFrame(atFrame);
+    return atFrame.message.atCommand.frameID;
 }
 
 /****************************************************************************/
@@ -369,3 +381,260 @@ uint16_t getXBeeADC(uint8_t* data, uint8_t adcPort)
     return value;
 }
 
+
+/****************************************************************************/
+/** @brief Start a transport window
+
+@param[out] transportWindow *window: window to start.
+@param[in] uint8_t sequence: sequence number of the first frame.
+*/
+
+void transportInit(transportWindow *window, const uint8_t sequence)
+{
+    window->base = sequence;
+    window->next = sequence;
+    uint8_t i;
+    for (i = 0; i < TRANSPORT_WINDOW; i++) window->frameID[i] = 0;
+}
+
+/****************************************************************************/
+/** @brief Number of frames sent and not yet acknowledged
+
+@param[in] transportWindow *window: transport window.
+@returns uint8_t frames in flight.
+*/
+
+uint8_t transportPending(const transportWindow *window)
+{
+    return (uint8_t)(window->next - window->base);
+}
+
+/****************************************************************************/
+/** @brief Send the next frame of a transport window
+
+The sequence number is inserted as two hex characters after the command
+character at the start of the data. The frame is not sent if the window is
+full or the frame would exceed the RF payload.
+
+@param[in] transportWindow *window: transport window.
+@param[in]:   uint8_t sourceAddress64[]. Address of parent or 0 for coordinator.
+@param[in]:   uint8_t sourceAddress16[].
+@param[in]:   uint8_t dataLength. Length of data array, including the command.
+@param[in]:   uint8_t data[]. Command character followed by the frame data.
+@returns bool: true if the frame was sent.
+*/
+
+bool transportSend(transportWindow *window, const uint8_t sourceAddress64[],
+                   const uint8_t sourceAddress16[], const uint8_t dataLength,
+                   const uint8_t data[])
+{
+    if ((dataLength < 1) || (dataLength+2 > RF_PAYLOAD)) return false;
+    if (transportPending(window) >= TRANSPORT_WINDOW) return false;
+    uint8_t frame[RF_PAYLOAD];
+    uint8_t sequence = window->next;
+    frame[0] = data[0];
+    frame[1] = "0123456789ABCDEF"[sequence >> 4];
+    frame[2] = "0123456789ABCDEF"[sequence & 0x0F];
+    uint8_t i;
+    for (i = 1; i < dataLength; i++) frame[i+2] = data[i];
+    window->frameID[sequence % TRANSPORT_WINDOW] =
+        sendTxRequestFrame(sourceAddress64, sourceAddress16, 0, dataLength+2, frame);
+    window->next++;
+    return true;
+}
+
+/****************************************************************************/
+/** @brief Match a TX Status frame to a frame in flight
+
+@param[in] transportWindow *window: transport window.
+@param[in] uint8_t frameID: frame ID from the TX Status frame.
+@returns int8_t: position of the frame in the window, oldest first, or -1 if
+         the status is for some other frame.
+*/
+
+int8_t transportStatus(const transportWindow *window, const uint8_t frameID)
+{
+    uint8_t i;
+    for (i = 0; i < transportPending(window); i++)
+    {
+        uint8_t sequence = window->base + i;
+        if (window->frameID[sequence % TRANSPORT_WINDOW] == frameID) return i;
+    }
+    return -1;
+}
+
+/****************************************************************************/
+/** @brief Apply a cumulative acknowledgement
+
+All frames up to and including the sequence number are acknowledged. An
+acknowledgement for a sequence number not in flight is stale and ignored.
+
+@param[in] transportWindow *window: transport window.
+@param[in] uint8_t sequence: last sequence number received in order.
+@returns uint8_t: number of frames newly acknowledged.
+*/
+
+uint8_t transportAck(transportWindow *window, const uint8_t sequence)
+{
+    uint8_t acked = (uint8_t)(sequence - window->base) + 1;
+    if (acked > transportPending(window)) return 0;
+    window->base += acked;
+    return acked;
+}
+
+/****************************************************************************/
+/** @brief Go back to the oldest unacknowledged frame
+
+The application then sends the frames in flight again in order. This follows a
+NAK, a failed delivery or a timeout.
+
+@param[in] transportWindow *window: transport window.
+*/
+
+void transportRewind(transportWindow *window)
+{
+    window->next = window->base;
+}
+
+/****************************************************************************/
+/** @brief Give the next frame ID
+
+Frame IDs roll over from 1 to 255 so that each TX Status or AT Command Response
+can be matched to the frame that caused it. Zero is skipped as it would
+suppress the response.
+
+@returns uint8_t: frame ID.
+*/
+
+static uint8_t nextFrameID(void)
+{
+    if (++lastFrameID == 0) lastFrameID = 1;
+    return lastFrameID;
+}
+
+/****************************************************************************/
+/** @brief Send a message as fragments
+
+A message longer than FRAGMENT_PAYLOAD is split into numbered fragments, each
+FRAGMENT_PAYLOAD long except the last. Each starts with FRAGMENT_MARK and hex
+digits giving the message number, the fragment index and the number of
+fragments. A shorter message is sent whole without a header.
+
+@param[in]:   uint8_t sourceAddress64[]. Address of parent or 0 for coordinator.
+@param[in]:   uint8_t sourceAddress16[].
+@param[in]:   uint8_t dataLength. Length of data array.
+@param[in]:   uint8_t data[]. Message to send.
+@returns uint8_t: number of frames sent, zero if the message is too long.
+*/
+
+uint8_t sendFragments(const uint8_t sourceAddress64[],
+                      const uint8_t sourceAddress16[],
+                      const uint8_t dataLength, const uint8_t data[])
+{
+    if (dataLength <= FRAGMENT_PAYLOAD)
+    {
+        sendTxRequestFrame(sourceAddress64, sourceAddress16, 0, dataLength, data);
+        return 1;
+    }
+    uint8_t count = (dataLength + FRAGMENT_PAYLOAD - 1)/FRAGMENT_PAYLOAD;
+    if (count > FRAGMENT_MAX) return 0;
+    lastMessage = (lastMessage + 1) & 0x0F;
+    uint8_t frame[FRAGMENT_HEADER+FRAGMENT_PAYLOAD];
+    uint8_t index;
+    for (index = 0; index < count; index++)
+    {
+        uint8_t offset = index*FRAGMENT_PAYLOAD;
+        uint8_t length = dataLength - offset;
+        if (length > FRAGMENT_PAYLOAD) length = FRAGMENT_PAYLOAD;
+        frame[0] = FRAGMENT_MARK;
+        frame[1] = "0123456789ABCDEF"[lastMessage];
+        frame[2] = "0123456789ABCDEF"[index];
+        frame[3] = "0123456789ABCDEF"[count];
+        uint8_t i;
+        for (i = 0; i < length; i++) frame[FRAGMENT_HEADER+i] = data[offset+i];
+        sendTxRequestFrame(sourceAddress64, sourceAddress16, 0,
+                           FRAGMENT_HEADER+length, frame);
+    }
+    return count;
+}
+
+/****************************************************************************/
+/** @brief Clear a fragment reassembly buffer
+
+@param[out] fragmentBuffer *buffer: buffer to clear.
+*/
+
+void fragmentInit(fragmentBuffer *buffer)
+{
+    buffer->count = 0;
+    buffer->received = 0;
+    buffer->length = 0;
+}
+
+/****************************************************************************/
+/** @brief Reassemble a fragmented message
+
+Fragments may come in any order and each is placed in the buffer by its index.
+A fragment of another message, or any fragment after the timeout, drops a
+message partly reassembled. A message that would not fit in FRAGMENT_BUFFER is
+dropped. The complete message is left at the start of the buffer data.
+
+@param[in] fragmentBuffer *buffer: reassembly buffer.
+@param[in] uint8_t dataLength: length of the frame data.
+@param[in] uint8_t data[]: frame data starting with FRAGMENT_MARK.
+@param[in] uint16_t now: time in units chosen by the caller.
+@param[in] uint16_t timeout: time allowed for a whole message, same units.
+@returns int16_t: length of the message once complete, zero if more fragments
+         are awaited, or -1 if the fragment was not taken.
+*/
+
+int16_t fragmentReceive(fragmentBuffer *buffer, const uint8_t dataLength,
+                        const uint8_t data[], const uint16_t now,
+                        const uint16_t timeout)
+{
+    if ((dataLength <= FRAGMENT_HEADER) || (data[0] != FRAGMENT_MARK)) return -1;
+    uint8_t message = hexDigit(data[1]);
+    uint8_t index = hexDigit(data[2]);
+    uint8_t count = hexDigit(data[3]);
+    uint8_t length = dataLength - FRAGMENT_HEADER;
+    uint16_t offset = (uint16_t)index*FRAGMENT_PAYLOAD;
+    if ((count == 0) || (count > FRAGMENT_MAX) || (index >= count) ||
+        (length > FRAGMENT_PAYLOAD) ||
+        ((index < count-1) && (length < FRAGMENT_PAYLOAD)) ||
+        (offset + length > FRAGMENT_BUFFER))
+    {
+        fragmentInit(buffer);
+        return -1;
+    }
+    if ((buffer->count > 0) && ((message != buffer->message) ||
+        (count != buffer->count) || ((uint16_t)(now - buffer->started) > timeout)))
+        fragmentInit(buffer);
+    if (buffer->count == 0)
+    {
+        buffer->message = message;
+        buffer->count = count;
+        buffer->started = now;
+    }
+    uint8_t i;
+    for (i = 0; i < length; i++) buffer->data[offset+i] = data[FRAGMENT_HEADER+i];
+    if (index == count-1) buffer->length = offset + length;
+    buffer->received |= (1 << index);
+    if (buffer->received != (uint16_t)((1L << count) - 1)) return 0;
+    int16_t total = buffer->length;
+    fragmentInit(buffer);
+    return total;
+}
+
+/****************************************************************************/
+/** @brief Convert a hex character to its value
+
+@param[in] uint8_t character: ASCII hex digit, upper case.
+@returns uint8_t: value, or 0xFF if not a hex digit.
+*/
+
+static uint8_t hexDigit(const uint8_t character)
+{
+    if ((character >= '0') && (character <= '9')) return character - '0';
+    if ((character >= 'A') && (character <= 'F')) return character - 'A' + 10;
+    return 0xFF;
+}
@@ -44,9 +44,38 @@
 #define IO_DATA_SAMPLE          0x92
 #define NODE_IDENT              0x95
 
+/* Modem Status values */
+#define HARDWARE_RESET          0x00
+#define WATCHDOG_RESET          0x01
+#define JOINED_NETWORK          0x02
+#define DISASSOCIATED           0x03
+
+/* Receive Packet options */
+#define RX_BROADCAST            0x02
+
 /* Serial buffer size */
 #define BUFFER_SIZE 60
 
+/* Reliable transport. Frames to the base carry a sequence number of two hex
+characters following the command character, and are acknowledged cumulatively.
+Up to TRANSPORT_WINDOW frames may be sent before the first is acknowledged. */
+#ifndef TRANSPORT_WINDOW
+#define TRANSPORT_WINDOW        4
+#endif
+
+/* Fragmentation. A message too long for one frame is sent as fragments, each
+starting with FRAGMENT_MARK then hex digits giving the message number, the
+fragment index and the number of fragments. All fragments but the last carry
+FRAGMENT_PAYLOAD bytes. The reassembly buffer sets the longest message that can
+be received and its static RAM cost, and may be changed in project.h. */
+#define FRAGMENT_MARK           '+'
+#define FRAGMENT_HEADER         4
+#define FRAGMENT_PAYLOAD        (RF_PAYLOAD-FRAGMENT_HEADER)
+#define FRAGMENT_MAX            15
+#ifndef FRAGMENT_BUFFER
+#define FRAGMENT_BUFFER         64
+#endif
+
 /* The rxFrameType can be expressed as an Rx Request or AT Command Response frame */
 typedef struct
 {
@@ -114,6 +143,29 @@ typedef struct
     uint8_t checksum;
 } txFrameType;
 
+/* The transportWindow holds the sequence numbers in flight and the frame IDs
+they were last sent with, so that TX Status frames can be matched to them. The
+frame data is kept by the application, which sends the frames again in order
+from the oldest unacknowledged one when the window is rewound. */
+typedef struct
+{
+    uint8_t base;                       /* Oldest unacknowledged sequence */
+    uint8_t next;                       /* Sequence of the next frame sent */
+    uint8_t frameID[TRANSPORT_WINDOW];  /* Frame ID of the last send of each */
+} transportWindow;
+
+/* The fragmentBuffer holds a message being reassembled. The time is given by
+the caller for the timeout. */
+typedef struct
+{
+    uint8_t message;                    /* Message number being reassembled */
+    uint8_t count;                      /* Fragments in it, zero if none */
+    uint16_t received;                  /* Bit for each fragment received */
+    uint16_t length;                    /* Length once the last is received */
+    uint16_t started;                   /* Time the first fragment came */
+    uint8_t data[FRAGMENT_BUFFER];
+} fragmentBuffer;
+
 typedef enum {associationCheck, batteryCheck, transmit} txStage;
 typedef enum {no_error, timeout, unknown_frame_type, checksum_error, frame_error,
               modem_status, node_ident, io_data_sample,
@@ -122,17 +174,32 @@ typedef enum {no_error, timeout, unknown_frame_type, checksum_error, frame_error
 /*----------------------------------------------------------------------*/
 /* Prototypes */
 
-void sendTxRequestFrame(const uint8_t sourceAddress64[],
-                        const uint8_t sourceAddress16[],
-                        const uint8_t radius, const uint8_t dataLength,
-                        const uint8_t data[]);
-void sendATFrame(const uint8_t dataLength, const char data[]);
+uint8_t sendTxRequestFrame(const uint8_t sourceAddress64[],
+                           const uint8_t sourceAddress16[],
+                           const uint8_t radius, const uint8_t dataLength,
+                           const uint8_t data[]);
+uint8_t sendATFrame(const uint8_t dataLength, const char data[]);
 void sendBaseFrame(const txFrameType txMessage);
 uint8_t receiveMessage(rxFrameType *rxMessage, uint8_t *messageState);
 bool checkAssociated(void);
 bool resetXBeeSoft(void);
 int8_t readXBeeIO(uint8_t* data);
 uint16_t getXBeeADC(uint8_t* data, uint8_t adcPort);
+void transportInit(transportWindow *window, const uint8_t sequence);
+uint8_t transportPending(const transportWindow *window);
+bool transportSend(transportWindow *window, const uint8_t sourceAddress64[],
+                   const uint8_t sourceAddress16[], const uint8_t dataLength,
+                   const uint8_t data[]);
+int8_t transportStatus(const transportWindow *window, const uint8_t frameID);
+uint8_t transportAck(transportWindow *window, const uint8_t sequence);
+void transportRewind(transportWindow *window);
+uint8_t sendFragments(const uint8_t sourceAddress64[],
+                      const uint8_t sourceAddress16[],
+                      const uint8_t dataLength, const uint8_t data[]);
+void fragmentInit(fragmentBuffer *buffer);
+int16_t fragmentReceive(fragmentBuffer *buffer, const uint8_t dataLength,
+                        const uint8_t data[], const uint16_t now,
+                        const uint16_t timeout);
 
 #endif
 